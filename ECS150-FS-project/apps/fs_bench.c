@@ -0,0 +1,178 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <crc32c.h>
+#include <disk.h>
+#include <fs.h>
+
+#define bench_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	bench_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+/* Size of every fs_write()/fs_read() call */
+#define CHUNK_SIZE (1 << 20)
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Device time simulated so far, in seconds */
+static double device_time(void)
+{
+	struct block_disk_stats stats;
+
+	if (block_disk_stats(&stats))
+		die("Cannot get disk statistics");
+	return stats.device_ns / 1e9;
+}
+
+/* Checksum throughput of both implementations, in MB/s */
+static void bench_crc32c(void)
+{
+	char *buf = malloc(CHUNK_SIZE);
+	double start, hw, sw;
+	uint32_t crc = 0;
+	int i;
+
+	if (!buf)
+		die_perror("malloc");
+	memset(buf, 0xA5, CHUNK_SIZE);
+
+	start = now();
+	for (i = 0; i < 256; i++)
+		crc = crc32c(crc, buf, CHUNK_SIZE);
+	hw = 256.0 * CHUNK_SIZE / (now() - start) / (1 << 20);
+	start = now();
+	for (i = 0; i < 64; i++)
+		crc = crc32c_sw(crc, buf, CHUNK_SIZE);
+	sw = 64.0 * CHUNK_SIZE / (now() - start) / (1 << 20);
+	free(buf);
+
+	printf("crc32c: %.1f MB/s (%s), %.1f MB/s (table) [%08x]\n", hw,
+	       crc32c_hw() ? "crc32 instruction" : "table", sw, crc);
+}
+
+static void bench_one(const char *diskname, const char *prefix, uint32_t bsize,
+		      size_t file_size, int checksum)
+{
+	struct fs_format_opts opts = {
+		.wide = 1, .block_size = bsize, .checksum = checksum
+	};
+	char *buf = malloc(CHUNK_SIZE);
+	double start, wtime, rtime, dstart, dwtime, drtime;
+	char mountname[4096];
+	size_t done;
+	int fd, ret;
+
+	if (!buf)
+		die_perror("malloc");
+	memset(buf, 0xA5, CHUNK_SIZE);
+
+	if (fs_format(diskname, file_size / bsize + 2, &opts))
+		die("Cannot format %s", diskname);
+	snprintf(mountname, sizeof(mountname), "%s%s", prefix, diskname);
+	if (fs_mount(mountname))
+		die("Cannot mount %s", mountname);
+	if (fs_create("bench") || (fd = fs_open("bench")) < 0)
+		die("Cannot create file");
+
+	start = now();
+	dstart = device_time();
+	for (done = 0; done < file_size; done += ret) {
+		ret = fs_write(fd, buf, CHUNK_SIZE);
+		if (ret <= 0)
+			die("write error at %zu", done);
+	}
+	wtime = now() - start;
+	dwtime = device_time() - dstart;
+
+	fs_lseek(fd, 0);
+	start = now();
+	dstart = device_time();
+	for (done = 0; done < file_size; done += ret) {
+		ret = fs_read(fd, buf, CHUNK_SIZE);
+		if (ret <= 0)
+			die("read error at %zu", done);
+	}
+	rtime = now() - start;
+	drtime = device_time() - dstart;
+
+	fs_close(fd);
+	if (fs_umount())
+		die("Cannot unmount %s", diskname);
+	unlink(diskname);
+	free(buf);
+
+	printf("%6u%c %10.1f %10.1f", bsize, checksum ? 'c' : ' ',
+	       file_size / wtime / (1 << 20), file_size / rtime / (1 << 20));
+	/* Throughput the emulated device would have delivered */
+	if (dwtime > 0 && drtime > 0)
+		printf(" %10.1f %10.1f", file_size / dwtime / (1 << 20),
+		       file_size / drtime / (1 << 20));
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *diskname = "bench.fs";
+	const char *prefix = "";
+	size_t file_size = 64 << 20;
+	uint32_t bsize;
+	int compare = 0, bad = 0, opt;
+
+	/* -c: run every block size again with checksums */
+	while ((opt = getopt(argc, argv, "c")) != -1) {
+		if (opt == 'c')
+			compare = 1;
+		else
+			bad = 1;
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if (argc > 1)
+		diskname = argv[1];
+	if (argc > 2)
+		file_size = (size_t)strtoul(argv[2], NULL, 0) << 20;
+	if (argc > 3)
+		prefix = argv[3];
+	if (bad || !file_size || file_size % CHUNK_SIZE || file_size > FS_FILE_SIZE_MAX)
+		die("Usage: %s [-c] [<scratch disk>] [<file size in MiB, up to 2047>]"
+		    " [<backend prefix, e.g. lat,hdd:>]", argv[0]);
+
+	if (compare)
+		bench_crc32c();
+
+	printf("Sequential %zu MiB file, %d KiB per call\n",
+	       file_size >> 20, CHUNK_SIZE >> 10);
+	printf("%7s %10s %10s", "bsize", "write MB/s", "read MB/s");
+	if (strstr(prefix, "lat") || strstr(diskname, "lat"))
+		printf(" %10s %10s", "dev write", "dev read");
+	printf("\n");
+	for (bsize = 4096; bsize <= 65536; bsize <<= 1) {
+		bench_one(diskname, prefix, bsize, file_size, 0);
+		if (compare)
+			bench_one(diskname, prefix, bsize, file_size, 1);
+	}
+
+	return 0;
+}
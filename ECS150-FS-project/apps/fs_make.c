@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fs.h>
+
+#define fs_make_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_make_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+static void usage(const char *program)
+{
+	fprintf(stderr, "Usage: %s <diskname> <data block count> [-w] [-b <block size>] [-p]"
+	    " [-d <dir blocks>] [-r] [-c] [-z]\n"
+	    "\t-w\twide format (32-bit FAT entries)\n"
+	    "\t-b\tblock size of a wide image, 4096 to 65536\n"
+	    "\t-p\tpreallocate the image instead of leaving it sparse\n"
+	    "\t-d\thashed root directory over that many blocks (wide only)\n"
+	    "\t-r\tkeep block reference counts for clones (wide only)\n"
+	    "\t-c\tkeep block checksums, verified on every read (wide only)\n"
+	    "\t-z\tallow compressed files (wide only)\n", program);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct fs_format_opts opts = { 0 };
+	char *diskname, *end;
+	size_t nblocks;
+	int i;
+
+	if (argc < 3)
+		usage(argv[0]);
+
+	diskname = argv[1];
+	nblocks = strtoul(argv[2], &end, 0);
+	if (*end)
+		usage(argv[0]);
+
+	for (i = 3; i < argc; i++) {
+		if (!strcmp(argv[i], "-w")) {
+			opts.wide = 1;
+		} else if (!strcmp(argv[i], "-p")) {
+			opts.preallocate = 1;
+		} else if (!strcmp(argv[i], "-r")) {
+			opts.refcount = 1;
+		} else if (!strcmp(argv[i], "-c")) {
+			opts.checksum = 1;
+		} else if (!strcmp(argv[i], "-z")) {
+			opts.compress = 1;
+		} else if (!strcmp(argv[i], "-d") && i + 1 < argc) {
+			opts.dir_blocks = strtoul(argv[++i], &end, 0);
+			if (*end)
+				usage(argv[0]);
+		} else if (!strcmp(argv[i], "-b") && i + 1 < argc) {
+			opts.block_size = strtoul(argv[++i], &end, 0);
+			if (*end)
+				usage(argv[0]);
+		} else {
+			usage(argv[0]);
+		}
+	}
+
+	if (fs_format(diskname, nblocks, &opts))
+		die("Cannot create virtual disk");
+
+	printf("Created virtual disk '%s' with '%zu' data blocks\n", diskname,
+	       nblocks);
+
+	return 0;
+}
@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fs.h>
+
+#define fs_pack_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_pack_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+static const char *program;
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: %s <diskname> <host directory> [-n <data block count>] "
+	    "[-j <workers>] [-w] [-b <block size>] [-d <dir blocks>] [-r] [-c]\n"
+	    "\t-n\tdata blocks of the image, default is just enough\n"
+	    "\t-j\tparallel copy threads, default is one per CPU\n"
+	    "\t-w\twide format (32-bit FAT entries)\n"
+	    "\t-b\tblock size of a wide image, 4096 to 65536\n"
+	    "\t-d\thashed root directory over that many blocks (wide only)\n"
+	    "\t-r\tkeep block reference counts for clones (wide only)\n"
+	    "\t-c\tkeep block checksums, verified on every read (wide only)\n",
+	    program);
+	exit(1);
+}
+
+static size_t get_number(const char *arg)
+{
+	char *end;
+	size_t ret = strtoul(arg, &end, 0);
+
+	if (*end)
+		usage();
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct fs_format_opts opts = { 0 };
+	size_t nblocks = 0;
+	int nworkers = 0;
+	int i;
+
+	program = argv[0];
+	if (argc < 3)
+		usage();
+
+	for (i = 3; i < argc; i++) {
+		if (!strcmp(argv[i], "-w"))
+			opts.wide = 1;
+		else if (!strcmp(argv[i], "-r"))
+			opts.refcount = 1;
+		else if (!strcmp(argv[i], "-c"))
+			opts.checksum = 1;
+		else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+			nblocks = get_number(argv[++i]);
+		else if (!strcmp(argv[i], "-j") && i + 1 < argc)
+			nworkers = get_number(argv[++i]);
+		else if (!strcmp(argv[i], "-d") && i + 1 < argc)
+			opts.dir_blocks = get_number(argv[++i]);
+		else if (!strcmp(argv[i], "-b") && i + 1 < argc)
+			opts.block_size = get_number(argv[++i]);
+		else
+			usage();
+	}
+
+	if (fs_pack(argv[1], argv[2], nblocks, &opts, nworkers))
+		die("Cannot pack '%s' into '%s'", argv[2], argv[1]);
+
+	printf("Packed '%s' into virtual disk '%s'\n", argv[2], argv[1]);
+
+	return 0;
+}
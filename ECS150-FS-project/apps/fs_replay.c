@@ -0,0 +1,277 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+#include <trace.h>
+
+#define replay_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	replay_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+/* Latencies of the replayed calls of one operation */
+struct op_stats {
+	uint64_t *lat;
+	size_t count;
+	size_t cap;
+	/* Calls whose return value differs from the trace */
+	size_t diverged;
+	/* Time the calls took when the trace was taken */
+	uint64_t traced;
+};
+
+static struct op_stats stats[TRACE_OPS];
+
+/* Replay descriptor of every descriptor of the trace, -1 if none */
+static int *fds;
+static size_t nfds;
+
+/* Buffer for reads and writes, grown to the largest call */
+static char *buf;
+static size_t buf_size;
+
+static uint64_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *grow(void *ptr, size_t size)
+{
+	ptr = realloc(ptr, size);
+	if (!ptr)
+		die_perror("realloc");
+	return ptr;
+}
+
+static int fd_of(int fd)
+{
+	/*
+	 * Descriptors that were never opened, or whose replayed open failed, stay
+	 * invalid: their number may name another descriptor open in the replay
+	 */
+	return fd >= 0 && (size_t)fd < nfds ? fds[fd] : -1;
+}
+
+static void fd_set_map(int fd, int replay_fd)
+{
+	if ((size_t)fd >= nfds) {
+		size_t n = nfds ? nfds : 64;
+
+		while (n <= (size_t)fd)
+			n *= 2;
+		fds = grow(fds, n * sizeof(*fds));
+		memset(fds + nfds, 0xFF, (n - nfds) * sizeof(*fds));
+		nfds = n;
+	}
+	fds[fd] = replay_fd;
+}
+
+static char *buffer(uint64_t count)
+{
+	if (count > buf_size) {
+		buf = grow(buf, count);
+		memset(buf, 0xA5, count);
+		buf_size = count;
+	}
+	return buf;
+}
+
+/* Issue the call of @rec, with @disk standing for the recorded disk if set */
+static int replay_one(const struct trace_rec *rec, const char *disk)
+{
+	int fd = fd_of(rec->fd);
+
+	switch (rec->op) {
+	case TRACE_MOUNT:
+		return fs_mount(disk ? disk : rec->name);
+	case TRACE_MOUNT_RO:
+		return fs_mount_ro(disk ? disk : rec->name);
+	case TRACE_UMOUNT:
+		return fs_umount();
+	case TRACE_INFO:
+		return fs_info();
+	case TRACE_CREATE:
+		return fs_create(rec->name);
+	case TRACE_DELETE:
+		return fs_delete(rec->name);
+	case TRACE_CLONE:
+		return fs_clone(rec->name, rec->name2);
+	case TRACE_COMPRESS:
+		return fs_compress(rec->name);
+	case TRACE_LS:
+		return fs_ls();
+	case TRACE_OPEN:
+		return fs_open(rec->name);
+	case TRACE_CLOSE:
+		return fs_close(fd);
+	case TRACE_STAT:
+		return fs_stat(fd);
+	case TRACE_LSEEK:
+		return fs_lseek(fd, rec->arg);
+	case TRACE_WRITE:
+		return fs_write(fd, buffer(rec->arg), rec->arg);
+	case TRACE_READ:
+		return fs_read(fd, buffer(rec->arg), rec->arg);
+	}
+
+	return -1;
+}
+
+/* Replay every call of @trace, return the time it took */
+static uint64_t replay(FILE *trace, const char *disk, int timed)
+{
+	struct trace_rec *rec = malloc(sizeof(*rec));
+	uint64_t begin = now(), first = 0, prev = 0;
+	size_t calls = 0;
+	int ret;
+
+	if (!rec)
+		die_perror("malloc");
+
+	while ((ret = trace_read(trace, rec, prev)) == 1) {
+		struct op_stats *st = &stats[rec->op];
+		uint64_t start;
+		int res;
+
+		if (!calls++)
+			first = rec->start;
+		prev = rec->start;
+		if (timed) {
+			/* Calls start when they did, relative to the first one */
+			uint64_t due = begin + rec->start - first;
+			struct timespec ts = {
+				.tv_sec = due / 1000000000,
+				.tv_nsec = due % 1000000000
+			};
+
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		}
+
+		start = now();
+		res = replay_one(rec, disk);
+		if (st->count == st->cap) {
+			st->cap = st->cap ? 2 * st->cap : 1024;
+			st->lat = grow(st->lat, st->cap * sizeof(*st->lat));
+		}
+		st->lat[st->count++] = now() - start;
+		st->traced += rec->duration;
+		if (res != rec->ret)
+			st->diverged++;
+
+		if (rec->op == TRACE_OPEN && rec->ret >= 0 && rec->ret <= INT32_MAX)
+			fd_set_map(rec->ret, res);
+		else if (rec->op == TRACE_CLOSE && rec->fd >= 0
+			 && (size_t)rec->fd < nfds)
+			fds[rec->fd] = -1;
+	}
+	if (ret < 0)
+		die("Trace corrupted after %zu calls", calls);
+
+	free(rec);
+	return now() - begin;
+}
+
+static int cmp_lat(const void *a, const void *b)
+{
+	uint64_t la = *(const uint64_t*)a, lb = *(const uint64_t*)b;
+
+	return la < lb ? -1 : la > lb;
+}
+
+static void report(uint64_t elapsed)
+{
+	size_t calls = 0, diverged = 0;
+	int op;
+
+	printf("%-9s %9s %9s %10s %10s %10s %10s %10s\n", "op", "calls",
+	       "diverged", "mean us", "p50 us", "p99 us", "max us", "traced us");
+	for (op = 1; op < TRACE_OPS; op++) {
+		struct op_stats *st = &stats[op];
+		uint64_t total = 0;
+		size_t i;
+
+		if (!st->count)
+			continue;
+		qsort(st->lat, st->count, sizeof(*st->lat), cmp_lat);
+		for (i = 0; i < st->count; i++)
+			total += st->lat[i];
+		printf("%-9s %9zu %9zu %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+		       trace_op_names[op], st->count, st->diverged,
+		       total / 1e3 / st->count,
+		       st->lat[st->count / 2] / 1e3,
+		       st->lat[st->count * 99 / 100] / 1e3,
+		       st->lat[st->count - 1] / 1e3,
+		       st->traced / 1e3 / st->count);
+		calls += st->count;
+		diverged += st->diverged;
+	}
+
+	printf("%zu calls in %.3f s (%.0f calls/s), %zu diverged from the trace\n",
+	       calls, elapsed / 1e9, calls / (elapsed / 1e9), diverged);
+}
+
+int main(int argc, char **argv)
+{
+	const char *disk = NULL;
+	uint64_t elapsed;
+	int timed = 0, bad = 0, opt, out, null;
+	FILE *trace;
+
+	/*
+	 * -t: start every call when it started in the trace
+	 * -d: mount this disk instead of the one of the trace
+	 */
+	while ((opt = getopt(argc, argv, "td:")) != -1) {
+		if (opt == 't')
+			timed = 1;
+		else if (opt == 'd')
+			disk = optarg;
+		else
+			bad = 1;
+	}
+	if (bad || optind != argc - 1)
+		die("Usage: %s [-t] [-d <disk>] <trace>\n"
+		    "\t-t\tkeep the timing of the trace instead of replaying at full speed\n"
+		    "\t-d\tmount <disk> instead of the disk the trace was taken on\n"
+		    "Writes are replayed, so replay on a copy of the disk.", argv[0]);
+
+	trace = trace_open(argv[optind]);
+	if (!trace)
+		die("Cannot open trace %s", argv[optind]);
+
+	/* What fs_info() and fs_ls() print is not part of the report */
+	fflush(stdout);
+	out = dup(STDOUT_FILENO);
+	null = open("/dev/null", O_WRONLY);
+	if (out < 0 || null < 0 || dup2(null, STDOUT_FILENO) < 0)
+		die_perror("/dev/null");
+	close(null);
+	elapsed = replay(trace, disk, timed);
+	fflush(stdout);
+	if (dup2(out, STDOUT_FILENO) < 0)
+		die_perror("dup2");
+	close(out);
+	fclose(trace);
+
+	report(elapsed);
+
+	return 0;
+}
@@ -34,6 +34,33 @@ struct thread_arg {
 	char **argv;
 };
 
+/*
+ * Test pattern @seed, as found from @offset on: 16-byte records made of a
+ * letter, the record's index in 14 hex digits and a newline. It compresses
+ * well, yet tells every offset apart, and never holds a zero byte.
+ */
+static char *pattern(int seed, size_t offset, size_t len)
+{
+	char *buf = malloc(len + 1);
+	size_t i;
+
+	if (!buf)
+		die_perror("malloc");
+	for (i = 0; i < len; i++) {
+		size_t record = (offset + i) / 16;
+		int pos = (offset + i) % 16;
+
+		if (pos == 0)
+			buf[i] = 'A' + seed % 26;
+		else if (pos == 15)
+			buf[i] = '\n';
+		else
+			buf[i] = "0123456789abcdef"[(record >> (4 * (14 - pos))) & 0xf];
+	}
+	buf[len] = '\0';
+	return buf;
+}
+
 void thread_fs_script(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -44,6 +71,8 @@ void thread_fs_script(void *arg)
 	const int total_command_parts = 4;
 	char *command_args[total_command_parts];
 	int offset;
+	size_t pos = 0; //offset of the open file
+	int failed = 0; //commands that did not give the expected result
 	char mounted = 0;
 
 	char line_buffer[1024];
@@ -122,6 +151,22 @@ void thread_fs_script(void *arg)
 
 			printf("DELETE successful.\n");
 
+		} else if (strcmp(command, "CLONE") == 0) {
+			if (fs_clone(command_args[1], command_args[2])) {
+				fs_umount();
+				die("Cannot clone file");
+			}
+
+			printf("CLONE successful.\n");
+
+		} else if (strcmp(command, "COMPRESS") == 0) {
+			if (fs_compress(command_args[1])) {
+				fs_umount();
+				die("Cannot compress file");
+			}
+
+			printf("COMPRESS successful.\n");
+
 		} else if (strcmp(command, "OPEN") == 0) {
 			fs_filename = command_args[1];
 
@@ -131,6 +176,7 @@ void thread_fs_script(void *arg)
 				fs_umount();
 				die("Cannot open file");
 			}
+			pos = 0;
 
 			printf("OPEN successful.\n");
 
@@ -149,16 +195,31 @@ void thread_fs_script(void *arg)
 				fs_umount();
 				die("Cannot seek to position");
 			} else {
+				pos = offset;
 				printf("SEEK successful.\n");
 			}
 
+		} else if (strcmp(command, "STAT") == 0) {
+			int size = fs_stat(fs_fd);
+
+			if (size == atoi(command_args[1])) {
+				printf("STAT successful.\n");
+			} else {
+				printf("Unexpected size! %d vs given %s\n", size, command_args[1]);
+				failed++;
+			}
+
 		} else if (strcmp(command, "WRITE") == 0) {
 			data_source = command_args[1];
 			data_description = command_args[2];
+			char *generated = NULL;
 
 			if (strcmp(data_source, "DATA") == 0) {
 				data = data_description;
 				data_size = strlen(data);
+			} else if (strcmp(data_source, "PATTERN") == 0) {
+				data_size = atoi(command_args[3]);
+				data = generated = pattern(atoi(data_description), pos, data_size);
 			} else if (strcmp(data_source, "FILE") == 0) {
 				data_fd = open(data_description, O_RDONLY);
 				if (data_fd < 0) {
@@ -190,6 +251,8 @@ void thread_fs_script(void *arg)
 				fs_umount();
 				die("write error");
 			}
+			pos += count;
+			free(generated);
 			printf("Wrote %d bytes to file.\n", count);
 
 		} else if (strcmp(command, "READ") == 0) {
@@ -202,6 +265,10 @@ void thread_fs_script(void *arg)
 			if (strcmp(data_source, "DATA") == 0) {
 				data = data_description;
 				data_size = strlen(data);
+			} else if (strcmp(data_source, "PATTERN") == 0) {
+				data_size = read_req_length;
+				data = pattern(atoi(data_description), pos, data_size);
+				file_loaded = 1;
 			} else if (strcmp(data_source, "FILE") == 0) {
 				data_fd = open(data_description, O_RDONLY);
 				if (data_fd < 0) {
@@ -247,12 +314,18 @@ void thread_fs_script(void *arg)
 				die("read error");
 			}
 
+			pos += count;
 			// both data and read_buf were allocated with an extra zero byte
 			// +1 here to check for the canaries
-			if (memcmp(data, read_buf, data_size+1) == 0)
+			if (memcmp(data, read_buf, data_size+1) == 0) {
 				printf("Read %d bytes from file. Compared %d correct.\n", count, data_size);
-			else
-				printf("Read unexpected data! %s read vs given %s\n", read_buf, data);
+			} else {
+				if (strcmp(data_source, "PATTERN") == 0)
+					printf("Read unexpected data! %d bytes read vs pattern %s\n", count, data_description);
+				else
+					printf("Read unexpected data! %s read vs given %s\n", read_buf, data);
+				failed++;
+			}
 
 			free(read_buf);
 			if(file_loaded){
@@ -267,6 +340,9 @@ void thread_fs_script(void *arg)
 		die("Cannot unmount diskname");
 
 	fclose(fd_script);
+
+	if (failed)
+		die("%d command(s) did not give the expected result", failed);
 }
 
 void thread_fs_stat(void *arg)
@@ -282,7 +358,7 @@ void thread_fs_stat(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (fs_mount_ro(diskname))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
@@ -329,7 +405,7 @@ void thread_fs_cat(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (fs_mount_ro(diskname))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
@@ -398,7 +474,33 @@ void thread_fs_rm(void *arg)
 	printf("Removed file '%s'\n", filename);
 }
 
-void thread_fs_add(void *arg)
+void thread_fs_clone(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *src, *dst;
+
+	if (t_arg->argc < 3)
+		die("need <diskname> <filename> <new filename>");
+
+	diskname = t_arg->argv[0];
+	src = t_arg->argv[1];
+	dst = t_arg->argv[2];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_clone(src, dst)) {
+		fs_umount();
+		die("Cannot clone file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Cloned file '%s' as '%s'\n", src, dst);
+}
+
+static void add_file(void *arg, int compress)
 {
 	struct thread_arg *t_arg = arg;
 	char *diskname, *filename, *buf;
@@ -438,6 +540,11 @@ void thread_fs_add(void *arg)
 		die("Cannot create file");
 	}
 
+	if (compress && fs_compress(filename)) {
+		fs_umount();
+		die("Cannot compress file");
+	}
+
 	fs_fd = fs_open(filename);
 	if (fs_fd < 0) {
 		fs_umount();
@@ -461,6 +568,16 @@ void thread_fs_add(void *arg)
 	close(fd);
 }
 
+void thread_fs_add(void *arg)
+{
+	add_file(arg, 0);
+}
+
+void thread_fs_addz(void *arg)
+{
+	add_file(arg, 1);
+}
+
 void thread_fs_ls(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -471,7 +588,7 @@ void thread_fs_ls(void *arg)
 
 	diskname = t_arg->argv[0];
 
-	if (fs_mount(diskname))
+	if (fs_mount_ro(diskname))
 		die("Cannot mount diskname");
 
 	fs_ls();
@@ -490,7 +607,7 @@ void thread_fs_info(void *arg)
 
 	diskname = t_arg->argv[0];
 
-	if (fs_mount(diskname))
+	if (fs_mount_ro(diskname))
 		die("Cannot mount diskname");
 
 	fs_info();
@@ -514,7 +631,9 @@ static struct {
 	{ "info",	thread_fs_info },
 	{ "ls",		thread_fs_ls },
 	{ "add",	thread_fs_add },
+	{ "addz",	thread_fs_addz },
 	{ "rm",		thread_fs_rm },
+	{ "clone",	thread_fs_clone },
 	{ "cat",	thread_fs_cat },
 	{ "stat",	thread_fs_stat },
 	{ "script",	thread_fs_script }
@@ -0,0 +1,150 @@
+#ifndef _BACKEND_H
+#define _BACKEND_H
+
+/*
+ * This header is only meant to be included by the block layer of the libfs
+ * and by its backends. It describes how a virtual disk is accessed once
+ * opened: the block layer only deals in byte ranges of an abstract device, the
+ * backend selected by the disk's name moves the bytes around.
+ */
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "disk.h"
+
+struct disk_backend;
+
+/* Open device */
+struct disk_dev {
+	/* Backend operating the device */
+	const struct disk_backend *ops;
+	/* Size of the device in bytes */
+	off_t size;
+	/* Backend's own state */
+	void *priv;
+	/* Opened for reading only, set before open() */
+	int ro;
+	/* Whole device mapped in memory, if a read-only backend could map it */
+	const void *map;
+};
+
+/*
+ * Device backend, selected by prefixing a disk name with "<name>:" or
+ * "<name>,<options>:", the options being a comma-separated list of words or
+ * key=value pairs. Names without a known prefix are host files.
+ *
+ * All operations but open() return 0 on success, -1 on failure. Transfers
+ * are complete and always within the device.
+ */
+struct disk_backend {
+	const char *name;
+	/* Create (or truncate) the device at @path, of @size bytes */
+	int (*create)(const char *opts, const char *path, off_t size);
+	/* Open the device at @path, filling @dev */
+	int (*open)(struct disk_dev *dev, const char *opts, const char *path);
+	/* Release the device, flushing whatever it kept for later */
+	int (*close)(struct disk_dev *dev);
+	int (*read)(struct disk_dev *dev, void *buf, size_t len, off_t off);
+	int (*write)(struct disk_dev *dev, const void *buf, size_t len, off_t off);
+	/* Read consecutive ranges into several buffers at once, optional */
+	int (*readv)(struct disk_dev *dev, const struct iovec *iov, int iovcnt,
+		     off_t off);
+	/* Write consecutive ranges from several buffers at once, optional */
+	int (*writev)(struct disk_dev *dev, const struct iovec *iov, int iovcnt,
+		      off_t off);
+	/* Add what the device knows of its activity to @stats, optional */
+	void (*stats)(struct disk_dev *dev, struct block_disk_stats *stats);
+	/* Release the device at @path, which is not open, optional */
+	int (*drop)(const char *opts, const char *path);
+};
+
+extern const struct disk_backend file_backend;
+extern const struct disk_backend ram_backend;
+extern const struct disk_backend lat_backend;
+extern const struct disk_backend raid0_backend;
+
+/**
+ * disk_file_create - Create a host image file
+ * @path: Name of the file
+ * @size: Size of the file in bytes
+ *
+ * Shared by the backends that keep their data in a host file.
+ *
+ * Return: -1 if the file cannot be created, 0 otherwise.
+ */
+int disk_file_create(const char *path, off_t size);
+
+/**
+ * disk_dev_open - Open a device by name
+ * @dev: Device to fill
+ * @name: Disk name, optionally prefixed with a backend
+ * @ro: Whether the device is only going to be read
+ *
+ * Also meant for backends stacked over another device, which pass the rest
+ * of their own path as @name.
+ *
+ * Return: -1 if no device could be opened, 0 otherwise.
+ */
+int disk_dev_open(struct disk_dev *dev, const char *name, int ro);
+
+/**
+ * disk_dev_create - Create a device by name
+ * @name: Disk name, optionally prefixed with a backend
+ * @size: Size of the device in bytes
+ *
+ * Return: -1 if the device cannot be created, 0 otherwise.
+ */
+int disk_dev_create(const char *name, off_t size);
+
+/**
+ * disk_dev_readv - Scattered read from a device
+ * @dev: Device to read from
+ * @iov: Buffers to fill, one after the other
+ * @iovcnt: Number of buffers
+ * @off: Where the first buffer is read from
+ *
+ * Use the backend's readv() operation, or one read() per buffer if it has
+ * none.
+ *
+ * Return: -1 if a read failed, 0 otherwise.
+ */
+int disk_dev_readv(struct disk_dev *dev, const struct iovec *iov, int iovcnt,
+		   off_t off);
+
+/**
+ * disk_dev_writev - Gathered write to a device
+ * @dev: Device to write to
+ * @iov: Buffers to write, one after the other
+ * @iovcnt: Number of buffers
+ * @off: Where the first buffer goes
+ *
+ * Use the backend's writev() operation, or one write() per buffer if it has
+ * none.
+ *
+ * Return: -1 if a write failed, 0 otherwise.
+ */
+int disk_dev_writev(struct disk_dev *dev, const struct iovec *iov, int iovcnt,
+		    off_t off);
+
+/**
+ * disk_dev_close - Close a device opened with disk_dev_open()
+ * @dev: Device to close
+ *
+ * Return: -1 if the device failed to flush its content, 0 otherwise.
+ */
+int disk_dev_close(struct disk_dev *dev);
+
+/**
+ * disk_opt - Look for an option in a backend's option list
+ * @opts: Comma-separated options, or NULL
+ * @key: Option to look for
+ * @val: Receives the value of a key=value option (pointing into @opts, up to
+ *	the next comma), NULL for a plain word. Can be NULL.
+ *
+ * Return: 1 if @key is in @opts, 0 otherwise.
+ */
+int disk_opt(const char *opts, const char *key, const char **val);
+
+#endif /* _BACKEND_H */
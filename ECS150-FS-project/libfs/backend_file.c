@@ -0,0 +1,221 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "backend.h"
+
+/*
+ * Host file backend: the disk image is a regular file, accessed with
+ * pread()/pwrite(). The file descriptor is kept in the private pointer.
+ *
+ * Read-only devices are also mapped shared, so that every process reading the
+ * same image is served from a single copy in the page cache, without a system
+ * call per transfer.
+ */
+
+#define file_fd(dev) ((int)(intptr_t)(dev)->priv)
+
+static int file_open(struct disk_dev *dev, const char *opts, const char *path)
+{
+	struct stat st;
+	int fd;
+
+	(void)opts;
+
+	if ((fd = open(path, dev->ro ? O_RDONLY : O_RDWR, 0644)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		close(fd);
+		return -1;
+	}
+
+	dev->priv = (void*)(intptr_t)fd;
+	dev->size = st.st_size;
+
+	if (dev->ro && st.st_size) {
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+		/* Reads go through the file descriptor if the image cannot be mapped */
+		if (map != MAP_FAILED)
+			dev->map = map;
+	}
+
+	return 0;
+}
+
+static int file_close(struct disk_dev *dev)
+{
+	int ret = 0;
+
+	if (dev->map && munmap((void*)dev->map, dev->size)) {
+		perror("munmap");
+		ret = -1;
+	}
+
+	if (close(file_fd(dev))) {
+		perror("close");
+		ret = -1;
+	}
+
+	return ret;
+}
+
+static int file_read(struct disk_dev *dev, void *buf, size_t len, off_t off)
+{
+	size_t done = 0;
+
+	if (dev->map) {
+		memcpy(buf, (const char*)dev->map + off, len);
+		return 0;
+	}
+
+	while (done < len) {
+		ssize_t n = pread(file_fd(dev), (char*)buf + done, len - done,
+				  off + done);
+		if (n <= 0) {
+			perror("pread");
+			return -1;
+		}
+		done += n;
+	}
+
+	return 0;
+}
+
+static int file_write(struct disk_dev *dev, const void *buf, size_t len,
+		      off_t off)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t n = pwrite(file_fd(dev), (const char*)buf + done,
+				   len - done, off + done);
+		if (n <= 0) {
+			perror("pwrite");
+			return -1;
+		}
+		done += n;
+	}
+
+	return 0;
+}
+
+/*
+ * Transfer several buffers with as few system calls as possible, finishing
+ * buffer by buffer after a short transfer.
+ */
+static int file_rwv(struct disk_dev *dev, const struct iovec *iov, int iovcnt,
+		    off_t off, int write)
+{
+	while (iovcnt > 0) {
+		int i, n = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+		ssize_t done, total = 0;
+
+		for (i = 0; i < n; i++)
+			total += iov[i].iov_len;
+
+		if (write)
+			done = pwritev(file_fd(dev), iov, n, off);
+		else
+			done = preadv(file_fd(dev), iov, n, off);
+		if (done < 0) {
+			perror(write ? "pwritev" : "preadv");
+			return -1;
+		}
+
+		for (i = 0; done < total && i < n; i++) {
+			size_t skip = (size_t)done < iov[i].iov_len ?
+				(size_t)done : iov[i].iov_len;
+			char *base = (char*)iov[i].iov_base + skip;
+			size_t len = iov[i].iov_len - skip;
+
+			if (len && (write ? file_write(dev, base, len, off + skip)
+				    : file_read(dev, base, len, off + skip)))
+				return -1;
+			done -= skip;
+			off += iov[i].iov_len;
+			total -= iov[i].iov_len;
+		}
+		off += total;
+		iov += n;
+		iovcnt -= n;
+	}
+
+	return 0;
+}
+
+static int file_readv(struct disk_dev *dev, const struct iovec *iov,
+		      int iovcnt, off_t off)
+{
+	int i;
+
+	if (dev->map) {
+		for (i = 0; i < iovcnt; i++) {
+			memcpy(iov[i].iov_base, (const char*)dev->map + off,
+			       iov[i].iov_len);
+			off += iov[i].iov_len;
+		}
+		return 0;
+	}
+
+	return file_rwv(dev, iov, iovcnt, off, 0);
+}
+
+static int file_writev(struct disk_dev *dev, const struct iovec *iov,
+		       int iovcnt, off_t off)
+{
+	return file_rwv(dev, iov, iovcnt, off, 1);
+}
+
+int disk_file_create(const char *path, off_t size)
+{
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0) {
+		perror("open");
+		return -1;
+	}
+
+	if (ftruncate(fd, size)) {
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+
+	if (close(fd)) {
+		perror("close");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int file_create(const char *opts, const char *path, off_t size)
+{
+	(void)opts;
+
+	return disk_file_create(path, size);
+}
+
+const struct disk_backend file_backend = {
+	.name = "file",
+	.create = file_create,
+	.open = file_open,
+	.close = file_close,
+	.read = file_read,
+	.write = file_write,
+	.readv = file_readv,
+	.writev = file_writev,
+};
@@ -0,0 +1,225 @@
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "backend.h"
+
+#define lat_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/*
+ * Latency emulation backend: requests are passed to the device underneath,
+ * and charged with the time a real device would have taken to serve them.
+ *
+ * A request that does not start where the previous one ended pays for a seek,
+ * growing with the square root of the distance between the two (which is how
+ * the seek time of a disk arm grows for short and medium distances), plus a
+ * rotational delay and a fixed access time. Every request then pays for its
+ * transfer at the device's bandwidth.
+ */
+
+/* How far the device can get behind before a request is waited for */
+#define LAT_SLACK_NS 1000000
+
+/* Device model, times in microseconds */
+struct lat_model {
+	const char *name;
+	double seek;		/* shortest (track to track) seek */
+	double fullseek;	/* seek across the whole device */
+	double rot;		/* average rotational delay */
+	double access;		/* fixed cost of a non-sequential request */
+	double bw;		/* transfer rate, in MB/s */
+};
+
+static const struct lat_model models[] = {
+	/* 7200 RPM disk */
+	{ "hdd", 500, 15000, 4167, 0, 150 },
+	/* SATA flash disk */
+	{ "ssd", 0, 0, 0, 80, 500 },
+};
+
+struct lat_disk {
+	struct disk_dev lower;
+	struct lat_model model;
+	int sleep;
+	/* Where the previous request ended */
+	off_t head;
+	size_t seeks;
+	uint64_t device_ns;
+	/* When the device is done with the requests charged so far */
+	struct timespec busy_until;
+};
+
+static void lat_param(const char *opts, const char *key, double *param)
+{
+	const char *val;
+
+	if (disk_opt(opts, key, &val) && val)
+		*param = strtod(val, NULL);
+}
+
+static int lat_create(const char *opts, const char *path, off_t size)
+{
+	(void)opts;
+
+	return disk_dev_create(path, size);
+}
+
+static int lat_open(struct disk_dev *dev, const char *opts, const char *path)
+{
+	struct lat_disk *lat = calloc(1, sizeof(*lat));
+	size_t i;
+
+	if (!lat) {
+		perror("calloc");
+		return -1;
+	}
+
+	lat->model = models[0];
+	for (i = 0; i < sizeof(models) / sizeof(models[0]); i++) {
+		if (disk_opt(opts, models[i].name, NULL))
+			lat->model = models[i];
+	}
+	lat_param(opts, "seek", &lat->model.seek);
+	lat_param(opts, "fullseek", &lat->model.fullseek);
+	lat_param(opts, "rot", &lat->model.rot);
+	lat_param(opts, "access", &lat->model.access);
+	lat_param(opts, "bw", &lat->model.bw);
+	if (lat->model.bw <= 0) {
+		lat_error("invalid bandwidth");
+		free(lat);
+		return -1;
+	}
+	lat->sleep = disk_opt(opts, "sleep", NULL);
+
+	if (disk_dev_open(&lat->lower, path, dev->ro)) {
+		free(lat);
+		return -1;
+	}
+
+	dev->priv = lat;
+	dev->size = lat->lower.size;
+	clock_gettime(CLOCK_MONOTONIC, &lat->busy_until);
+
+	return 0;
+}
+
+static int lat_close(struct disk_dev *dev)
+{
+	struct lat_disk *lat = dev->priv;
+	int ret = disk_dev_close(&lat->lower);
+
+	free(lat);
+	return ret;
+}
+
+/* Charge a request of @len bytes at @off */
+static void lat_charge(struct disk_dev *dev, size_t len, off_t off)
+{
+	struct lat_disk *lat = dev->priv;
+	struct lat_model *m = &lat->model;
+	double us = len / m->bw;
+	struct timespec now;
+	uint64_t ns;
+
+	if (off != lat->head) {
+		double dist = off > lat->head ? off - lat->head : lat->head - off;
+
+		us += m->seek + (m->fullseek - m->seek) * sqrt(dist / dev->size);
+		us += m->rot + m->access;
+		lat->seeks++;
+	}
+	lat->head = off + len;
+
+	ns = us * 1000;
+	lat->device_ns += ns;
+	if (!lat->sleep)
+		return;
+
+	/* Requests are served one after the other, from when the device is idle */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec > lat->busy_until.tv_sec
+	    || (now.tv_sec == lat->busy_until.tv_sec
+		&& now.tv_nsec > lat->busy_until.tv_nsec))
+		lat->busy_until = now;
+	lat->busy_until.tv_nsec += ns % 1000000000;
+	lat->busy_until.tv_sec += ns / 1000000000 + lat->busy_until.tv_nsec / 1000000000;
+	lat->busy_until.tv_nsec %= 1000000000;
+	/* Short requests are only waited for once they add up to some time */
+	if ((lat->busy_until.tv_sec - now.tv_sec) * 1000000000
+	    + lat->busy_until.tv_nsec - now.tv_nsec < LAT_SLACK_NS)
+		return;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &lat->busy_until,
+			       NULL) == EINTR)
+		;
+}
+
+static int lat_read(struct disk_dev *dev, void *buf, size_t len, off_t off)
+{
+	struct lat_disk *lat = dev->priv;
+
+	lat_charge(dev, len, off);
+	return lat->lower.ops->read(&lat->lower, buf, len, off);
+}
+
+static int lat_write(struct disk_dev *dev, const void *buf, size_t len,
+		     off_t off)
+{
+	struct lat_disk *lat = dev->priv;
+
+	lat_charge(dev, len, off);
+	return lat->lower.ops->write(&lat->lower, buf, len, off);
+}
+
+static int lat_readv(struct disk_dev *dev, const struct iovec *iov,
+		     int iovcnt, off_t off)
+{
+	struct lat_disk *lat = dev->priv;
+	size_t len = 0;
+	int i;
+
+	/* A single request to the device */
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	lat_charge(dev, len, off);
+	return disk_dev_readv(&lat->lower, iov, iovcnt, off);
+}
+
+static int lat_writev(struct disk_dev *dev, const struct iovec *iov,
+		      int iovcnt, off_t off)
+{
+	struct lat_disk *lat = dev->priv;
+	size_t len = 0;
+	int i;
+
+	/* A single request to the device */
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	lat_charge(dev, len, off);
+	return disk_dev_writev(&lat->lower, iov, iovcnt, off);
+}
+
+static void lat_stats(struct disk_dev *dev, struct block_disk_stats *stats)
+{
+	struct lat_disk *lat = dev->priv;
+
+	stats->seeks += lat->seeks;
+	stats->device_ns += lat->device_ns;
+	if (lat->lower.ops->stats)
+		lat->lower.ops->stats(&lat->lower, stats);
+}
+
+const struct disk_backend lat_backend = {
+	.name = "lat",
+	.create = lat_create,
+	.open = lat_open,
+	.close = lat_close,
+	.read = lat_read,
+	.write = lat_write,
+	.readv = lat_readv,
+	.writev = lat_writev,
+	.stats = lat_stats,
+};
@@ -0,0 +1,415 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "backend.h"
+
+#define raid_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/*
+ * Striping backend (RAID-0): several member disks, separated by '+' in the
+ * path, make a single device. The device is cut into stripe units handed out
+ * to the members in turn, so that a large transfer keeps every member busy.
+ *
+ * Each member has its own thread: the pieces of a request that fall on
+ * different members are transferred in parallel, the calling thread taking
+ * care of one of them itself.
+ */
+
+/* Most member disks in a volume */
+#define RAID_MAX_MEMBERS 16
+
+/* Stripe unit when none is given */
+#define RAID_DEFAULT_UNIT (64 << 10)
+
+struct raid_disk;
+
+struct raid_member {
+	struct disk_dev dev;
+	struct raid_disk *raid;
+	pthread_t thread;
+	/* Piece of the current request, contiguous on the member */
+	struct iovec *iov;
+	int iovcnt;
+	int iovcap;
+	off_t off;
+	int write;
+	int ret;
+	/* Piece handed to the member's thread and not done yet */
+	int busy;
+};
+
+struct raid_disk {
+	int count;
+	off_t unit;
+	struct raid_member members[RAID_MAX_MEMBERS];
+	/* Member threads running */
+	int threads;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	int pending;
+	int stop;
+};
+
+/* Bytes of a volume of @size bytes that member @m holds */
+static off_t raid_member_size(off_t size, int m, int count, off_t unit)
+{
+	off_t row = unit * count;
+	off_t rest = size % row - m * unit;
+
+	return size / row * unit + (rest < 0 ? 0 : rest > unit ? unit : rest);
+}
+
+/* Parse options and split the member names, which stay in @names */
+static int raid_parse(const char *opts, const char *path, char **names,
+		      char **members, off_t *unit)
+{
+	const char *val;
+	char *end, *save, *name;
+	int count = 0;
+
+	*unit = RAID_DEFAULT_UNIT;
+	if (disk_opt(opts, "stripe", &val) && val) {
+		*unit = strtoul(val, &end, 0);
+		if (*end == 'k' || *end == 'K')
+			*unit <<= 10;
+		else if (*end == 'm' || *end == 'M')
+			*unit <<= 20;
+	}
+	if (*unit < BLOCK_SIZE || *unit % BLOCK_SIZE) {
+		raid_error("stripe unit must be a multiple of %d", BLOCK_SIZE);
+		return -1;
+	}
+
+	*names = strdup(path);
+	if (!*names) {
+		perror("strdup");
+		return -1;
+	}
+	for (name = strtok_r(*names, "+", &save); name;
+	     name = strtok_r(NULL, "+", &save)) {
+		if (count == RAID_MAX_MEMBERS) {
+			raid_error("more than %d member disks", RAID_MAX_MEMBERS);
+			free(*names);
+			return -1;
+		}
+		members[count++] = name;
+	}
+	if (!count) {
+		raid_error("no member disk");
+		free(*names);
+		return -1;
+	}
+
+	return count;
+}
+
+static int raid_create(const char *opts, const char *path, off_t size)
+{
+	char *names, *members[RAID_MAX_MEMBERS];
+	int count, m, ret = 0;
+	off_t unit;
+
+	count = raid_parse(opts, path, &names, members, &unit);
+	if (count < 0)
+		return -1;
+
+	for (m = 0; m < count && !ret; m++)
+		ret = disk_dev_create(members[m],
+				      raid_member_size(size, m, count, unit));
+
+	free(names);
+	return ret;
+}
+
+static int raid_member_io(struct raid_member *mb)
+{
+	if (mb->write)
+		return disk_dev_writev(&mb->dev, mb->iov, mb->iovcnt, mb->off);
+	return disk_dev_readv(&mb->dev, mb->iov, mb->iovcnt, mb->off);
+}
+
+static void *raid_worker(void *arg)
+{
+	struct raid_member *mb = arg;
+	struct raid_disk *raid = mb->raid;
+
+	pthread_mutex_lock(&raid->lock);
+	for (;;) {
+		while (!mb->busy && !raid->stop)
+			pthread_cond_wait(&raid->work, &raid->lock);
+		if (!mb->busy)
+			break;
+		pthread_mutex_unlock(&raid->lock);
+
+		mb->ret = raid_member_io(mb);
+
+		pthread_mutex_lock(&raid->lock);
+		mb->busy = 0;
+		if (--raid->pending == 0)
+			pthread_cond_signal(&raid->done);
+	}
+	pthread_mutex_unlock(&raid->lock);
+
+	return NULL;
+}
+
+static void raid_release(struct raid_disk *raid)
+{
+	int m;
+
+	pthread_mutex_lock(&raid->lock);
+	raid->stop = 1;
+	pthread_cond_broadcast(&raid->work);
+	pthread_mutex_unlock(&raid->lock);
+	for (m = 0; m < raid->threads; m++)
+		pthread_join(raid->members[m].thread, NULL);
+
+	pthread_mutex_destroy(&raid->lock);
+	pthread_cond_destroy(&raid->work);
+	pthread_cond_destroy(&raid->done);
+	for (m = 0; m < raid->count; m++)
+		free(raid->members[m].iov);
+	free(raid);
+}
+
+static int raid_close(struct disk_dev *dev)
+{
+	struct raid_disk *raid = dev->priv;
+	int m, ret = 0;
+
+	for (m = 0; m < raid->count; m++) {
+		if (disk_dev_close(&raid->members[m].dev))
+			ret = -1;
+	}
+	raid_release(raid);
+
+	return ret;
+}
+
+static int raid_open(struct disk_dev *dev, const char *opts, const char *path)
+{
+	char *names, *members[RAID_MAX_MEMBERS];
+	struct raid_disk *raid;
+	off_t size = 0;
+	int m, opened = 0;
+
+	raid = calloc(1, sizeof(*raid));
+	if (!raid) {
+		perror("calloc");
+		return -1;
+	}
+	pthread_mutex_init(&raid->lock, NULL);
+	pthread_cond_init(&raid->work, NULL);
+	pthread_cond_init(&raid->done, NULL);
+
+	raid->count = raid_parse(opts, path, &names, members, &raid->unit);
+	if (raid->count < 0) {
+		raid->count = 0;
+		raid_release(raid);
+		return -1;
+	}
+
+	for (; opened < raid->count; opened++) {
+		if (disk_dev_open(&raid->members[opened].dev, members[opened],
+				  dev->ro))
+			goto err;
+		size += raid->members[opened].dev.size;
+	}
+	free(names);
+	names = NULL;
+
+	/* Members must hold exactly their share of the volume */
+	for (m = 0; m < raid->count; m++) {
+		if (raid->members[m].dev.size
+		    != raid_member_size(size, m, raid->count, raid->unit)) {
+			raid_error("member disks do not form a striped volume");
+			goto err;
+		}
+	}
+
+	for (; raid->threads < raid->count; raid->threads++) {
+		struct raid_member *mb = &raid->members[raid->threads];
+
+		mb->raid = raid;
+		if (pthread_create(&mb->thread, NULL, raid_worker, mb)) {
+			perror("pthread_create");
+			goto err;
+		}
+	}
+
+	dev->priv = raid;
+	dev->size = size;
+
+	return 0;
+
+err:
+	free(names);
+	for (m = 0; m < opened; m++)
+		disk_dev_close(&raid->members[m].dev);
+	raid_release(raid);
+	return -1;
+}
+
+/* Append a piece of @len bytes at @base to the request of member @mb */
+static int raid_add(struct raid_member *mb, void *base, size_t len)
+{
+	if (mb->iovcnt == mb->iovcap) {
+		int cap = mb->iovcap ? 2 * mb->iovcap : 16;
+		struct iovec *iov = realloc(mb->iov, cap * sizeof(*iov));
+
+		if (!iov) {
+			perror("realloc");
+			return -1;
+		}
+		mb->iov = iov;
+		mb->iovcap = cap;
+	}
+	/* Pieces of a member follow each other on it, merge what follows in memory */
+	if (mb->iovcnt && (char*)mb->iov[mb->iovcnt - 1].iov_base
+	    + mb->iov[mb->iovcnt - 1].iov_len == (char*)base) {
+		mb->iov[mb->iovcnt - 1].iov_len += len;
+		return 0;
+	}
+	mb->iov[mb->iovcnt].iov_base = base;
+	mb->iov[mb->iovcnt].iov_len = len;
+	mb->iovcnt++;
+
+	return 0;
+}
+
+/*
+ * Split a request into one piece per member: the stripe units a member holds
+ * are next to each other on it, whatever their distance on the volume.
+ */
+static int raid_rw(struct disk_dev *dev, const struct iovec *iov, int iovcnt,
+		   off_t off, int write)
+{
+	struct raid_disk *raid = dev->priv;
+	struct raid_member *self = NULL;
+	size_t inner = 0;
+	int i = 0, m, ret = 0;
+
+	for (m = 0; m < raid->count; m++)
+		raid->members[m].iovcnt = 0;
+
+	while (i < iovcnt) {
+		off_t stripe = off / raid->unit, in = off % raid->unit;
+		struct raid_member *mb = &raid->members[stripe % raid->count];
+		size_t len = iov[i].iov_len - inner;
+
+		if (len > (size_t)(raid->unit - in))
+			len = raid->unit - in;
+		if (!mb->iovcnt)
+			mb->off = stripe / raid->count * raid->unit + in;
+		if (raid_add(mb, (char*)iov[i].iov_base + inner, len))
+			return -1;
+
+		off += len;
+		inner += len;
+		if (inner == iov[i].iov_len) {
+			inner = 0;
+			i++;
+		}
+	}
+
+	/* Hand every piece but one to the member threads */
+	pthread_mutex_lock(&raid->lock);
+	for (m = 0; m < raid->count; m++) {
+		struct raid_member *mb = &raid->members[m];
+
+		if (!mb->iovcnt)
+			continue;
+		mb->write = write;
+		if (!self) {
+			self = mb;
+			continue;
+		}
+		mb->busy = 1;
+		raid->pending++;
+	}
+	if (raid->pending)
+		pthread_cond_broadcast(&raid->work);
+	pthread_mutex_unlock(&raid->lock);
+
+	if (self)
+		ret = raid_member_io(self);
+
+	pthread_mutex_lock(&raid->lock);
+	while (raid->pending)
+		pthread_cond_wait(&raid->done, &raid->lock);
+	pthread_mutex_unlock(&raid->lock);
+
+	for (m = 0; m < raid->count; m++) {
+		struct raid_member *mb = &raid->members[m];
+
+		if (mb->iovcnt && mb != self && mb->ret)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+static int raid_read(struct disk_dev *dev, void *buf, size_t len, off_t off)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+	return raid_rw(dev, &iov, 1, off, 0);
+}
+
+static int raid_write(struct disk_dev *dev, const void *buf, size_t len,
+		      off_t off)
+{
+	struct iovec iov = { .iov_base = (void*)buf, .iov_len = len };
+
+	return raid_rw(dev, &iov, 1, off, 1);
+}
+
+static int raid_readv(struct disk_dev *dev, const struct iovec *iov,
+		      int iovcnt, off_t off)
+{
+	return raid_rw(dev, iov, iovcnt, off, 0);
+}
+
+static int raid_writev(struct disk_dev *dev, const struct iovec *iov,
+		       int iovcnt, off_t off)
+{
+	return raid_rw(dev, iov, iovcnt, off, 1);
+}
+
+static void raid_stats(struct disk_dev *dev, struct block_disk_stats *stats)
+{
+	struct raid_disk *raid = dev->priv;
+	uint64_t busiest = 0;
+	int m;
+
+	/* Members work in parallel, the volume is as busy as its busiest one */
+	for (m = 0; m < raid->count; m++) {
+		struct disk_dev *mdev = &raid->members[m].dev;
+		struct block_disk_stats mstats = { 0 };
+
+		if (!mdev->ops->stats)
+			continue;
+		mdev->ops->stats(mdev, &mstats);
+		stats->seeks += mstats.seeks;
+		if (mstats.device_ns > busiest)
+			busiest = mstats.device_ns;
+	}
+	stats->device_ns += busiest;
+}
+
+const struct disk_backend raid0_backend = {
+	.name = "raid0",
+	.create = raid_create,
+	.open = raid_open,
+	.close = raid_close,
+	.read = raid_read,
+	.write = raid_write,
+	.readv = raid_readv,
+	.writev = raid_writev,
+	.stats = raid_stats,
+};
@@ -0,0 +1,406 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "disk.h"
+
+#define ram_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/*
+ * RAM disk backend: the image file is loaded in memory when the disk is
+ * opened, and every access is then served from memory. Changes are written
+ * back to the image when the disk is closed, unless the "discard" option is
+ * given, in which case the image is only ever read.
+ *
+ * Only the parts of the image that hold data are loaded, and only the parts
+ * that were modified are written back, so that sparse images stay sparse.
+ *
+ * With the "size" option, there is no image: the path names a RAM disk of the
+ * process instead, which is created zero-filled by block_disk_create(), or
+ * when first opened with size=<bytes>. Its memory outlives the opening of the
+ * disk, so that it can be formatted then mounted, and is only released when
+ * the process exits or the disk is dropped with block_disk_drop().
+ */
+
+/* Granularity of the write-back */
+#define RAM_UNIT BLOCK_SIZE
+
+/* RAM disk without an image, kept from one opening to the next */
+struct ram_named {
+	char *name;
+	uint8_t *data;
+	off_t size;
+	/* Currently open */
+	int open;
+	struct ram_named *next;
+};
+
+/* Every named RAM disk of the process */
+static struct ram_named *named_disks;
+
+struct ram_disk {
+	uint8_t *data;
+	/* Named RAM disk holding the data, NULL when loaded from an image */
+	struct ram_named *named;
+	/* Image file, -1 when changes are discarded */
+	int fd;
+	/* Bitmap of the units modified since the disk was opened */
+	uint8_t *dirty;
+};
+
+/* Fill @data with the data regions of @fd, holes are already zero */
+static int ram_load(int fd, uint8_t *data, off_t size)
+{
+	off_t start = 0, end;
+
+	while (start < size) {
+		start = lseek(fd, start, SEEK_DATA);
+		if (start < 0) {
+			/* Past the last data region */
+			if (errno == ENXIO)
+				break;
+			/* Holes not reported, read everything */
+			start = 0;
+			end = size;
+		} else {
+			end = lseek(fd, start, SEEK_HOLE);
+			if (end < 0 || end > size)
+				end = size;
+		}
+
+		while (start < end) {
+			ssize_t n = pread(fd, data + start, end - start, start);
+			if (n <= 0) {
+				perror("pread");
+				return -1;
+			}
+			start += n;
+		}
+	}
+
+	return 0;
+}
+
+/* Write the modified units back, a run of consecutive units at a time */
+static int ram_flush(struct ram_disk *ram, off_t size)
+{
+	size_t units = size / RAM_UNIT, i = 0, j;
+
+	while (i < units) {
+		if (!(ram->dirty[i / 8] & (1 << (i % 8)))) {
+			i++;
+			continue;
+		}
+		for (j = i; j < units && (ram->dirty[j / 8] & (1 << (j % 8))); j++)
+			;
+
+		off_t off = (off_t)i * RAM_UNIT;
+		size_t len = (j - i) * RAM_UNIT, done = 0;
+		while (done < len) {
+			ssize_t n = pwrite(ram->fd, ram->data + off + done,
+					   len - done, off + done);
+			if (n <= 0) {
+				perror("pwrite");
+				return -1;
+			}
+			done += n;
+		}
+		i = j;
+	}
+
+	return 0;
+}
+
+/* Zero-filled memory for @size bytes of disk, MAP_FAILED if none */
+static uint8_t *ram_map(off_t size)
+{
+	/* Anonymous memory is zero-filled, and only takes room once touched */
+	void *data = size ? mmap(NULL, size, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+				 -1, 0) : NULL;
+
+	if (data == MAP_FAILED)
+		perror("mmap");
+	return data;
+}
+
+static void ram_unmap(uint8_t *data, off_t size)
+{
+	if (size)
+		munmap(data, size);
+}
+
+/* Named RAM disk @name, NULL if there is none. @prev receives its link. */
+static struct ram_named *named_find(const char *name, struct ram_named ***prev)
+{
+	struct ram_named **p;
+
+	for (p = &named_disks; *p; p = &(*p)->next) {
+		if (!strcmp((*p)->name, name))
+			break;
+	}
+	if (prev)
+		*prev = p;
+	return *p;
+}
+
+/* Create named RAM disk @name of @size bytes, replacing any previous one */
+static struct ram_named *named_create(const char *name, off_t size)
+{
+	struct ram_named **prev, *named = named_find(name, &prev);
+	uint8_t *data;
+
+	if (size % RAM_UNIT) {
+		ram_error("size '%zu' is not multiple of '%d'", (size_t)size,
+			  RAM_UNIT);
+		return NULL;
+	}
+	if (named && named->open) {
+		ram_error("RAM disk '%s' is open", name);
+		return NULL;
+	}
+	if ((data = ram_map(size)) == MAP_FAILED)
+		return NULL;
+
+	if (named) {
+		ram_unmap(named->data, named->size);
+	} else {
+		named = calloc(1, sizeof(*named));
+		if (!named || !(named->name = strdup(name))) {
+			perror("malloc");
+			free(named);
+			ram_unmap(data, size);
+			return NULL;
+		}
+		*prev = named;
+	}
+	named->data = data;
+	named->size = size;
+
+	return named;
+}
+
+/* Size given by the "size" option, 0 if it has no value, -1 if invalid */
+static off_t named_size(const char *opts)
+{
+	const char *val;
+	char *end;
+	off_t size;
+
+	if (!disk_opt(opts, "size", &val) || !val)
+		return 0;
+
+	size = strtoull(val, &end, 0);
+	if (*end == 'k' || *end == 'K')
+		size <<= 10;
+	else if (*end == 'm' || *end == 'M')
+		size <<= 20;
+	else if (*end == 'g' || *end == 'G')
+		size <<= 30;
+	if (size <= 0 || size % RAM_UNIT) {
+		ram_error("size must be a multiple of %d", RAM_UNIT);
+		return -1;
+	}
+	return size;
+}
+
+static int ram_create(const char *opts, const char *path, off_t size)
+{
+	if (disk_opt(opts, "size", NULL))
+		return named_create(path, size) ? 0 : -1;
+
+	/* The image is what a RAM disk is loaded from */
+	return disk_file_create(path, size);
+}
+
+/* Open named RAM disk @path, creating it if the options give its size */
+static int ram_open_named(struct disk_dev *dev, const char *opts,
+			  const char *path)
+{
+	struct ram_named *named = named_find(path, NULL);
+	struct ram_disk *ram;
+	off_t size;
+
+	if (!named) {
+		if ((size = named_size(opts)) < 0)
+			return -1;
+		if (!size) {
+			ram_error("no RAM disk '%s'", path);
+			return -1;
+		}
+		if (!(named = named_create(path, size)))
+			return -1;
+	} else if (named->open) {
+		ram_error("RAM disk '%s' is already open", path);
+		return -1;
+	}
+
+	ram = calloc(1, sizeof(*ram));
+	if (!ram) {
+		perror("calloc");
+		return -1;
+	}
+	ram->data = named->data;
+	ram->named = named;
+	ram->fd = -1;
+	named->open = 1;
+	dev->priv = ram;
+	dev->size = named->size;
+	if (dev->ro)
+		dev->map = ram->data;
+
+	return 0;
+}
+
+static int ram_open(struct disk_dev *dev, const char *opts, const char *path)
+{
+	/* Read-only devices have no changes to write back either */
+	int discard = dev->ro || disk_opt(opts, "discard", NULL);
+	struct ram_disk *ram;
+	struct stat st;
+	int fd;
+
+	if (disk_opt(opts, "size", NULL))
+		return ram_open_named(dev, opts, path);
+
+	if ((fd = open(path, discard ? O_RDONLY : O_RDWR)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		goto err_close;
+	}
+	if (st.st_size % RAM_UNIT) {
+		ram_error("size '%zu' is not multiple of '%d'",
+			  (size_t)st.st_size, RAM_UNIT);
+		goto err_close;
+	}
+
+	ram = calloc(1, sizeof(*ram));
+	if (!ram) {
+		perror("calloc");
+		goto err_close;
+	}
+	ram->dirty = calloc(st.st_size / RAM_UNIT / 8 + 1, 1);
+	if (!ram->dirty) {
+		perror("calloc");
+		goto err_free;
+	}
+	ram->data = ram_map(st.st_size);
+	if (ram->data == MAP_FAILED)
+		goto err_free;
+	if (ram_load(fd, ram->data, st.st_size))
+		goto err_unmap;
+
+	if (discard) {
+		close(fd);
+		fd = -1;
+	}
+	ram->fd = fd;
+	dev->priv = ram;
+	dev->size = st.st_size;
+	if (dev->ro)
+		dev->map = ram->data;
+
+	return 0;
+
+err_unmap:
+	ram_unmap(ram->data, st.st_size);
+err_free:
+	free(ram->dirty);
+	free(ram);
+err_close:
+	close(fd);
+	return -1;
+}
+
+static int ram_close(struct disk_dev *dev)
+{
+	struct ram_disk *ram = dev->priv;
+	int ret = 0;
+
+	if (ram->fd >= 0) {
+		ret = ram_flush(ram, dev->size);
+		if (close(ram->fd)) {
+			perror("close");
+			ret = -1;
+		}
+	}
+
+	/* A named RAM disk keeps its data for the next opening */
+	if (ram->named)
+		ram->named->open = 0;
+	else
+		ram_unmap(ram->data, dev->size);
+	free(ram->dirty);
+	free(ram);
+
+	return ret;
+}
+
+static int ram_read(struct disk_dev *dev, void *buf, size_t len, off_t off)
+{
+	struct ram_disk *ram = dev->priv;
+
+	memcpy(buf, ram->data + off, len);
+
+	return 0;
+}
+
+static int ram_write(struct disk_dev *dev, const void *buf, size_t len,
+		     off_t off)
+{
+	struct ram_disk *ram = dev->priv;
+	size_t i;
+
+	memcpy(ram->data + off, buf, len);
+	if (ram->fd >= 0) {
+		for (i = off / RAM_UNIT; i < (off + len + RAM_UNIT - 1) / RAM_UNIT; i++)
+			ram->dirty[i / 8] |= 1 << (i % 8);
+	}
+
+	return 0;
+}
+
+static int ram_drop(const char *opts, const char *path)
+{
+	struct ram_named **prev, *named = named_find(path, &prev);
+
+	if (!disk_opt(opts, "size", NULL) || !named) {
+		ram_error("no RAM disk '%s'", path);
+		return -1;
+	}
+	if (named->open) {
+		ram_error("RAM disk '%s' is open", path);
+		return -1;
+	}
+
+	*prev = named->next;
+	ram_unmap(named->data, named->size);
+	free(named->name);
+	free(named);
+
+	return 0;
+}
+
+const struct disk_backend ram_backend = {
+	.name = "ram",
+	.create = ram_create,
+	.open = ram_open,
+	.close = ram_close,
+	.read = ram_read,
+	.write = ram_write,
+	.drop = ram_drop,
+};
@@ -0,0 +1,201 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#endif
+
+#include "crc32c.h"
+
+/* Reversed Castagnoli polynomial */
+#define CRC32C_POLY 0x82F63B78
+
+/*
+ * Slicing-by-8 tables: table[k][b] is the checksum of byte b followed by k
+ * zero bytes, so that eight bytes can be folded with eight lookups.
+ */
+static uint32_t table[8][256];
+
+#ifdef __x86_64__
+/*
+ * The crc32 instruction takes three cycles but can start one every cycle:
+ * three streams of CRC32C_STREAM bytes are checksummed side by side, then
+ * combined. shift[k][b] moves byte k of a checksum over CRC32C_STREAM zero
+ * bytes, and shift2 over twice as many. A 4 KiB block is three streams and
+ * a short tail.
+ */
+#define CRC32C_STREAM 1360
+static uint32_t shift[4][256], shift2[4][256];
+#endif
+
+static uint32_t (*crc32c_impl)(uint32_t crc, const void *buf, size_t len);
+
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32c_table(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint32_t c = ~crc;
+
+	while (len && ((uintptr_t)p & 7)) {
+		c = table[0][(c ^ *p++) & 0xFF] ^ (c >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		uint32_t lo, hi;
+
+		memcpy(&lo, p, 4);
+		memcpy(&hi, p + 4, 4);
+		lo ^= c;
+		c = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF]
+			^ table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24]
+			^ table[3][hi & 0xFF] ^ table[2][(hi >> 8) & 0xFF]
+			^ table[1][(hi >> 16) & 0xFF] ^ table[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		c = table[0][(c ^ *p++) & 0xFF] ^ (c >> 8);
+
+	return ~c;
+}
+
+#ifdef __x86_64__
+/* Register @c followed by @len zero bytes */
+static uint32_t crc32c_zeros(uint32_t c, size_t len)
+{
+	while (len--)
+		c = table[0][c & 0xFF] ^ (c >> 8);
+	return c;
+}
+
+/* Tables moving a register over @len zero bytes, a linear map */
+static void crc32c_shift_init(uint32_t t[4][256], size_t len)
+{
+	uint32_t basis[32];
+	int i, k, b;
+
+	for (i = 0; i < 32; i++)
+		basis[i] = crc32c_zeros(1u << i, len);
+	for (k = 0; k < 4; k++) {
+		for (b = 0; b < 256; b++) {
+			uint32_t c = 0;
+
+			for (i = 0; i < 8; i++) {
+				if (b & (1 << i))
+					c ^= basis[8 * k + i];
+			}
+			t[k][b] = c;
+		}
+	}
+}
+
+static inline uint32_t crc32c_shift(uint32_t t[4][256], uint32_t c)
+{
+	return t[0][c & 0xFF] ^ t[1][(c >> 8) & 0xFF]
+		^ t[2][(c >> 16) & 0xFF] ^ t[3][c >> 24];
+}
+#endif
+
+#ifdef CRC32C_X86
+/* Eight bytes per crc32 instruction, compiled for SSE4.2 whatever the flags */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint32_t c = ~crc;
+
+	while (len && ((uintptr_t)p & 7)) {
+		c = _mm_crc32_u8(c, *p++);
+		len--;
+	}
+#ifdef __x86_64__
+	while (len >= 3 * CRC32C_STREAM) {
+		uint64_t c0 = c, c1 = 0, c2 = 0, v;
+		size_t i;
+
+		for (i = 0; i < CRC32C_STREAM; i += 8) {
+			memcpy(&v, p + i, 8);
+			c0 = _mm_crc32_u64(c0, v);
+			memcpy(&v, p + CRC32C_STREAM + i, 8);
+			c1 = _mm_crc32_u64(c1, v);
+			memcpy(&v, p + 2 * CRC32C_STREAM + i, 8);
+			c2 = _mm_crc32_u64(c2, v);
+		}
+		c = crc32c_shift(shift2, c0) ^ crc32c_shift(shift, c1) ^ c2;
+		p += 3 * CRC32C_STREAM;
+		len -= 3 * CRC32C_STREAM;
+	}
+	while (len >= 8) {
+		uint64_t v;
+
+		memcpy(&v, p, 8);
+		c = _mm_crc32_u64(c, v);
+		p += 8;
+		len -= 8;
+	}
+#endif
+	while (len >= 4) {
+		uint32_t v;
+
+		memcpy(&v, p, 4);
+		c = _mm_crc32_u32(c, v);
+		p += 4;
+		len -= 4;
+	}
+	while (len--)
+		c = _mm_crc32_u8(c, *p++);
+
+	return ~c;
+}
+#endif
+
+static void crc32c_init(void)
+{
+	uint32_t c;
+	int b, i, k;
+
+	for (b = 0; b < 256; b++) {
+		c = b;
+		for (i = 0; i < 8; i++)
+			c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		table[0][b] = c;
+	}
+	for (b = 0; b < 256; b++) {
+		c = table[0][b];
+		for (k = 1; k < 8; k++) {
+			c = table[0][c & 0xFF] ^ (c >> 8);
+			table[k][b] = c;
+		}
+	}
+
+	crc32c_impl = crc32c_table;
+#ifdef CRC32C_X86
+	if (__builtin_cpu_supports("sse4.2"))
+		crc32c_impl = crc32c_sse42;
+#endif
+#ifdef __x86_64__
+	crc32c_shift_init(shift, CRC32C_STREAM);
+	crc32c_shift_init(shift2, 2 * CRC32C_STREAM);
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+	return crc32c_impl(crc, buf, len);
+}
+
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+	return crc32c_table(crc, buf, len);
+}
+
+int crc32c_hw(void)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+	return crc32c_impl != crc32c_table;
+}
@@ -0,0 +1,37 @@
+#ifndef _CRC32C_H
+#define _CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * crc32c - Compute a CRC-32C (Castagnoli) checksum
+ * @crc: Checksum of the preceding data, 0 to start a new one
+ * @buf: Data to checksum
+ * @len: Length of @buf in bytes
+ *
+ * Use the SSE4.2 crc32 instruction when the processor has it, a table-driven
+ * implementation otherwise. Both give the same results.
+ *
+ * Return: The checksum of the preceding data followed by @buf.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * crc32c_sw - Compute a CRC-32C checksum without the crc32 instruction
+ * @crc: Checksum of the preceding data, 0 to start a new one
+ * @buf: Data to checksum
+ * @len: Length of @buf in bytes
+ *
+ * Return: The checksum of the preceding data followed by @buf.
+ */
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * crc32c_hw - Tell how crc32c() computes checksums
+ *
+ * Return: 1 if crc32c() uses the crc32 instruction, 0 otherwise.
+ */
+int crc32c_hw(void);
+
+#endif /* _CRC32C_H */
@@ -1,84 +1,620 @@
-#include <fcntl.h>
+#define _GNU_SOURCE
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <unistd.h>
+#include <string.h>
+#include <sys/uio.h>
 
+#include "backend.h"
+#include "crc32c.h"
 #include "disk.h"
 
 #define block_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
 
-/* Invalid file descriptor */
-#define INVALID_FD -1
+/* Most writes the request queue holds before dispatching them */
+#define QUEUE_MAX_REQS 4096
+
+/* Room for the copies of blocks given to block_write() while plugged */
+#define QUEUE_COPY_BYTES (8 << 20)
+
+/* Slots of the queue's block lookup table, a power of two */
+#define QUEUE_SLOTS (2 * QUEUE_MAX_REQS)
+
+/* Write waiting in the request queue */
+struct request {
+	size_t block;
+	const void *data;
+	/* Copy of the data in the queue's own buffer, if any */
+	int copy;
+};
+
+/* Request queue, collecting writes while the disk is plugged */
+struct queue {
+	int plugged;
+	/* A dispatch failed since the disk was plugged */
+	int error;
+	struct request reqs[QUEUE_MAX_REQS];
+	size_t count;
+	/* Block copies, allocated on first use */
+	uint8_t *copies;
+	size_t copies_used;
+	/* Open-addressing table of queued blocks, valid for the current gen */
+	struct {
+		uint32_t gen;
+		uint32_t req;
+	} slots[QUEUE_SLOTS];
+	uint32_t gen;
+};
 
 /* Disk instance description */
 struct disk {
-	/* File descriptor */
-	int fd;
+	/* Underlying device (no backend when closed) */
+	struct disk_dev dev;
+	/* Opened with block_disk_open_ro(), writes are refused */
+	int ro;
 	/* Block count */
 	size_t bcount;
+	/* Block size */
+	size_t bsize;
+	/* Blocks transferred since the disk was opened */
+	size_t reads;
+	size_t writes;
+	/* Transfers issued to the device */
+	size_t requests;
+	/* Pending writes */
+	struct queue queue;
+	/* Checksum of every block, 0 if unknown, NULL if not kept */
+	uint32_t *csum;
+	/* Blocks holding the checksums, which are not checksummed themselves */
+	size_t csum_first;
+	size_t csum_count;
+	/* Which of them changed since they were last written, NULL when the
+	 * table is read from the device's mapping */
+	uint8_t *csum_dirty;
 };
 
 /* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+static struct disk disk;
 
-int block_disk_open(const char *diskname)
+/* Backends selectable by prefix, the first one being the default */
+static const struct disk_backend *backends[] = {
+	&file_backend,
+	&ram_backend,
+	&lat_backend,
+	&raid0_backend,
+};
+
+int disk_opt(const char *opts, const char *key, const char **val)
+{
+	size_t len = strlen(key);
+
+	while (opts && *opts) {
+		if (!strncmp(opts, key, len)
+		    && (opts[len] == '\0' || opts[len] == ',' || opts[len] == '=')) {
+			if (val)
+				*val = opts[len] == '=' ? opts + len + 1 : NULL;
+			return 1;
+		}
+		opts = strchr(opts, ',');
+		if (opts)
+			opts++;
+	}
+	return 0;
+}
+
+/*
+ * Split @name into its backend, options and path. @prefix receives a copy of
+ * the prefix holding the options, to be freed once they are no longer needed.
+ */
+static const struct disk_backend *disk_parse(const char *name, char **prefix,
+					     const char **opts,
+					     const char **path)
+{
+	const struct disk_backend *backend = backends[0];
+	const char *colon = strchr(name, ':');
+	char *comma;
+	size_t i;
+
+	*prefix = NULL;
+	*opts = NULL;
+	*path = name;
+
+	/* "<backend>[,<options>]:<path>", anything else is a host file name */
+	if (!colon)
+		return backend;
+
+	*prefix = strndup(name, colon - name);
+	if (!*prefix) {
+		perror("strndup");
+		return NULL;
+	}
+	comma = strchr(*prefix, ',');
+	if (comma)
+		*comma++ = '\0';
+	for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		if (!strcmp(*prefix, backends[i]->name)) {
+			backend = backends[i];
+			*opts = comma;
+			*path = colon + 1;
+			break;
+		}
+	}
+
+	return backend;
+}
+
+int disk_dev_open(struct disk_dev *dev, const char *name, int ro)
+{
+	const struct disk_backend *backend;
+	const char *opts, *path;
+	char *prefix;
+	int ret;
+
+	backend = disk_parse(name, &prefix, &opts, &path);
+	if (!backend)
+		return -1;
+
+	dev->ops = backend;
+	dev->size = 0;
+	dev->priv = NULL;
+	dev->ro = ro;
+	dev->map = NULL;
+	ret = backend->open(dev, opts, path);
+	if (ret)
+		dev->ops = NULL;
+
+	free(prefix);
+	return ret;
+}
+
+int disk_dev_create(const char *name, off_t size)
+{
+	const struct disk_backend *backend;
+	const char *opts, *path;
+	char *prefix;
+	int ret;
+
+	backend = disk_parse(name, &prefix, &opts, &path);
+	if (!backend)
+		return -1;
+
+	ret = backend->create(opts, path, size);
+
+	free(prefix);
+	return ret;
+}
+
+int disk_dev_readv(struct disk_dev *dev, const struct iovec *iov, int iovcnt,
+		   off_t off)
+{
+	int i;
+
+	if (dev->ops->readv)
+		return dev->ops->readv(dev, iov, iovcnt, off);
+
+	for (i = 0; i < iovcnt; i++) {
+		if (dev->ops->read(dev, iov[i].iov_base, iov[i].iov_len, off))
+			return -1;
+		off += iov[i].iov_len;
+	}
+	return 0;
+}
+
+int disk_dev_writev(struct disk_dev *dev, const struct iovec *iov, int iovcnt,
+		    off_t off)
+{
+	int i;
+
+	if (dev->ops->writev)
+		return dev->ops->writev(dev, iov, iovcnt, off);
+
+	for (i = 0; i < iovcnt; i++) {
+		if (dev->ops->write(dev, iov[i].iov_base, iov[i].iov_len, off))
+			return -1;
+		off += iov[i].iov_len;
+	}
+	return 0;
+}
+
+int disk_dev_close(struct disk_dev *dev)
+{
+	int ret = dev->ops->close(dev);
+
+	dev->ops = NULL;
+	return ret;
+}
+
+int block_disk_create(const char *diskname, size_t size)
+{
+	if (!diskname || size % BLOCK_SIZE) {
+		block_error("invalid disk");
+		return -1;
+	}
+
+	return disk_dev_create(diskname, size);
+}
+
+int block_disk_drop(const char *diskname)
 {
-	int fd;
-	struct stat st;
+	const struct disk_backend *backend;
+	const char *opts, *path;
+	char *prefix;
+	int ret = -1;
 
+	if (!diskname) {
+		block_error("invalid disk");
+		return -1;
+	}
+
+	backend = disk_parse(diskname, &prefix, &opts, &path);
+	if (!backend)
+		return -1;
+
+	if (backend->drop)
+		ret = backend->drop(opts, path);
+	else
+		block_error("'%s' cannot be dropped", diskname);
+
+	free(prefix);
+	return ret;
+}
+
+static int disk_open(const char *diskname, int ro)
+{
 	if (!diskname) {
 		block_error("invalid file diskname");
 		return -1;
 	}
 
-	if (disk.fd != INVALID_FD) {
+	if (disk.dev.ops) {
 		block_error("disk already open");
 		return -1;
 	}
 
-	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
-		perror("open");
+	if (disk_dev_open(&disk.dev, diskname, ro))
+		return -1;
+
+	/* The disk image's size should be a multiple of the block size */
+	if (disk.dev.size % BLOCK_SIZE != 0) {
+		block_error("size '%zu' is not multiple of '%d'",
+			    (size_t)disk.dev.size, BLOCK_SIZE);
+		disk_dev_close(&disk.dev);
 		return -1;
 	}
 
-	if (fstat(fd, &st)) {
-		perror("fstat");
+	disk.ro = ro;
+	disk.bsize = BLOCK_SIZE;
+	disk.bcount = disk.dev.size / BLOCK_SIZE;
+	disk.reads = 0;
+	disk.writes = 0;
+	disk.requests = 0;
+	/* Lookup slots are valid for a nonzero generation only */
+	if (!disk.queue.gen)
+		disk.queue.gen = 1;
+
+	return 0;
+}
+
+int block_disk_open(const char *diskname)
+{
+	return disk_open(diskname, 0);
+}
+
+int block_disk_open_ro(const char *diskname)
+{
+	return disk_open(diskname, 1);
+}
+
+/* Slot of @block in the lookup table, free or holding it */
+static size_t queue_slot(struct queue *q, size_t block)
+{
+	size_t i = (block * 0x9E3779B97F4A7C15ull) >> 32;
+
+	for (;; i++) {
+		i &= QUEUE_SLOTS - 1;
+		if (q->slots[i].gen != q->gen || q->reqs[q->slots[i].req].block == block)
+			return i;
+	}
+}
+
+/* Queued data of @block, or NULL */
+static const void *queue_find(size_t block)
+{
+	struct queue *q = &disk.queue;
+	size_t i;
+
+	if (!q->count)
+		return NULL;
+	i = queue_slot(q, block);
+	return q->slots[i].gen == q->gen ? q->reqs[q->slots[i].req].data : NULL;
+}
+
+static int cmp_requests(const void *a, const void *b)
+{
+	const struct request *ra = a, *rb = b;
+
+	return ra->block < rb->block ? -1 : ra->block > rb->block;
+}
+
+/*
+ * Issue every queued write: in block order, each run of consecutive blocks as
+ * a single vectored transfer.
+ */
+static int queue_dispatch(void)
+{
+	struct queue *q = &disk.queue;
+	struct iovec iov[IOV_MAX];
+	size_t i = 0, n;
+	int ret = 0;
+
+	qsort(q->reqs, q->count, sizeof(q->reqs[0]), cmp_requests);
+
+	while (i < q->count) {
+		size_t first = q->reqs[i].block;
+
+		for (n = 0; i < q->count && n < IOV_MAX
+			     && q->reqs[i].block == first + n; i++, n++) {
+			iov[n].iov_base = (void*)q->reqs[i].data;
+			iov[n].iov_len = disk.bsize;
+		}
+		disk.requests++;
+		if (disk_dev_writev(&disk.dev, iov, n, first * disk.bsize))
+			ret = -1;
+	}
+
+	q->count = 0;
+	q->copies_used = 0;
+	/* Forget every slot at once */
+	if (++q->gen == 0) {
+		memset(q->slots, 0, sizeof(q->slots));
+		q->gen = 1;
+	}
+	if (ret)
+		q->error = 1;
+
+	return ret;
+}
+
+/* Queue a write of @block, copying @buf unless @keep */
+static int queue_add(size_t block, const void *buf, int keep)
+{
+	struct queue *q = &disk.queue;
+	struct request *req;
+	size_t i;
+
+	if (!keep && !q->copies) {
+		q->copies = malloc(QUEUE_COPY_BYTES);
+		if (!q->copies) {
+			perror("malloc");
+			return -1;
+		}
+	}
+
+	i = queue_slot(q, block);
+	if (q->slots[i].gen == q->gen) {
+		/* Rewrite of a queued block, the last data wins */
+		req = &q->reqs[q->slots[i].req];
+		if (keep) {
+			req->data = buf;
+			req->copy = 0;
+			return 0;
+		}
+		if (req->copy) {
+			memcpy((void*)req->data, buf, disk.bsize);
+			return 0;
+		}
+	} else {
+		req = NULL;
+	}
+
+	if (q->count == QUEUE_MAX_REQS
+	    || (!keep && q->copies_used + disk.bsize > QUEUE_COPY_BYTES)) {
+		/* Full, make room by dispatching what is there */
+		if (queue_dispatch())
+			return -1;
+		return queue_add(block, buf, keep);
+	}
+
+	if (!req) {
+		q->slots[i].gen = q->gen;
+		q->slots[i].req = q->count;
+		req = &q->reqs[q->count++];
+		req->block = block;
+	}
+	if (keep) {
+		req->data = buf;
+		req->copy = 0;
+	} else {
+		memcpy(q->copies + q->copies_used, buf, disk.bsize);
+		req->data = q->copies + q->copies_used;
+		req->copy = 1;
+		q->copies_used += disk.bsize;
+	}
+
+	return 0;
+}
+
+/* Checksum of a block's content, never 0 which stands for unknown */
+static uint32_t csum_of(const void *buf)
+{
+	uint32_t crc = crc32c(0, buf, disk.bsize);
+
+	return crc ? crc : 0xFFFFFFFF;
+}
+
+static int csum_kept(size_t block)
+{
+	return disk.csum && (block < disk.csum_first
+			     || block >= disk.csum_first + disk.csum_count);
+}
+
+/* Record the checksum of @block, about to be written with @buf */
+static void csum_update(size_t block, const void *buf)
+{
+	uint32_t crc;
+
+	if (!csum_kept(block))
+		return;
+	crc = csum_of(buf);
+	if (disk.csum[block] != crc) {
+		disk.csum[block] = crc;
+		disk.csum_dirty[block * sizeof(uint32_t) / disk.bsize] = 1;
+	}
+}
+
+/* Check @block, just read into @buf, against its checksum */
+static int csum_verify(size_t block, const void *buf)
+{
+	if (!csum_kept(block) || !disk.csum[block] || disk.csum[block] == csum_of(buf))
+		return 0;
+
+	block_error("checksum mismatch on block %zu", block);
+	return -1;
+}
+
+/* Write the checksum blocks that changed, or queue them if plugged */
+static int csum_flush(void)
+{
+	size_t i;
+	int ret = 0;
+
+	for (i = 0; disk.csum_dirty && i < disk.csum_count; i++) {
+		const uint8_t *data = (const uint8_t*)disk.csum + i * disk.bsize;
+
+		if (!disk.csum_dirty[i])
+			continue;
+		disk.csum_dirty[i] = 0;
+		if (disk.queue.plugged) {
+			/* The table is only written on unplug, when it is current */
+			if (queue_add(disk.csum_first + i, data, 1))
+				ret = -1;
+		} else {
+			disk.requests++;
+			if (disk.dev.ops->write(&disk.dev, data, disk.bsize,
+						(disk.csum_first + i) * disk.bsize))
+				ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+int block_disk_set_checksums(size_t first, size_t count)
+{
+	if (!disk.dev.ops) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	/* The disk image's size should be a multiple of the block size */
-	if (st.st_size % BLOCK_SIZE != 0) {
-		block_error("size '%zu' is not multiple of '%d'",
-			    st.st_size, BLOCK_SIZE);
+	if (disk.csum || first >= disk.bcount || count > disk.bcount - first
+	    || count * disk.bsize / sizeof(uint32_t) < disk.bcount) {
+		block_error("invalid checksum blocks");
 		return -1;
 	}
 
-	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	/* Nothing is written to a read-only disk, its table can stay mapped */
+	if (disk.ro && disk.dev.map) {
+		disk.csum = (uint32_t*)((const uint8_t*)disk.dev.map
+					+ first * disk.bsize);
+		disk.csum_first = first;
+		disk.csum_count = count;
+		return 0;
+	}
+
+	disk.csum = malloc(count * disk.bsize);
+	disk.csum_dirty = calloc(count, 1);
+	if (!disk.csum || !disk.csum_dirty) {
+		perror("malloc");
+		goto err;
+	}
+	disk.requests++;
+	if (disk.dev.ops->read(&disk.dev, disk.csum, count * disk.bsize,
+			       first * disk.bsize))
+		goto err;
+	disk.csum_first = first;
+	disk.csum_count = count;
 
 	return 0;
+
+err:
+	free(disk.csum);
+	free(disk.csum_dirty);
+	disk.csum = NULL;
+	disk.csum_dirty = NULL;
+	return -1;
 }
 
 int block_disk_close(void)
 {
-	if (disk.fd == INVALID_FD) {
+	int ret = 0;
+
+	if (!disk.dev.ops) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	close(disk.fd);
+	if (disk.queue.count && queue_dispatch())
+		ret = -1;
+	disk.queue.plugged = 0;
+	free(disk.queue.copies);
+	disk.queue.copies = NULL;
 
-	disk.fd = INVALID_FD;
+	if (csum_flush())
+		ret = -1;
+	if (disk.csum_dirty)
+		free(disk.csum);
+	free(disk.csum_dirty);
+	disk.csum = NULL;
+	disk.csum_dirty = NULL;
+
+	if (disk_dev_close(&disk.dev))
+		ret = -1;
+	return ret;
+}
+
+int block_plug(void)
+{
+	if (!disk.dev.ops) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (!disk.queue.plugged++)
+		disk.queue.error = 0;
 
 	return 0;
 }
 
+int block_unplug(void)
+{
+	struct queue *q = &disk.queue;
+
+	if (!disk.dev.ops || !q->plugged) {
+		block_error("disk not plugged");
+		return -1;
+	}
+
+	/* Nested plugs are only dispatched by the outermost unplug */
+	if (q->plugged > 1) {
+		q->plugged--;
+		return 0;
+	}
+
+	/* Checksums of the queued blocks go out with them */
+	if (csum_flush())
+		q->error = 1;
+	q->plugged = 0;
+	if (q->count)
+		queue_dispatch();
+
+	return q->error ? -1 : 0;
+}
+
 int block_disk_count(void)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk.dev.ops) {
 		block_error("no disk currently open");
 		return -1;
 	}
@@ -86,59 +622,204 @@ int block_disk_count(void)
 	return disk.bcount;
 }
 
-int block_write(size_t block, const void *buf)
+int block_disk_stats(struct block_disk_stats *stats)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk.dev.ops) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	memset(stats, 0, sizeof(*stats));
+	stats->reads = disk.reads;
+	stats->writes = disk.writes;
+	stats->requests = disk.requests;
+	if (disk.dev.ops->stats)
+		disk.dev.ops->stats(&disk.dev, stats);
+
+	return 0;
+}
+
+int block_disk_block_size(void)
+{
+	if (!disk.dev.ops) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	return disk.bsize;
+}
+
+int block_disk_set_block_size(size_t size)
+{
+	if (!disk.dev.ops) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (size < BLOCK_SIZE || size > BLOCK_SIZE_MAX || (size & (size - 1))) {
+		block_error("invalid block size '%zu'", size);
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	if (disk.dev.size % size != 0) {
+		block_error("size '%zu' is not multiple of '%zu'",
+			    (size_t)disk.dev.size, size);
 		return -1;
 	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	if (disk.csum) {
+		block_error("checksums already kept");
 		return -1;
 	}
 
+	if (disk.queue.count && queue_dispatch())
+		return -1;
+
+	disk.bsize = size;
+	disk.bcount = disk.dev.size / size;
+
 	return 0;
 }
 
-int block_read(size_t block, void *buf)
+/* Check that @count blocks from @block can be transferred */
+static int block_check(size_t block, size_t count)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk.dev.ops) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
+	if (block >= disk.bcount || count > disk.bcount - block) {
 		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+			    block + count - 1, disk.bcount);
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	return 0;
+}
+
+/* Check that @count blocks from @block can be written */
+static int block_check_write(size_t block, size_t count)
+{
+	if (block_check(block, count))
+		return -1;
+
+	if (disk.ro) {
+		block_error("disk is read-only");
 		return -1;
 	}
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	return 0;
+}
+
+int block_write(size_t block, const void *buf)
+{
+	if (block_check_write(block, 1))
 		return -1;
+
+	disk.writes++;
+	csum_update(block, buf);
+	if (disk.queue.plugged)
+		return queue_add(block, buf, 0);
+
+	/* Perform the actual write into the disk image at the specified block number */
+	disk.requests++;
+	if (disk.dev.ops->write(&disk.dev, buf, disk.bsize, block * disk.bsize))
+		return -1;
+	return csum_flush();
+}
+
+int block_read(size_t block, void *buf)
+{
+	const void *queued;
+
+	if (block_check(block, 1))
+		return -1;
+
+	disk.reads++;
+	/* Queued writes are newer than what the device holds */
+	queued = queue_find(block);
+	if (queued) {
+		memcpy(buf, queued, disk.bsize);
+		return 0;
+	}
+
+	/* Perform the actual read from the disk image at the specified block number */
+	disk.requests++;
+	if (disk.dev.ops->read(&disk.dev, buf, disk.bsize, block * disk.bsize))
+		return -1;
+	return csum_verify(block, buf);
+}
+
+int block_write_many(size_t block, size_t count, const void *buf)
+{
+	size_t i;
+
+	if (block_check_write(block, count))
+		return -1;
+
+	disk.writes += count;
+	for (i = 0; disk.csum && i < count; i++)
+		csum_update(block + i, (const uint8_t*)buf + i * disk.bsize);
+	if (disk.queue.plugged) {
+		for (i = 0; i < count; i++) {
+			if (queue_add(block + i, (const uint8_t*)buf + i * disk.bsize, 1))
+				return -1;
+		}
+		return 0;
+	}
+
+	disk.requests++;
+	if (disk.dev.ops->write(&disk.dev, buf, count * disk.bsize,
+				block * disk.bsize))
+		return -1;
+	return csum_flush();
+}
+
+int block_read_many(size_t block, size_t count, void *buf)
+{
+	const void *queued;
+	size_t i;
+
+	if (block_check(block, count))
+		return -1;
+
+	disk.reads += count;
+	disk.requests++;
+	if (disk.dev.ops->read(&disk.dev, buf, count * disk.bsize,
+			       block * disk.bsize))
+		return -1;
+
+	/* Queued writes are newer than what the device holds */
+	for (i = 0; (disk.queue.count || disk.csum) && i < count; i++) {
+		uint8_t *data = (uint8_t*)buf + i * disk.bsize;
+
+		queued = queue_find(block + i);
+		if (queued)
+			memcpy(data, queued, disk.bsize);
+		else if (csum_verify(block + i, data))
+			return -1;
 	}
 
 	return 0;
 }
 
+const void *block_disk_map(size_t block, size_t count)
+{
+	const uint8_t *data;
+	size_t i;
+
+	if (block_check(block, count))
+		return NULL;
+
+	if (!disk.ro || !disk.dev.map)
+		return NULL;
+
+	data = (const uint8_t*)disk.dev.map + block * disk.bsize;
+	for (i = 0; disk.csum && i < count; i++) {
+		if (csum_verify(block + i, data + i * disk.bsize))
+			return NULL;
+	}
+
+	return data;
+}
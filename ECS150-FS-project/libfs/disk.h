@@ -2,10 +2,40 @@
 #define _DISK_H
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h>
 
-/** Size of a disk block in bytes */
+/** Size of a disk block in bytes, until block_disk_set_block_size() */
 #define BLOCK_SIZE 4096
 
+/** Largest block size a disk can be switched to */
+#define BLOCK_SIZE_MAX 65536
+
+/**
+ * block_disk_create - Create virtual disk
+ * @diskname: Name of the virtual disk, as for block_disk_open()
+ * @size: Size of the virtual disk in bytes
+ *
+ * Create (or truncate) virtual disk @diskname, which then reads as zeros. The
+ * members of a striped disk get their share of @size each.
+ *
+ * Return: -1 if @diskname is invalid, if @size is not a multiple of
+ * %BLOCK_SIZE, or if the virtual disk cannot be created. 0 otherwise.
+ */
+int block_disk_create(const char *diskname, size_t size);
+
+/**
+ * block_disk_drop - Release an in-process virtual disk
+ * @diskname: Name of the virtual disk, as for block_disk_open()
+ *
+ * Free the memory of RAM disk @diskname, given with the size option (see
+ * block_disk_open()). Other disks have an image that outlives the process, and
+ * are not dropped.
+ *
+ * Return: -1 if @diskname is not an in-process disk, if there is no such disk,
+ * or if it is open. 0 otherwise.
+ */
+int block_disk_drop(const char *diskname);
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
@@ -14,11 +44,91 @@
  * blocks can be read from it with block_read() or written to it with
  * block_write().
  *
+ * @diskname may start with a backend prefix selecting how the disk is
+ * accessed, followed by the name of the image:
+ *
+ *	file:<image>		the image file itself (same as no prefix)
+ *	ram:<image>		the image loaded in memory, written back on close
+ *	ram,discard:<image>	the image loaded in memory, changes are dropped
+ *	ram,size[=<size>]:<name>
+ *				RAM disk of the process, without image, see
+ *				below
+ *	lat,<model>:<disk>	latency emulation over another disk, see below
+ *	raid0[,stripe=<size>]:<disk>+<disk>...
+ *				disks striped into a single one, by units of
+ *				64 KiB unless told otherwise (k and m suffixes
+ *				are understood), transferring in parallel
+ *
+ * A RAM disk given the size option lives in the process only, under its name.
+ * block_disk_create() makes it anew, zero-filled, of the size it is given. If
+ * it does not exist yet when opened, <size> bytes are allocated for it (k, m
+ * and g suffixes are understood), otherwise <size> is ignored. It keeps its
+ * data once closed, until the process exits or it is dropped with
+ * block_disk_drop(): fs_format() then fs_mount() work without any host file.
+ *
+ * The lat backend charges every request with the time a device would take to
+ * serve it, depending on the distance from the end of the previous request.
+ * The model is "hdd" (distance-dependent seek plus half a rotation for each
+ * non-sequential request, 150 MB/s) or "ssd" (fixed access time for each
+ * non-sequential request, 500 MB/s). Options override its parameters:
+ * seek=<us> and fullseek=<us> for the shortest and longest seeks, rot=<us>
+ * for the rotational delay, access=<us> for the fixed access time and bw=<MB/s>
+ * for the transfer rate. With the sleep option, requests also take that long
+ * in real time. Simulated time is reported by block_disk_stats().
+ *
  * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
  * or is already open. 0 otherwise.
  */
 int block_disk_open(const char *diskname);
 
+/**
+ * block_disk_open_ro - Open virtual disk file for reading only
+ * @diskname: Name of the virtual disk file, as for block_disk_open()
+ *
+ * Open virtual disk file @diskname like block_disk_open(), except that any
+ * write is refused. Host image files are mapped shared, so that processes
+ * reading the same image share its pages, and reads are copied out of the
+ * mapping. The image must not be modified while it is open this way.
+ *
+ * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
+ * or is already open. 0 otherwise.
+ */
+int block_disk_open_ro(const char *diskname);
+
+/**
+ * block_disk_map - Access blocks in place
+ * @block: Index of the first block
+ * @count: Number of blocks
+ *
+ * Give direct access to blocks @block to @block + @count - 1 of a disk opened
+ * with block_disk_open_ro() whose device is mapped in memory. The blocks are
+ * checked against their checksums, if kept, and stay valid until the disk is
+ * closed.
+ *
+ * Return: NULL if a block is out of bounds or does not match its checksum, or
+ * if the disk is not mapped. Otherwise return the content of the blocks.
+ */
+const void *block_disk_map(size_t block, size_t count);
+
+/**
+ * struct block_disk_stats - Activity of a virtual disk
+ * @reads: Number of blocks read since the disk was opened
+ * @writes: Number of blocks written since the disk was opened
+ * @requests: Number of transfers issued to the device for them, multi-block
+ *	transfers and merged writes counting once
+ * @seeks: Number of non-sequential requests seen by a latency emulation
+ *	backend, 0 without one
+ * @device_ns: Time a latency emulation backend simulated for all requests, in
+ *	nanoseconds, 0 without one
+ */
+struct block_disk_stats {
+	size_t reads;
+	size_t writes;
+	size_t requests;
+	size_t seeks;
+	uint64_t device_ns;
+};
+
 /**
  * block_disk_close - Close virtual disk file
  *
@@ -34,16 +144,69 @@ int block_disk_close(void);
  */
 int block_disk_count(void);
 
+/**
+ * block_disk_stats - Get disk's activity
+ * @stats: Statistics to fill
+ *
+ * Return: -1 if there was no virtual disk file opened. 0 otherwise.
+ */
+int block_disk_stats(struct block_disk_stats *stats);
+
+/**
+ * block_disk_block_size - Get disk's block size
+ *
+ * Return: -1 if there was no virtual disk file opened, otherwise the size in
+ * bytes of the blocks transferred by block_read() and block_write().
+ */
+int block_disk_block_size(void);
+
+/**
+ * block_disk_set_block_size - Change disk's block size
+ * @size: New block size in bytes
+ *
+ * Switch the currently open disk to blocks of @size bytes. Disks are always
+ * opened with %BLOCK_SIZE blocks, so that the file system can read its
+ * superblock before telling the disk which block size it was formatted with.
+ * The block count is recomputed accordingly.
+ *
+ * Return: -1 if there was no virtual disk file opened, if @size is not a power
+ * of two between %BLOCK_SIZE and %BLOCK_SIZE_MAX, or if the disk's size is not
+ * a multiple of @size. 0 otherwise.
+ */
+int block_disk_set_block_size(size_t size);
+
+/**
+ * block_disk_set_checksums - Keep block checksums
+ * @first: Index of the first block of the checksum region
+ * @count: Number of blocks of the checksum region
+ *
+ * Tell the disk that blocks @first to @first + @count - 1 hold a 32-bit
+ * CRC-32C checksum for each of its blocks, 0 standing for a checksum not
+ * known yet. From then on, block_write() records the checksum of every block
+ * it writes, and block_read() fails on blocks not matching their checksum.
+ * The checksums of the region's own blocks are not kept. The region is
+ * written along with the blocks it describes, when the disk is unplugged if it
+ * is plugged.
+ *
+ * Checksums are computed with the SSE4.2 crc32 instruction when available.
+ *
+ * Return: -1 if there was no virtual disk file opened, if the region is out
+ * of bounds, too small to hold a checksum for each block, or cannot be read,
+ * or if checksums are already kept. 0 otherwise.
+ */
+int block_disk_set_checksums(size_t first, size_t count);
+
 /**
  * block_write - Write a block to disk
  * @block: Index of the block to write to
  * @buf: Data buffer to write in the block
  *
- * Write the content of buffer @buf (%BLOCK_SIZE bytes) in the virtual disk's
- * block @block.
+ * Write the content of buffer @buf (block size bytes) in the virtual disk's
+ * block @block. While the disk is plugged, @buf is copied into the request
+ * queue and can be reused right away.
  *
- * Return: -1 if @block is out of bounds or inaccessible or if the writing
- * operation fails. 0 otherwise.
+ * Return: -1 if @block is out of bounds or inaccessible, if the disk is
+ * read-only, or if the writing operation fails. 0 otherwise.
  */
 int block_write(size_t block, const void *buf);
 
@@ -52,13 +215,67 @@ int block_write(size_t block, const void *buf);
  * @block: Index of the block to read from
  * @buf: Data buffer to be filled with content of block
  *
- * Read the content of virtual disk's block @block (%BLOCK_SIZE bytes) into
+ * Read the content of virtual disk's block @block (block size bytes) into
  * buffer @buf.
  *
- * Return: -1 if @block is out of bounds or inaccessible, or if the reading
- * operation fails. 0 otherwise.
+ * Return: -1 if @block is out of bounds or inaccessible, if the reading
+ * operation fails, or if the block does not match its checksum. 0 otherwise.
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_write_many - Write consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks
+ * @buf: Data buffer to write in the blocks
+ *
+ * Write the content of buffer @buf (@count times the block size bytes) in the
+ * virtual disk's blocks @block to @block + @count - 1, with a single transfer.
+ *
+ * While the disk is plugged the blocks are queued without being copied, so
+ * @buf must stay valid and unchanged until block_unplug().
+ *
+ * Return: -1 if a block is out of bounds or inaccessible, if the disk is
+ * read-only, or if the writing operation fails. 0 otherwise.
+ */
+int block_write_many(size_t block, size_t count, const void *buf);
+
+/**
+ * block_read_many - Read consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @count: Number of blocks
+ * @buf: Data buffer to be filled with content of blocks
+ *
+ * Read the content of virtual disk's blocks @block to @block + @count - 1
+ * into buffer @buf, with a single transfer.
+ *
+ * Return: -1 if a block is out of bounds or inaccessible, if the reading
+ * operation fails, or if a block does not match its checksum. 0 otherwise.
+ */
+int block_read_many(size_t block, size_t count, void *buf);
+
+/**
+ * block_plug - Start queueing writes
+ *
+ * Until the matching block_unplug(), writes are not issued to the device but
+ * collected in a request queue. Reads still go to the device, but see the
+ * queued writes. Plugs nest.
+ *
+ * Return: -1 if there was no virtual disk file opened. 0 otherwise.
+ */
+int block_plug(void);
+
+/**
+ * block_unplug - Issue queued writes
+ *
+ * Once the outermost plug is removed, queued writes are sorted by block
+ * number and consecutive blocks are merged into single transfers. The queue
+ * is also dispatched early when it fills up.
+ *
+ * Return: -1 if the disk was not plugged, or if any queued write failed since
+ * it was plugged. 0 otherwise.
+ */
+int block_unplug(void);
+
 #endif /* _DISK_H */
 
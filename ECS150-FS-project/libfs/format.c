@@ -0,0 +1,251 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "private.h"
+
+#define format_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Default options: the layout produced by the reference fs_make */
+static const struct fs_format_opts default_opts = {
+	.wide = 0,
+	.block_size = BLOCK_SIZE,
+	.preallocate = 0,
+	.dir_blocks = 0,
+	.refcount = 0,
+	.checksum = 0,
+	.compress = 0,
+};
+
+int format_layout(size_t nblocks, const struct fs_format_opts *opts,
+		  struct layout *lay)
+{
+	if (!opts)
+		opts = &default_opts;
+	lay->block_size = opts->block_size ? opts->block_size : BLOCK_SIZE;
+
+	if (lay->block_size < (1 << MIN_SHIFT) || lay->block_size > (1 << MAX_SHIFT)
+	    || (lay->block_size & (lay->block_size - 1))
+	    || (!opts->wide && lay->block_size != BLOCK_SIZE)) {
+		format_error("invalid block size '%zu'", lay->block_size);
+		return -1;
+	}
+
+	if (!opts->wide && (opts->dir_blocks || opts->refcount || opts->checksum
+			    || opts->compress)) {
+		format_error("hashed directories, clones, checksums and compression"
+			     " need the wide format");
+		return -1;
+	}
+
+	/*
+	 * Superblock, FAT blocks, reference counts, checksums, root directory,
+	 * then the data blocks
+	 */
+	lay->fat_blocks = (nblocks * (opts->wide ? 4 : 2) + lay->block_size - 1)
+		/ lay->block_size;
+	lay->refcnt_index = opts->refcount ? 1 + lay->fat_blocks : 0;
+	lay->refcnt_blocks = opts->refcount ?
+		(nblocks * 2 + lay->block_size - 1) / lay->block_size : 0;
+	lay->dir_blocks = opts->dir_blocks ? opts->dir_blocks : 1;
+	lay->csum_index = opts->checksum ? 1 + lay->fat_blocks + lay->refcnt_blocks : 0;
+	lay->csum_blocks = 0;
+	/* Every block has a checksum, including those of the region itself */
+	while (opts->checksum && lay->csum_blocks * lay->block_size / 4
+	       < lay->csum_index + lay->csum_blocks + lay->dir_blocks + nblocks)
+		lay->csum_blocks++;
+	lay->root_index = 1 + lay->fat_blocks + lay->refcnt_blocks + lay->csum_blocks;
+	lay->data_start = lay->root_index + lay->dir_blocks;
+	lay->total = lay->data_start + nblocks;
+
+	if (nblocks < 1 || (!opts->wide && nblocks > LEGACY_MAX_DATA_BLOCKS)
+	    || (opts->wide && (nblocks > INT_MAX || lay->dir_blocks > INT_MAX
+			       || lay->total > INT_MAX))) {
+		format_error("data block count '%zu' out of range", nblocks);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Emit @count blocks starting at block 0: the superblock then zero blocks,
+ * except for the first FAT block. As many blocks as the system allows go into
+ * each pwritev(), which for any reasonable image means a single call.
+ */
+static int write_metadata(int fd, size_t bsize, void *super, void *fat0,
+			  void *zero, size_t count)
+{
+	struct iovec iov[IOV_MAX];
+	size_t block = 0;
+
+	while (block < count) {
+		size_t n = 0;
+		off_t start = (off_t)block * bsize;
+
+		for (; n < IOV_MAX && block < count; n++, block++) {
+			if (block == 0)
+				iov[n].iov_base = super;
+			else if (block == 1)
+				iov[n].iov_base = fat0;
+			else
+				iov[n].iov_base = zero;
+			iov[n].iov_len = bsize;
+		}
+
+		if (pwritev(fd, iov, n, start) != (ssize_t)(n * bsize)) {
+			perror("pwritev");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Lay out the same blocks through the disk layer, for disks named with a
+ * backend prefix rather than plain image files.
+ */
+static int format_dev(const char *diskname, const struct layout *lay,
+		      void *super, void *fat0, void *zero)
+{
+	size_t i;
+	int ret = 0;
+
+	if (block_disk_create(diskname, (size_t)lay->total * lay->block_size)
+	    || block_disk_open(diskname))
+		return -1;
+
+	if (lay->block_size != BLOCK_SIZE
+	    && block_disk_set_block_size(lay->block_size))
+		ret = -1;
+
+	block_plug();
+	for (i = 0; i < lay->data_start && !ret; i++)
+		ret = block_write_many(i, 1, i == 0 ? super : i == 1 ? fat0 : zero);
+	if (block_unplug())
+		ret = -1;
+
+	if (block_disk_close())
+		ret = -1;
+	return ret;
+}
+
+int fs_format(const char *diskname, size_t nblocks,
+	      const struct fs_format_opts *opts)
+{
+	uint8_t *super, *fat0, *zero;
+	struct layout lay;
+	size_t bsize;
+	int fd, ret = -1;
+
+	if (!opts)
+		opts = &default_opts;
+
+	if (!diskname) {
+		format_error("invalid diskname");
+		return -1;
+	}
+
+	if (format_layout(nblocks, opts, &lay))
+		return -1;
+	bsize = lay.block_size;
+
+	super = calloc(3, bsize);
+	if (!super) {
+		perror("calloc");
+		return -1;
+	}
+	fat0 = super + bsize;
+	zero = fat0 + bsize;
+
+	if (opts->wide) {
+		struct superblock_wide *sb = (struct superblock_wide*)super;
+
+		memcpy(sb->signature, FMT_WIDE, 8);
+		sb->total_block_amount = lay.total;
+		sb->root_block_index = lay.root_index;
+		sb->data_block_start_index = lay.data_start;
+		sb->data_block_amount = nblocks;
+		sb->fat_block_count = lay.fat_blocks;
+		sb->block_size = bsize;
+		if (opts->dir_blocks) {
+			/* Empty blocks are valid hashed directory blocks */
+			sb->flags |= FEAT_HASHDIR;
+			sb->root_block_count = lay.dir_blocks;
+		}
+		if (opts->refcount) {
+			/* Zero means a block has a single owner */
+			sb->flags |= FEAT_REFCOUNT;
+			sb->refcnt_block_index = lay.refcnt_index;
+			sb->refcnt_block_count = lay.refcnt_blocks;
+		}
+		if (opts->checksum) {
+			/* Zero means a checksum is not known yet */
+			sb->flags |= FEAT_CHECKSUM;
+			sb->csum_block_index = lay.csum_index;
+			sb->csum_block_count = lay.csum_blocks;
+		}
+		if (opts->compress)
+			sb->flags |= FEAT_COMPRESS;
+		/* Data block 0 is never handed out */
+		((uint32_t*)fat0)[0] = FAT_EOC;
+	} else {
+		struct superblock *sb = (struct superblock*)super;
+
+		memcpy(sb->signature, FMT_LEGACY, 8);
+		sb->total_block_amount = lay.total;
+		sb->root_block_index = lay.root_index;
+		sb->data_block_start_index = lay.data_start;
+		sb->data_block_amount = nblocks;
+		sb->fat_block_count = lay.fat_blocks;
+		((uint16_t*)fat0)[0] = FAT_EOC16;
+	}
+
+	if (strchr(diskname, ':')) {
+		ret = format_dev(diskname, &lay, super, fat0, zero);
+		goto out_free;
+	}
+
+	fd = open(diskname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("open");
+		goto out_free;
+	}
+
+	/* Size the image, reserving its space only when asked to */
+	if (opts->preallocate) {
+		if (fallocate(fd, 0, 0, (off_t)lay.total * bsize)
+		    && (errno != EOPNOTSUPP
+			|| ftruncate(fd, (off_t)lay.total * bsize))) {
+			perror("fallocate");
+			goto out_close;
+		}
+	} else if (ftruncate(fd, (off_t)lay.total * bsize)) {
+		perror("ftruncate");
+		goto out_close;
+	}
+
+	ret = write_metadata(fd, bsize, super, fat0, zero, lay.data_start);
+
+out_close:
+	if (close(fd) && !ret) {
+		perror("close");
+		ret = -1;
+	}
+	if (ret)
+		unlink(diskname);
+out_free:
+	free(super);
+	return ret;
+}
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -6,143 +7,488 @@
 
 #include "disk.h"
 #include "fs.h"
+#include "lz.h"
+#include "private.h"
+#include "trace.h"
 
-#define FAT_EOC 0xFFFF
-#define MAXI_SIZE 4096
-
-//memory layout of the superblock
-struct __attribute__ ((__packed__)) superblock {
-	uint8_t signature[8];
-	uint16_t total_block_amount;
-	uint16_t root_block_index;
-	uint16_t data_block_start_index;
-	uint16_t data_block_amount;
-	uint8_t fat_block_count;
-	uint8_t padding[4079];
+//geometry of the mounted file system, whatever its on-disk format
+struct volume {
+	int wide;
+	uint32_t total_block_amount;
+	uint32_t root_block_index;
+	uint32_t data_block_start_index;
+	uint32_t data_block_amount;
+	uint32_t fat_block_count;
+	uint32_t block_size;
+	uint32_t block_shift;
+	//root directory: a single block, or hashed over several blocks
+	int hashed;
+	uint32_t root_block_count;
+	uint32_t dir_slots; //file entries per directory block
+	//reference counts, when files can be cloned
+	uint32_t refcnt_block_index;
+	uint32_t refcnt_block_count;
+	//block checksums, verified by the disk layer
+	uint32_t csum_block_index;
+	uint32_t csum_block_count;
+	//files may be stored compressed
+	int compress;
+	//mounted with fs_mount_ro(): no mutation, metadata read in place if @mapped
+	int ro;
+	int mapped;
 };
-//memory layout of an individual file entry
-struct __attribute__ ((__packed__)) fileentry {
-	uint8_t filename[FS_FILENAME_LEN];
-	uint32_t file_size;
-	uint16_t first_data_block_index;
-	uint8_t padding[10];
+//unit map of an open compressed file, shared by its file descriptors
+struct cmap {
+	int users;
+	uint32_t units;
+	uint32_t map_blocks;
+	uint32_t *len; //stored length of every unit, whole blocks as on disk
+	uint32_t *start; //first block of every unit, counted from the end of the map
+	uint32_t *map_index; //data blocks holding the map
+	uint8_t *dirty; //map blocks changed since they were last written
+	uint8_t *ubuf; //content of unit @cached
+	uint32_t cached;
+	uint8_t *cbuf; //compressed unit, padded to whole blocks
 };
 //open file
 struct openfile {
 	struct fileentry *file;
 	uint32_t offset;
+	//last block visited in the chain, so sequential I/O does not rewalk it
+	uint32_t cur_block;
+	uint32_t cur_lblock;
+	uint32_t cur_prev;
+	//the first @owned blocks are not shared with clones, @owned_last ends them
+	uint32_t owned;
+	uint32_t owned_last;
+	//unit map, compressed files only
+	struct cmap *cmap;
+	//fileinfo generation the cached positions above belong to
+	uint32_t gen;
+	//next free descriptor, while this one is free
+	int next_free;
+};
+//in-memory state of a directory entry, for as long as the volume is mounted
+struct fileinfo {
+	uint32_t opens; //descriptors open on the file
+	uint32_t gen; //bumped when the chain changes shape under open descriptors
+	struct cmap *cmap; //unit map shared by the descriptors of a compressed file
+};
+//block transfer loops, specialized for one block size
+struct xfer_ops {
+	int (*read)(struct openfile *of, uint8_t *buf, size_t count);
+	int (*write)(struct openfile *of, const uint8_t *buf, size_t count);
 };
 
-static struct superblock *super_block;
-static uint16_t *FAT; //array to be size data block amount
-static struct fileentry *rootdirectory; //array to have size 128
-static uint16_t num_free_data_blocks;
+static struct volume *super_block;
+static void *FAT; //fat blocks as stored on disk, 16 or 32-bit entries
+static struct fileentry *rootdirectory; //every block of the root directory
+static uint32_t num_free_data_blocks;
+static uint32_t fat_hint; //where the next free block search starts
 static int num_empty_entries;
-static struct openfile *openfile_table;
+static int num_entries; //capacity of the root directory
+static uint16_t *refcnt; //extra references per data block, NULL if not kept
+static uint32_t num_shared_blocks; //data blocks with extra references
+static struct fileinfo *fileinfo; //one per slot of the root directory
+static struct openfile *openfile_table; //grows as files are opened
+static int openfile_cap;
+static int openfile_free; //first free descriptor, -1 if the table is full
+static int num_open;
+static uint8_t *bounce; //one block, for partial block transfers
+static const struct xfer_ops *xfer;
+static const struct xfer_ops xfer_table[MAX_SHIFT - MIN_SHIFT + 1];
 
-int fs_mount(const char *diskname)
+static uint32_t fat_get(uint32_t index)
+{
+	if (super_block->wide) return ((uint32_t*)FAT)[index];
+	uint16_t entry = ((uint16_t*)FAT)[index];
+	return entry == FAT_EOC16 ? FAT_EOC : entry;
+}
+
+static void fat_set(uint32_t index, uint32_t value)
 {
-	super_block = (struct superblock*) malloc(sizeof(struct superblock));
-	rootdirectory = (struct fileentry*) malloc(FS_FILE_MAX_COUNT * sizeof(struct fileentry));
-	openfile_table = (struct openfile*) malloc(FS_OPEN_MAX_COUNT * sizeof(struct openfile));
+	if (super_block->wide) ((uint32_t*)FAT)[index] = value;
+	else ((uint16_t*)FAT)[index] = value == FAT_EOC ? FAT_EOC16 : value;
+}
 
-	int dopenret = block_disk_open(diskname);
+static uint32_t entry_first(struct fileentry *file)
+{
+	if (super_block->wide) return file->first_data_block_index | (uint32_t)file->first_data_block_hi << 16;
+	return file->first_data_block_index == FAT_EOC16 ? FAT_EOC : file->first_data_block_index;
+}
 
-	int readret1 = block_read(0, super_block);
-	//check for failed operations
-	if (!super_block || !rootdirectory || !openfile_table || dopenret == -1 || readret1 == -1 || block_disk_count() != super_block->total_block_amount) {
-		fs_umount();
-		return -1;
+static void entry_set_first(struct fileentry *file, uint32_t index)
+{
+	file->first_data_block_index = index & 0xFFFF;
+	file->first_data_block_hi = super_block->wide ? index >> 16 : 0;
+}
+
+//file entry @i of root directory block @block
+static struct fileentry *dir_slot(uint32_t block, uint32_t i)
+{
+	struct fileentry *base = (struct fileentry*)((uint8_t*)rootdirectory + ((size_t)block << super_block->block_shift));
+	return base + super_block->hashed + i;
+}
+
+static struct dirheader *dir_header(uint32_t block)
+{
+	return (struct dirheader*)((uint8_t*)rootdirectory + ((size_t)block << super_block->block_shift));
+}
+
+static uint32_t dir_block_of(struct fileentry *file)
+{
+	return ((uint8_t*)file - (uint8_t*)rootdirectory) >> super_block->block_shift;
+}
+
+static uint32_t dir_home(const char *filename)
+{
+	return super_block->hashed ? dir_hash(filename, super_block->root_block_count) : 0;
+}
+
+static struct fileinfo *file_info(struct fileentry *file)
+{
+	return &fileinfo[file - rootdirectory];
+}
+
+//forget positions cached by @of if the file's chain changed since
+static inline void of_sync(struct openfile *of)
+{
+	uint32_t gen = file_info(of->file)->gen;
+	if (of->gen == gen) return;
+	of->gen = gen;
+	of->cur_block = FAT_EOC;
+	of->owned = 0;
+}
+
+//double the descriptor table, chaining the new descriptors as free
+static int fd_table_grow(void)
+{
+	if (openfile_cap > INT_MAX / 2) return -1;
+	int cap = openfile_cap ? openfile_cap * 2 : FS_OPEN_MAX_COUNT;
+	struct openfile *table = (struct openfile*) realloc(openfile_table, cap * sizeof(struct openfile));
+	if (!table) return -1;
+	for (int i = cap - 1; i >= openfile_cap; i--) {
+		table[i].file = NULL;
+		table[i].cmap = NULL;
+		table[i].next_free = openfile_free;
+		openfile_free = i;
 	}
-	//check for signature
-	uint8_t fmt[8] = {'E', 'C', 'S', '1', '5', '0', 'F', 'S'};
-	for (int i = 0; i < 8; i++) {
-		if (fmt[i] != super_block->signature[i]) {
-			fs_umount();
-			return -1;
+	openfile_table = table;
+	openfile_cap = cap;
+
+	return 0;
+}
+
+//write back the only directory block a change touched
+static void dir_flush(uint32_t block)
+{
+	block_write(super_block->root_block_index + block, (uint8_t*)rootdirectory + ((size_t)block << super_block->block_shift));
+}
+
+/*
+find the entry of @filename. in a hashed directory this only scans
+its home block, unless entries hashed there had to be stored further.
+*/
+static struct fileentry *dir_lookup(const char *filename)
+{
+	uint32_t home = dir_home(filename);
+
+	for (uint32_t k = 0; k < super_block->root_block_count; k++) {
+		uint32_t block = (home + k) % super_block->root_block_count;
+		for (uint32_t i = 0; i < super_block->dir_slots; i++) {
+			struct fileentry *file = dir_slot(block, i);
+			if (!strcmp((char*)file->filename, filename)) return file;
+		}
+		if (!super_block->hashed || dir_header(home)->overflow == 0) break;
+	}
+
+	return NULL;
+}
+
+//claim an empty entry for @filename, in its home block when there is room
+static struct fileentry *dir_insert(const char *filename)
+{
+	uint32_t home = dir_home(filename);
+
+	for (uint32_t k = 0; k < super_block->root_block_count; k++) {
+		uint32_t block = (home + k) % super_block->root_block_count;
+		if (super_block->hashed && dir_header(block)->used == super_block->dir_slots) continue;
+		for (uint32_t i = 0; i < super_block->dir_slots; i++) {
+			struct fileentry *file = dir_slot(block, i);
+			if (file->filename[0] != '\0') continue;
+			memset(file, 0, sizeof(struct fileentry));
+			strcpy((char*)file->filename, filename);
+			if (super_block->hashed) {
+				dir_header(block)->used++;
+				if (block != home) {
+					dir_header(home)->overflow++;
+					dir_flush(home);
+				}
+			}
+			return file;
 		}
 	}
 
-	FAT = (uint16_t*) malloc(super_block->fat_block_count * sizeof(struct superblock));
+	return NULL;
+}
 
-	int readret2 = block_read(super_block->root_block_index, rootdirectory);
-	//check for failed operations
-	if (!FAT || readret2 == -1) {
-		fs_umount();
+//release @file, the caller flushes the block holding it
+static void dir_remove(struct fileentry *file)
+{
+	uint32_t block = dir_block_of(file);
+
+	if (super_block->hashed) {
+		uint32_t home = dir_home((char*)file->filename);
+		dir_header(block)->used--;
+		if (block != home) {
+			dir_header(home)->overflow--;
+			dir_flush(home);
+		}
+	}
+	file->filename[0] = '\0';
+}
+
+//write the whole FAT back to disk, it must not change until the disk is unplugged
+static void fat_flush(void)
+{
+	block_write_many(1, super_block->fat_block_count, FAT);
+}
+
+//write back the reference counts, all of them or only the block holding @index's
+static void refcnt_flush(uint32_t index)
+{
+	uint32_t per_block = super_block->block_size / sizeof(uint16_t);
+
+	if (index == FAT_EOC) {
+		block_write_many(super_block->refcnt_block_index, super_block->refcnt_block_count, refcnt);
+		return;
+	}
+	uint32_t i = index / per_block;
+	block_write(super_block->refcnt_block_index + i, (uint8_t*)refcnt + ((size_t)i << super_block->block_shift));
+}
+
+//take one more reference on data block @index
+static void ref_get(uint32_t index)
+{
+	if (refcnt[index]++ == 0) num_shared_blocks++;
+}
+
+//drop a reference on @index, returns whether other owners are left
+static int ref_put(uint32_t index)
+{
+	if (!refcnt || refcnt[index] == 0) return 0;
+	if (--refcnt[index] == 0) num_shared_blocks--;
+	return 1;
+}
+
+//decode either superblock format into the mounted volume description
+static int read_superblock(const void *block, struct volume *v)
+{
+	const struct superblock *sb = block;
+	const struct superblock_wide *wsb = block;
+
+	if (!memcmp(sb->signature, FMT_LEGACY, 8)) {
+		v->wide = 0;
+		v->total_block_amount = sb->total_block_amount;
+		v->root_block_index = sb->root_block_index;
+		v->data_block_start_index = sb->data_block_start_index;
+		v->data_block_amount = sb->data_block_amount;
+		v->fat_block_count = sb->fat_block_count;
+		v->block_size = BLOCK_SIZE;
+		v->hashed = 0;
+		v->root_block_count = 1;
+		v->refcnt_block_index = 0;
+		v->refcnt_block_count = 0;
+		v->csum_block_index = 0;
+		v->csum_block_count = 0;
+		v->compress = 0;
+	} else if (!memcmp(wsb->signature, FMT_WIDE, 8)) {
+		v->wide = 1;
+		v->total_block_amount = wsb->total_block_amount;
+		v->root_block_index = wsb->root_block_index;
+		v->data_block_start_index = wsb->data_block_start_index;
+		v->data_block_amount = wsb->data_block_amount;
+		v->fat_block_count = wsb->fat_block_count;
+		v->block_size = wsb->block_size ? wsb->block_size : BLOCK_SIZE;
+		//refuse extensions this code does not know about
+		if (wsb->flags & ~FEAT_KNOWN) return -1;
+		v->hashed = (wsb->flags & FEAT_HASHDIR) != 0;
+		v->root_block_count = v->hashed ? wsb->root_block_count : 1;
+		if (v->root_block_count == 0) return -1;
+		v->refcnt_block_index = wsb->flags & FEAT_REFCOUNT ? wsb->refcnt_block_index : 0;
+		v->refcnt_block_count = wsb->flags & FEAT_REFCOUNT ? wsb->refcnt_block_count : 0;
+		if ((wsb->flags & FEAT_REFCOUNT) && (uint64_t)v->refcnt_block_count * (wsb->block_size ? wsb->block_size : BLOCK_SIZE) / 2 < v->data_block_amount) return -1;
+		v->csum_block_index = wsb->flags & FEAT_CHECKSUM ? wsb->csum_block_index : 0;
+		v->csum_block_count = wsb->flags & FEAT_CHECKSUM ? wsb->csum_block_count : 0;
+		if ((wsb->flags & FEAT_CHECKSUM) && v->csum_block_count == 0) return -1;
+		v->compress = (wsb->flags & FEAT_COMPRESS) != 0;
+	} else {
 		return -1;
 	}
-	//fill FAT
-	for (unsigned int i = 1; i <= super_block->fat_block_count; i++) {
-		int readret = block_read(i, FAT + (i - 1)*(MAXI_SIZE / 2));
-		//check for failed read
-		if (readret == -1) {
-			fs_umount();
-			return -1;
-		}
+	//block size must be a power of two the disk layer supports
+	for (v->block_shift = MIN_SHIFT; v->block_shift <= MAX_SHIFT && (1u << v->block_shift) != v->block_size; v->block_shift++);
+	if (v->block_shift > MAX_SHIFT) return -1;
+	if ((uint64_t)v->root_block_index + v->root_block_count > v->data_block_start_index) return -1;
+	//classic directories keep their 128 entries whatever the block size
+	v->dir_slots = v->hashed ? v->block_size / sizeof(struct fileentry) - 1 : FS_FILE_MAX_COUNT;
+	//fat must be large enough to describe every data block
+	uint32_t per_block = v->block_size / (v->wide ? 4 : 2);
+	if (v->data_block_amount == 0 || (uint64_t)v->fat_block_count * per_block < v->data_block_amount) return -1;
+
+	return 0;
+}
+
+static int do_umount(void);
+
+//@count blocks from @index: in place when the disk is mapped, else a private copy
+static void *load_blocks(uint32_t index, uint32_t count)
+{
+	if (super_block->mapped) return (void*) block_disk_map(index, count);
+	void *buf = malloc((size_t)count << super_block->block_shift);
+	if (buf && block_read_many(index, count, buf) == -1) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+static void unload_blocks(void *buf)
+{
+	if (!super_block->mapped) free(buf);
+}
+
+static int mount(const char *diskname, int ro)
+{
+	if (super_block) return -1;
+	super_block = (struct volume*) malloc(sizeof(struct volume));
+	openfile_table = NULL;
+	openfile_cap = 0;
+	openfile_free = -1;
+	num_open = 0;
+	int tableret = fd_table_grow();
+	uint8_t *block0 = (uint8_t*) malloc(BLOCK_SIZE);
+
+	int dopenret = ro ? block_disk_open_ro(diskname) : block_disk_open(diskname);
+	int readret1 = dopenret == -1 || !block0 ? -1 : block_read(0, block0);
+	//check for failed operations and for signature
+	if (!super_block || tableret == -1 || readret1 == -1 || read_superblock(block0, super_block) == -1
+	|| (super_block->block_size != BLOCK_SIZE && block_disk_set_block_size(super_block->block_size) == -1)
+	|| (uint32_t)block_disk_count() != super_block->total_block_amount
+	|| (super_block->csum_block_count && block_disk_set_checksums(super_block->csum_block_index, super_block->csum_block_count) == -1)) {
+		free(block0);
+		if (dopenret != -1) block_disk_close();
+		free(super_block);
+		free(openfile_table);
+		openfile_table = NULL;
+		super_block = NULL;
+		return -1;
+	}
+	free(block0);
+	//read-only mounts of a mapped disk share its pages with every other reader
+	super_block->ro = ro;
+	super_block->mapped = ro && block_disk_map(0, 1);
+
+	//the root directory occupies whole blocks even if only 128 entries are used,
+	//it is filled like the FAT with a single transfer
+	FAT = load_blocks(1, super_block->fat_block_count);
+	rootdirectory = (struct fileentry*) load_blocks(super_block->root_block_index, super_block->root_block_count);
+	bounce = (uint8_t*) malloc(super_block->block_size);
+	fileinfo = (struct fileinfo*) calloc(((size_t)super_block->root_block_count << super_block->block_shift) / sizeof(struct fileentry), sizeof(struct fileinfo));
+	xfer = &xfer_table[super_block->block_shift - MIN_SHIFT];
+
+	//check for failed operations
+	if (!FAT || !rootdirectory || !bounce || !fileinfo) {
+		do_umount();
+		return -1;
 	}
 	//count number of free data blocks
 	num_free_data_blocks = super_block->data_block_amount;
-	for (uint16_t i = 0; i < super_block->data_block_amount; i++) {
-		if (FAT[i] != 0) {
+	for (uint32_t i = 0; i < super_block->data_block_amount; i++) {
+		if (fat_get(i) != 0) {
 			num_free_data_blocks--;
 		}
 	}
-	//count number of empty file entries
-	num_empty_entries = FS_FILE_MAX_COUNT;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (rootdirectory[i].filename[0] != '\0') {
-			num_empty_entries--;
+	fat_hint = 0;
+	//load reference counts
+	if (super_block->refcnt_block_count) {
+		refcnt = (uint16_t*) load_blocks(super_block->refcnt_block_index, super_block->refcnt_block_count);
+		if (!refcnt) {
+			do_umount();
+			return -1;
+		}
+		num_shared_blocks = 0;
+		for (uint32_t i = 0; i < super_block->data_block_amount; i++) {
+			if (refcnt[i]) num_shared_blocks++;
 		}
 	}
-	//empty fd table
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		openfile_table[i].file = NULL;
-		openfile_table[i].offset = 0;
+	//count number of empty file entries
+	num_entries = super_block->root_block_count * super_block->dir_slots;
+	num_empty_entries = num_entries;
+	for (uint32_t b = 0; b < super_block->root_block_count; b++) {
+		for (uint32_t i = 0; i < super_block->dir_slots; i++) {
+			if (dir_slot(b, i)->filename[0] != '\0') {
+				num_empty_entries--;
+			}
+		}
 	}
 
 	return 0;
 }
 
-int fs_umount(void)
+static int do_umount(void)
 {
 	if (!super_block) return -1;
 	//check for open file
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		if (openfile_table[i].file)  return -1;
-	}
+	if (num_open) return -1;
 	int ret = block_disk_close();
 	if (ret == -1) return -1;
-	//reset data
+	//reset data, the disk's mapping went away with it
+	unload_blocks(FAT);
+	unload_blocks(rootdirectory);
+	unload_blocks(refcnt);
 	free(super_block);
-	free(FAT);
-	free(rootdirectory);
 	free(openfile_table);
+	free(fileinfo);
+	free(bounce);
+	refcnt = NULL;
+	num_shared_blocks = 0;
 	num_free_data_blocks = 0;
 	num_empty_entries = 0;
 	super_block = NULL;
 	FAT = NULL;
 	rootdirectory = NULL;
+	openfile_table = NULL;
+	openfile_cap = 0;
+	fileinfo = NULL;
+	bounce = NULL;
 
 	return 0;
 }
 
-int fs_info(void)
+static int do_info(void)
 {
 	if (!super_block) return -1;
 	printf("FS Info:\n");
-	printf("total_blk_count=%d\n", super_block->total_block_amount);
-	printf("fat_blk_count=%d\n", super_block->fat_block_count);
-	printf("rdir_blk=%d\n", super_block->root_block_index);
-	printf("data_blk=%d\n", super_block->data_block_start_index);
-	printf("data_blk_count=%d\n", super_block->data_block_amount);
-	printf("fat_free_ratio=%d/%d\n", num_free_data_blocks, super_block->data_block_amount);
-	printf("rdir_free_ratio=%d/%d\n", num_empty_entries, FS_FILE_MAX_COUNT);
+	printf("total_blk_count=%u\n", super_block->total_block_amount);
+	printf("fat_blk_count=%u\n", super_block->fat_block_count);
+	printf("rdir_blk=%u\n", super_block->root_block_index);
+	printf("data_blk=%u\n", super_block->data_block_start_index);
+	printf("data_blk_count=%u\n", super_block->data_block_amount);
+	printf("fat_free_ratio=%u/%u\n", num_free_data_blocks, super_block->data_block_amount);
+	printf("rdir_free_ratio=%d/%d\n", num_empty_entries, num_entries);
+	if (super_block->wide) {
+		printf("fat_entry_bits=32\n");
+		printf("blk_size=%u\n", super_block->block_size);
+	}
+	if (super_block->hashed) printf("rdir_blk_count=%u\n", super_block->root_block_count);
+	if (refcnt) printf("shared_blk_count=%u\n", num_shared_blocks);
+	if (super_block->csum_block_count) printf("csum_blk_count=%u\n", super_block->csum_block_count);
 	return 0;
 }
 
-int fs_create(const char *filename)
+static int do_create(const char *filename)
 {
-	if (!super_block) return -1;
+	if (!super_block || super_block->ro || !filename) return -1;
 	//check for space
 	if (num_empty_entries < 1) return -1;
 	int len = strlen(filename) + 1;
@@ -151,278 +497,930 @@ int fs_create(const char *filename)
 		return -1;
 	}
 	//check if filename exists
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (!strcmp((char*)rootdirectory[i].filename, filename)) {
-			return -1;
-		}
-	}
+	if (dir_lookup(filename)) return -1;
 
-	//identify empty file entry
-	int index;
-	for (index = 0; rootdirectory[index].filename[0] != '\0'; index++);
-	//fill entry
-	strcpy((char*)rootdirectory[index].filename, filename);
-	rootdirectory[index].file_size = 0;
-	rootdirectory[index].first_data_block_index = FAT_EOC;
+	//identify empty file entry and fill it
+	struct fileentry *file = dir_insert(filename);
+	if (!file) return -1;
+	file->file_size = 0;
+	entry_set_first(file, FAT_EOC);
 	//write root block to disk
-	block_write(super_block->root_block_index, rootdirectory);
+	dir_flush(dir_block_of(file));
 	num_empty_entries--;
 
 	return 0;
 }
 
-int fs_delete(const char *filename)
+static int do_delete(const char *filename)
 {
-	if (!super_block) return -1;
+	if (!super_block || super_block->ro || !filename) return -1;
 	//check if filename exists
-	int index = -1;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (!strcmp((char*)rootdirectory[i].filename, filename)) {
-			index = i;
-			break;
-		}
-	}
-	if (index == -1) return -1;
+	struct fileentry *file = dir_lookup(filename);
+	if (!file) return -1;
 	//need to check if file is open and return -1 if so
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		if (openfile_table[i].file && !strcmp((char*)openfile_table[i].file->filename, filename))  return -1;
-	}
-	//update data
-	uint16_t bindex = rootdirectory[index].first_data_block_index;
+	if (file_info(file)->opens) return -1;
+	//update data, the chain is shared with clones from the first shared block on
+	uint32_t bindex = entry_first(file);
+	int shared = 0;
 	while (bindex != FAT_EOC) {
-		uint16_t next = FAT[bindex];
-		FAT[bindex] = 0;
+		if (ref_put(bindex)) {
+			shared = 1;
+			break;
+		}
+		uint32_t next = fat_get(bindex);
+		fat_set(bindex, 0);
+		if (bindex < fat_hint) fat_hint = bindex;
 		bindex = next;
 		num_free_data_blocks++;
 	}
-	rootdirectory[index].filename[0] = '\0';
+	dir_remove(file);
 	num_empty_entries++;
 
 	//write to disk
-	for (uint8_t i = 1; i <= super_block->fat_block_count; i++) {
-		block_write(i, FAT + (i - 1)*(MAXI_SIZE / 2));
+	block_plug();
+	fat_flush();
+	if (shared) refcnt_flush(bindex);
+	dir_flush(dir_block_of(file));
+	block_unplug();
+
+	return 0;
+}
+
+static int do_clone(const char *src, const char *dst)
+{
+	if (!super_block || super_block->ro || !refcnt || !src || !dst) return -1;
+	//check for space
+	if (num_empty_entries < 1) return -1;
+	int len = strlen(dst) + 1;
+	//check for appropriate length
+	if (!(len >= 2 && len <= FS_FILENAME_LEN)) {
+		return -1;
 	}
-	block_write(super_block->root_block_index, rootdirectory);
+	struct fileentry *from = dir_lookup(src);
+	if (!from || dir_lookup(dst)) return -1;
+	uint32_t first = entry_first(from);
+	//extra references are counted on 16 bits
+	if (first != FAT_EOC && refcnt[first] == UINT16_MAX) return -1;
+
+	//the new entry shares the whole chain, only its head gains a reference
+	uint32_t size = from->file_size;
+	file_info(from)->gen++;
+	struct fileentry *file = dir_insert(dst);
+	if (!file) return -1;
+	file->file_size = size;
+	file->flags = from->flags;
+	entry_set_first(file, first);
+	if (first != FAT_EOC) {
+		ref_get(first);
+		refcnt_flush(first);
+	}
+	dir_flush(dir_block_of(file));
+	num_empty_entries--;
 
 	return 0;
 }
 
-int fs_ls(void)
+static int do_compress(const char *filename)
+{
+	if (!super_block || super_block->ro || !super_block->compress || !filename) return -1;
+	struct fileentry *file = dir_lookup(filename);
+	//units are laid out from the first write on
+	if (!file || file->file_size || entry_first(file) != FAT_EOC || file_info(file)->opens) return -1;
+	file->flags |= ENTRY_COMPRESSED;
+	dir_flush(dir_block_of(file));
+
+	return 0;
+}
+
+static int do_ls(void)
 {
 	if (!super_block) return -1;
 
 	printf("FS Ls:\n");
 	//print information for all files
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (rootdirectory[i].filename[0] != '\0') {
-			printf("file: %s, size: %d, data_blk: %d\n", rootdirectory[i].filename, rootdirectory[i].file_size, 
-			rootdirectory[i].first_data_block_index);
+	for (uint32_t b = 0; b < super_block->root_block_count; b++) {
+		for (uint32_t i = 0; i < super_block->dir_slots; i++) {
+			struct fileentry *file = dir_slot(b, i);
+			if (file->filename[0] == '\0') continue;
+			uint32_t first = entry_first(file);
+			printf("file: %s, size: %u, data_blk: %u\n", file->filename, file->file_size,
+			super_block->wide ? first : (first & 0xFFFF));
 		}
 	}
 
 	return 0;
 }
 
+//number of blocks holding @bytes bytes
+static uint32_t blocks_of(uint32_t bytes)
+{
+	return ((uint64_t)bytes + super_block->block_size - 1) >> super_block->block_shift;
+}
 
-int fs_open(const char *filename)
+static void cmap_free(struct cmap *m)
 {
-	if (!super_block) return -1;
+	free(m->len);
+	free(m->start);
+	free(m->map_index);
+	free(m->dirty);
+	free(m->ubuf);
+	free(m->cbuf);
+	free(m);
+}
 
-	//find entry
-	int index = -1;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (!strcmp((char*)rootdirectory[i].filename, filename)) {
-			index = i;
-			break;
-		}
+//make room for a map of @to blocks instead of @from, with at least one block
+static int cmap_resize(struct cmap *m, uint32_t from, uint32_t to)
+{
+	size_t n = to ? to : 1;
+	size_t entries = (n << super_block->block_shift) / sizeof(uint32_t);
+	size_t old = ((size_t)from << super_block->block_shift) / sizeof(uint32_t);
+	uint32_t *len = realloc(m->len, entries * sizeof(uint32_t));
+	if (len) m->len = len;
+	uint32_t *start = realloc(m->start, (entries + 1) * sizeof(uint32_t));
+	if (start) m->start = start;
+	uint32_t *map_index = realloc(m->map_index, n * sizeof(uint32_t));
+	if (map_index) m->map_index = map_index;
+	uint8_t *dirty = realloc(m->dirty, n);
+	if (dirty) m->dirty = dirty;
+	if (!len || !start || !map_index || !dirty) return -1;
+
+	memset(m->len + old, 0, (entries - old) * sizeof(uint32_t));
+	//start[old] may already be the end of the last unit
+	memset(m->start + old + 1, 0, (entries - old) * sizeof(uint32_t));
+	memset(m->dirty + from, 0, n - from);
+
+	return 0;
+}
+
+//load the unit map of @of's file, or share the one of another descriptor
+static int cmap_open(struct openfile *of)
+{
+	struct fileinfo *info = file_info(of->file);
+	if (info->cmap) {
+		of->cmap = info->cmap;
+		of->cmap->users++;
+		return 0;
 	}
-	if (index == -1) return -1;
-	//find empty spot in fd table
-	int tbindex = -1;
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		if (!openfile_table[i].file)  {
-			tbindex = i;
-			break;
+
+	uint32_t usize = CUNIT_BLOCKS << super_block->block_shift;
+	struct cmap *m = (struct cmap*) calloc(1, sizeof(struct cmap));
+	if (!m) return -1;
+	m->users = 1;
+	m->units = ((uint64_t)of->file->file_size + usize - 1) / usize;
+	m->map_blocks = blocks_of(m->units * sizeof(uint32_t));
+	m->cached = FAT_EOC;
+	m->ubuf = (uint8_t*) malloc(usize);
+	m->cbuf = (uint8_t*) malloc(usize);
+	if (!m->ubuf || !m->cbuf || cmap_resize(m, 0, m->map_blocks) == -1) {
+		cmap_free(m);
+		return -1;
+	}
+	m->start[0] = 0;
+	//the map is at the head of the chain
+	uint32_t index = entry_first(of->file);
+	for (uint32_t i = 0; i < m->map_blocks; i++) {
+		if (index == FAT_EOC || block_read(index + super_block->data_block_start_index, (uint8_t*)m->len + ((size_t)i << super_block->block_shift)) == -1) {
+			cmap_free(m);
+			return -1;
 		}
+		m->map_index[i] = index;
+		index = fat_get(index);
 	}
-	if (tbindex == -1) return -1;
-	//update fd table
-	openfile_table[tbindex].file = &rootdirectory[index];
-	openfile_table[tbindex].offset = 0;
+	for (uint32_t u = 0; u < m->units; u++) {
+		m->start[u + 1] = m->start[u] + blocks_of(m->len[u] & ~CMAP_RAW);
+	}
+	of->cmap = info->cmap = m;
+
+	return 0;
+}
+
+static void cmap_close(struct openfile *of)
+{
+	if (of->cmap && --of->cmap->users == 0) {
+		cmap_free(of->cmap);
+		file_info(of->file)->cmap = NULL;
+	}
+	of->cmap = NULL;
+}
+
+static int do_open(const char *filename)
+{
+	if (!super_block || !filename) return -1;
+
+	//find entry
+	struct fileentry *file = dir_lookup(filename);
+	if (!file) return -1;
+	//take the first free descriptor, growing the table when there is none
+	if (openfile_free == -1 && fd_table_grow() == -1) return -1;
+	int tbindex = openfile_free;
+	struct openfile *of = &openfile_table[tbindex];
+	of->file = file;
+	of->offset = 0;
+	of->cur_block = FAT_EOC;
+	of->owned = 0;
+	of->gen = file_info(file)->gen;
+	of->cmap = NULL;
+	if (super_block->compress && (file->flags & ENTRY_COMPRESSED) && cmap_open(of) == -1) {
+		of->file = NULL;
+		return -1;
+	}
+	openfile_free = of->next_free;
+	file_info(file)->opens++;
+	num_open++;
 
 	return tbindex;
 }
 
-int fs_close(int fd)
+static int do_close(int fd)
 {
-	if (!super_block || fd < 0 || fd >= FS_OPEN_MAX_COUNT || !openfile_table[fd].file) return -1;
+	if (!super_block || fd < 0 || fd >= openfile_cap || !openfile_table[fd].file) return -1;
 
-	openfile_table[fd].file = NULL;
-	openfile_table[fd].offset = 0;
+	struct openfile *of = &openfile_table[fd];
+	cmap_close(of);
+	file_info(of->file)->opens--;
+	num_open--;
+	of->file = NULL;
+	of->offset = 0;
+	of->next_free = openfile_free;
+	openfile_free = fd;
 
 	return 0;
 }
 
-int fs_stat(int fd)
+static int do_stat(int fd)
 {
-	if (!super_block || fd < 0 || fd >= FS_OPEN_MAX_COUNT || !openfile_table[fd].file) return -1;
+	if (!super_block || fd < 0 || fd >= openfile_cap || !openfile_table[fd].file) return -1;
 
 	return openfile_table[fd].file->file_size;
 }
 
-int fs_lseek(int fd, size_t offset)
+static int do_lseek(int fd, size_t offset)
 {
-	if (!super_block || fd < 0 || fd >= FS_OPEN_MAX_COUNT || !openfile_table[fd].file || offset > openfile_table[fd].file->file_size) return -1;
+	if (!super_block || fd < 0 || fd >= openfile_cap || !openfile_table[fd].file || offset > openfile_table[fd].file->file_size) return -1;
 	openfile_table[fd].offset = offset;
 	return 0;
 }
 /*
-need a function that returns the index of the data block 
+return the index of block number @target of the file's chain.
+@prev receives the block before it in the chain (FAT_EOC for the
+first block).
+*/
+static inline __attribute__((always_inline)) uint32_t chain_walk(struct openfile *of, uint32_t target, uint32_t *prev)
+{
+	of_sync(of);
+	uint32_t index = entry_first(of->file);
+	uint32_t before = FAT_EOC;
+	uint32_t j = 0;
+
+	//resume from the last visited block when it is not past the target
+	if (of->cur_block != FAT_EOC && of->cur_lblock <= target) {
+		index = of->cur_block;
+		before = of->cur_prev;
+		j = of->cur_lblock;
+	}
+	for (; j < target && index != FAT_EOC; j++) {
+		before = index;
+		index = fat_get(index);
+	}
+	*prev = before;
+
+	return index;
+}
+
+/*
+need a function that returns the index of the data block
 corresponding to the file’s offset.
 */
-static uint16_t index_check(int fd)
-{
-	uint16_t index = 0;
-	char* name = (char *)openfile_table[fd].file->filename;
-
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
-	{
-		if(!strcmp((char *)rootdirectory[i].filename, name))
-		{
-			index = rootdirectory[i].first_data_block_index;
-			for (int j = 0; j < (int) (openfile_table[fd].offset / MAXI_SIZE); j++) {
-				index = FAT[index];
-			}
-			break;
-		}
+static inline __attribute__((always_inline)) uint32_t index_check(struct openfile *of, uint32_t *prev, const unsigned shift)
+{
+	return chain_walk(of, of->offset >> shift, prev);
+}
+
+//remember @index as block number @lblock of the file, preceded by @prev
+static inline void index_cache(struct openfile *of, uint32_t index, uint32_t lblock, uint32_t prev)
+{
+	of->cur_block = index;
+	of->cur_lblock = lblock;
+	of->cur_prev = prev;
+}
+
+//claim a free data block, FAT_EOC when the disk is full
+static uint32_t alloc_block(void)
+{
+	if (num_free_data_blocks == 0) return FAT_EOC;
+	//resume searching where the last allocation stopped
+	uint32_t index = fat_hint;
+	while (fat_get(index) != 0) {
+		if (++index == super_block->data_block_amount) index = 0;
 	}
+	fat_set(index, FAT_EOC);
+	fat_hint = index + 1 == super_block->data_block_amount ? 0 : index + 1;
+	num_free_data_blocks--;
 
 	return index;
+}
 
+/*
+a function that allocates a new data block and link
+it at the end of the file’s data block chain, right after @prev.
+*/
+static uint32_t new_block(struct openfile *of, uint32_t prev)
+{
+	uint32_t index = alloc_block();
+	if (index == FAT_EOC) return FAT_EOC;
+	if (prev == FAT_EOC) {
+		entry_set_first(of->file, index);
+	} else {
+		fat_set(prev, index);
+	}
+
+	return index;
 }
 
 /*
-a function that allocates a new data block and link 
-it at the end of the file’s data block chain.
+give @of's file its own copy of every shared block up to block
+number @upto. clones share the tail of a chain, so once a block is
+copied the copy points to the rest of the shared chain, which gains
+a reference. returns 1 if the chain changed, 0 if it did not and
+-1 if the disk filled up on the way.
 */
-static int new_block(int fd)
-{
-	if (!super_block || fd < 0 || fd >= FS_OPEN_MAX_COUNT || !openfile_table[fd].file) return -1;
-	int curr = 0;
-	int index = 0;
-	if(num_free_data_blocks > 0)
-	{
-		for (index = 0; FAT[index] != 0; index++);
-		for (curr = openfile_table[fd].file->first_data_block_index; (curr != FAT_EOC) && (FAT[curr] != FAT_EOC); curr = FAT[curr]);
-		if (curr == FAT_EOC) {
-			openfile_table[fd].file->first_data_block_index = index;
-		} else {
-			FAT[curr] = index;
+static int cow_path(struct openfile *of, uint32_t upto)
+{
+	of_sync(of);
+	//blocks known to be owned already are not walked again
+	uint32_t prev = of->owned ? of->owned_last : FAT_EOC;
+	uint32_t index = of->owned ? fat_get(of->owned_last) : entry_first(of->file);
+	uint32_t j = of->owned;
+	int changed = 0;
+
+	for (; j <= upto && index != FAT_EOC; j++) {
+		if (refcnt[index]) {
+			uint32_t copy = alloc_block();
+			if (copy == FAT_EOC) {
+				changed = -1;
+				break;
+			}
+			size_t start = super_block->data_block_start_index;
+			block_read(index + start, bounce);
+			block_write(copy + start, bounce);
+			uint32_t next = fat_get(index);
+			fat_set(copy, next);
+			if (next != FAT_EOC) ref_get(next);
+			ref_put(index);
+			if (prev == FAT_EOC) entry_set_first(of->file, copy);
+			else fat_set(prev, copy);
+			index = copy;
+			if (!changed) changed = 1;
 		}
-		FAT[index] = FAT_EOC;
-		num_free_data_blocks--;
+		prev = index;
+		index = fat_get(index);
 	}
-	else 
-		return -1;
-	return index;
+	of->owned = j;
+	of->owned_last = prev;
+	//cached positions of this file may point into the old chain
+	if (changed) {
+		of->gen = ++file_info(of->file)->gen;
+		of->cur_block = FAT_EOC;
+	}
+
+	return changed;
 }
 
+/*
+transfer loops, written once and instantiated for every supported
+block size so that offsets are split with constant shifts and masks.
+*/
+static inline __attribute__((always_inline)) int xfer_write(struct openfile *of, const uint8_t *ibuf, size_t count, const unsigned shift)
+{
+	const uint32_t bsize = 1u << shift;
+	uint64_t offset = of->offset;
+	size_t numwrite = 0;
+	int allocated = 0;
+	int copied = 0;
 
-int fs_write(int fd, void *buf, size_t count)
+	//data and metadata writes go out together, sorted and merged
+	block_plug();
+	//blocks shared with clones are copied before being modified
+	of_sync(of);
+	if (num_shared_blocks && of->file->file_size) {
+		uint32_t last = (offset + count - 1) >> shift;
+		uint32_t nblocks = (of->file->file_size - 1) >> shift;
+		if (last > nblocks) last = nblocks;
+		if (last >= of->owned) copied = cow_path(of, last);
+		//out of space, the file is left as it was
+		if (copied < 0) count = 0;
+	}
+	uint32_t prev;
+	uint32_t index = index_check(of, &prev, shift);
+	uint32_t lblock = offset >> shift;
+
+	while (numwrite < count) {
+		int fresh = 0;
+		//extend the file when the chain runs out
+		if (index == FAT_EOC) {
+			index = new_block(of, prev);
+			if (index == FAT_EOC) break;
+			allocated = fresh = 1;
+		}
+		uint32_t boffset = offset & (bsize - 1);
+		uint32_t len = bsize - boffset;
+		if (len > count - numwrite) len = count - numwrite;
+		size_t block = (size_t)index + super_block->data_block_start_index;
+
+		if (len == bsize) {
+			//@ibuf outlives the plug, no need to copy it
+			block_write_many(block, 1, ibuf + numwrite);
+		} else {
+			//partial block, merge with what is already there
+			if (fresh) memset(bounce, 0, bsize);
+			else if (block_read(block, bounce) == -1) break;
+			memcpy(bounce + boffset, ibuf + numwrite, len);
+			block_write(block, bounce);
+		}
+		numwrite += len;
+		offset += len;
+		index_cache(of, index, lblock++, prev);
+		prev = index;
+		index = fat_get(index);
+	}
+
+	if (offset > of->file->file_size) {
+		of->file->file_size = offset;
+	}
+
+	dir_flush(dir_block_of(of->file));
+	if (allocated || copied) fat_flush();
+	if (copied) refcnt_flush(FAT_EOC);
+	block_unplug();
+	of->offset = offset;
+
+	return (int)numwrite;
+}
+
+static inline __attribute__((always_inline)) int xfer_read(struct openfile *of, uint8_t *ibuf, size_t count, const unsigned shift)
 {
-	
-	if (!super_block || fd < 0 || fd >= FS_OPEN_MAX_COUNT || !openfile_table[fd].file) return -1;
-	if (count < 1) return 0;
-	if (openfile_table[fd].file->first_data_block_index == FAT_EOC) {
-		new_block(fd);
-	}
-	int start = openfile_table[fd].offset / MAXI_SIZE;
-	int end = (openfile_table[fd].offset + count) / MAXI_SIZE;
-	char bounce[(end - start + 1) * MAXI_SIZE];
-	fs_read(fd, bounce, count);
-	uint32_t numwrite = 0;
-	uint32_t offset = openfile_table[fd].offset;
-	uint16_t index = index_check(fd);
-	//block_read(index, bounce);
-	int file_des = fd;
-
-	if(count < MAXI_SIZE - offset)
-	{
-		memcpy((bounce+offset), buf, count);
-		block_write(index+super_block->data_block_start_index, (bounce-offset));
-		numwrite = count;
-	}
-	
-	if(count > MAXI_SIZE-offset){
-		int remain_count = count - (MAXI_SIZE - offset);
-		int remain_block = remain_count / MAXI_SIZE;
-		int left_bytes = remain_count % MAXI_SIZE;
-
-		memcpy((bounce+offset), buf, MAXI_SIZE - offset);
-		block_write(index+super_block->data_block_start_index, (bounce-offset));
-		numwrite = MAXI_SIZE - offset;
-		buf += MAXI_SIZE - offset;
-
-		for (int i = 0; i < remain_block; i++)
-		{
-			if(num_free_data_blocks > 0){
-				index = index_check(file_des);
-				int new_index = FAT[new_block(index)];
-				block_write(new_index+super_block->data_block_start_index, buf + MAXI_SIZE);
-				file_des = new_index;
-				buf += MAXI_SIZE;
-				numwrite += MAXI_SIZE;
+	const uint32_t bsize = 1u << shift;
+	uint64_t offset = of->offset;
+	size_t numread = 0;
+	uint32_t prev;
+	uint32_t index = index_check(of, &prev, shift);
+	uint32_t lblock = offset >> shift;
 
-			}
+	//never read past the end of the file
+	if (count > of->file->file_size - offset) count = of->file->file_size - offset;
+
+	while (numread < count && index != FAT_EOC) {
+		uint32_t boffset = offset & (bsize - 1);
+		uint32_t len = bsize - boffset;
+		uint32_t run = 1;
+		if (len > count - numread) len = count - numread;
+		size_t block = (size_t)index + super_block->data_block_start_index;
+
+		if (len == bsize) {
+			//whole blocks that follow each other on disk are read at once
+			while (count - numread >= (size_t)(run + 1) << shift && fat_get(index + run - 1) == index + run) run++;
+			len = run << shift;
+			if (block_read_many(block, run, ibuf + numread) == -1) break;
+		} else {
+			if (block_read(block, bounce) == -1) break;
+			memcpy(ibuf + numread, bounce + boffset, len);
 		}
-		//for remainders
-		if(num_free_data_blocks > 0){
-			index = index_check(file_des);
-			int new_index = FAT[new_block(index)];
-			block_write(new_index+super_block->data_block_start_index,buf);
-			numwrite += left_bytes;
+		numread += len;
+		offset += len;
+		//the last block of the run becomes the current one
+		if (run > 1) {
+			prev = index + run - 2;
+			index += run - 1;
+			lblock += run - 1;
 		}
+		index_cache(of, index, lblock++, prev);
+		prev = index;
+		index = fat_get(index);
+	}
+	of->offset = offset;
+	//blocks that cannot be read, or fail their checksum, end the transfer
+	if (count && !numread) return -1;
 
+	return (int)numread;
+}
+
+#define XFER_INSTANCE(shift) \
+static int read_##shift(struct openfile *of, uint8_t *buf, size_t count) { return xfer_read(of, buf, count, shift); } \
+static int write_##shift(struct openfile *of, const uint8_t *buf, size_t count) { return xfer_write(of, buf, count, shift); }
+
+XFER_INSTANCE(12)
+XFER_INSTANCE(13)
+XFER_INSTANCE(14)
+XFER_INSTANCE(15)
+XFER_INSTANCE(16)
+
+//indexed by block shift - MIN_SHIFT
+static const struct xfer_ops xfer_table[MAX_SHIFT - MIN_SHIFT + 1] = {
+	{ read_12, write_12 },
+	{ read_13, write_13 },
+	{ read_14, write_14 },
+	{ read_15, write_15 },
+	{ read_16, write_16 },
+};
+
+//the chain of @file changed shape, positions remembered in it are stale
+static void chain_changed(struct fileentry *file)
+{
+	file_info(file)->gen++;
+}
+
+//bytes of content in unit @u of @of's file
+static uint32_t unit_size(struct openfile *of, uint32_t u)
+{
+	uint32_t usize = CUNIT_BLOCKS << super_block->block_shift;
+	uint64_t left = of->file->file_size - (uint64_t)u * usize;
+	return left < usize ? left : usize;
+}
+
+//find the map blocks again, after copying shared blocks moved them
+static void cmap_locate(struct openfile *of)
+{
+	uint32_t index = entry_first(of->file);
+	for (uint32_t i = 0; i < of->cmap->map_blocks; i++) {
+		of->cmap->map_index[i] = index;
+		index = fat_get(index);
 	}
+}
 
-	if (offset + count > openfile_table[fd].file->file_size) {
-		openfile_table[fd].file->file_size = offset + count;
+//write back the map blocks that changed
+static void cmap_flush(struct cmap *m)
+{
+	for (uint32_t i = 0; i < m->map_blocks; i++) {
+		if (!m->dirty[i]) continue;
+		block_write(m->map_index[i] + super_block->data_block_start_index, (uint8_t*)m->len + ((size_t)i << super_block->block_shift));
+		m->dirty[i] = 0;
 	}
+}
 
-	block_write(super_block->root_block_index, rootdirectory);
-	for (uint8_t i = 1; i <= super_block->fat_block_count; i++) {
-		block_write(i, FAT + (i - 1)*(MAXI_SIZE / 2));
+//add a block at the end of the map, room for more units
+static int cmap_grow(struct openfile *of)
+{
+	struct cmap *m = of->cmap;
+	if (cmap_resize(m, m->map_blocks, m->map_blocks + 1) == -1) return -1;
+	uint32_t index = alloc_block();
+	if (index == FAT_EOC) return -1;
+	uint32_t prev = m->map_blocks ? m->map_index[m->map_blocks - 1] : FAT_EOC;
+	fat_set(index, prev == FAT_EOC ? entry_first(of->file) : fat_get(prev));
+	if (prev == FAT_EOC) entry_set_first(of->file, index);
+	else fat_set(prev, index);
+	m->map_index[m->map_blocks] = index;
+	m->dirty[m->map_blocks] = 1;
+	m->map_blocks++;
+	chain_changed(of->file);
+
+	return 0;
+}
+
+//read unit @u into @dst, which receives unit_size() bytes
+static int unit_load(struct openfile *of, uint32_t u, uint8_t *dst)
+{
+	struct cmap *m = of->cmap;
+	const unsigned shift = super_block->block_shift;
+	uint32_t stored = m->len[u] & ~CMAP_RAW;
+	uint32_t size = unit_size(of, u);
+	uint32_t n = blocks_of(stored);
+	uint32_t pos = m->map_blocks + m->start[u];
+	uint32_t prev;
+	uint32_t index = chain_walk(of, pos, &prev);
+	//units stored as is and ending on a block boundary need no copy
+	int raw = (m->len[u] & CMAP_RAW) != 0;
+	uint8_t *buf = raw && stored == size && !(stored & (super_block->block_size - 1)) ? dst : m->cbuf;
+
+	for (uint32_t i = 0; i < n;) {
+		if (index == FAT_EOC) return -1;
+		uint32_t run = 1;
+		while (i + run < n && fat_get(index + run - 1) == index + run) run++;
+		if (block_read_many(index + super_block->data_block_start_index, run, buf + ((size_t)i << shift)) == -1) return -1;
+		i += run;
+		pos += run;
+		if (run > 1) {
+			prev = index + run - 2;
+			index += run - 1;
+		}
+		index_cache(of, index, pos - 1, prev);
+		prev = index;
+		index = fat_get(index);
 	}
-	openfile_table[fd].offset += numwrite;
 
-	return numwrite;
+	if (raw) {
+		if (stored != size) return -1;
+		if (buf != dst) memcpy(dst, buf, size);
+		return 0;
+	}
+	return lz_decompress(m->cbuf, stored, dst, size) == (int)size ? 0 : -1;
 }
 
-int fs_read(int fd, void *buf, size_t count)
+/*
+store unit @u as the @stored bytes at @data, padded to whole blocks,
+in place of its previous version. the unit keeps its blocks, and
+blocks are spliced into or out of the chain after them when its size
+changes. returns -1 if the disk is too full, the unit is left as is.
+*/
+static int unit_store(struct openfile *of, uint32_t u, const uint8_t *data, uint32_t stored, int raw)
 {
+	struct cmap *m = of->cmap;
+	const unsigned shift = super_block->block_shift;
+	size_t start = super_block->data_block_start_index;
+	uint32_t old = u < m->units ? blocks_of(m->len[u] & ~CMAP_RAW) : 0;
+	uint32_t n = blocks_of(stored);
+	//a new unit may need a new map block
+	int grow = u == m->units && ((size_t)(u + 1) * sizeof(uint32_t)) > ((size_t)m->map_blocks << shift);
 
-	if (!super_block || fd < 0 || fd >= FS_OPEN_MAX_COUNT || !openfile_table[fd].file) return -1;
-	int start = openfile_table[fd].offset / MAXI_SIZE;
-	int end = (openfile_table[fd].offset + count) / MAXI_SIZE;
-	uint16_t blk_cnt = end - start + 1;
-	uint8_t bounce[(blk_cnt) * MAXI_SIZE];
-	for (uint32_t c = 0; c < (blk_cnt) * MAXI_SIZE; c++) {
-		bounce[c] = '\0';
+	if ((uint64_t)n + grow > (uint64_t)old + num_free_data_blocks) return -1;
+	if (grow && cmap_grow(of) == -1) return -1;
+	if (u == m->units) {
+		m->units++;
+		m->len[u] = 0;
+		m->start[u + 1] = m->start[u];
 	}
-	uint32_t numread = 0;
-	uint32_t offset = openfile_table[fd].offset;
-	uint16_t index = index_check(fd);
 
-	for (uint16_t i = 0; i < blk_cnt && index != FAT_EOC; i++) {
-		block_read(index+super_block->data_block_start_index, bounce + (i*MAXI_SIZE));
-		index = FAT[index];
+	uint32_t prev;
+	uint32_t index = chain_walk(of, m->map_blocks + m->start[u], &prev);
+	uint32_t i;
+	for (i = 0; i < n; i++) {
+		if (i >= old) {
+			uint32_t fresh = alloc_block();
+			fat_set(fresh, index);
+			if (prev == FAT_EOC) entry_set_first(of->file, fresh);
+			else fat_set(prev, fresh);
+			index = fresh;
+		}
+		block_write(index + start, data + ((size_t)i << shift));
+		prev = index;
+		index = fat_get(index);
+	}
+	for (; i < old; i++) {
+		uint32_t next = fat_get(index);
+		fat_set(index, 0);
+		if (index < fat_hint) fat_hint = index;
+		num_free_data_blocks++;
+		if (prev == FAT_EOC) entry_set_first(of->file, next);
+		else fat_set(prev, next);
+		index = next;
 	}
-	uint8_t *ibuf = (uint8_t*) buf;
-	for (uint32_t i = 0; i < count && bounce[i + offset] != '\0'; i++) {
-		ibuf[i] = bounce[i + offset];
-		numread++;
+
+	m->len[u] = stored | (raw ? CMAP_RAW : 0);
+	m->dirty[(u * sizeof(uint32_t)) >> shift] = 1;
+	if (n != old) {
+		for (uint32_t k = u + 1; k <= m->units; k++) m->start[k] += n - old;
+		chain_changed(of->file);
 	}
-	openfile_table[fd].offset += numread;
+
+	return 0;
+}
+
+//make unit @u the cached one
+static int unit_cache(struct openfile *of, uint32_t u)
+{
+	struct cmap *m = of->cmap;
+	if (m->cached == u) return 0;
+	m->cached = FAT_EOC;
+	if (unit_load(of, u, m->ubuf) == -1) return -1;
+	m->cached = u;
+	return 0;
+}
+
+//transfers of compressed files, a unit at a time
+static int cmap_write(struct openfile *of, const uint8_t *ibuf, size_t count)
+{
+	struct cmap *m = of->cmap;
+	const unsigned shift = super_block->block_shift;
+	const uint32_t bsize = super_block->block_size;
+	const uint32_t usize = CUNIT_BLOCKS << shift;
+	uint64_t offset = of->offset;
+	size_t numwrite = 0;
+	int copied = 0;
+	int changed = 0;
+
+	block_plug();
+	//units are rewritten whole, a shared chain is copied first
+	if (num_shared_blocks && of->file->file_size) {
+		copied = cow_path(of, UINT32_MAX - 1);
+		if (copied < 0) count = 0;
+		if (copied > 0) cmap_locate(of);
+	}
+	while (numwrite < count) {
+		uint32_t u = offset / usize;
+		uint32_t uoff = offset % usize;
+		uint32_t len = usize - uoff;
+		if (len > count - numwrite) len = count - numwrite;
+		uint32_t old = u < m->units ? unit_size(of, u) : 0;
+		uint32_t size = uoff + len > old ? uoff + len : old;
+		const uint8_t *src;
+
+		if (uoff == 0 && len >= old && !(size & (bsize - 1))) {
+			//whole unit replaced, compressed straight from the caller's buffer
+			src = ibuf + numwrite;
+			if (m->cached == u) m->cached = FAT_EOC;
+		} else {
+			//what the write does not cover is kept
+			if ((uoff || len < old) && unit_cache(of, u) == -1) break;
+			memcpy(m->ubuf + uoff, ibuf + numwrite, len);
+			m->cached = u;
+			src = m->ubuf;
+		}
+		//compression has to save at least one block
+		size_t clen = lz_compress(src, size, m->cbuf, (size_t)(blocks_of(size) - 1) << shift);
+		const uint8_t *data = clen ? m->cbuf : src;
+		uint32_t stored = clen ? clen : size;
+		if (stored & (bsize - 1)) memset((uint8_t*)data + stored, 0, bsize - (stored & (bsize - 1)));
+		if (unit_store(of, u, data, stored, !clen) == -1) {
+			if (m->cached == u) m->cached = FAT_EOC;
+			break;
+		}
+		changed = 1;
+		numwrite += len;
+		offset += len;
+		if (offset > of->file->file_size) of->file->file_size = offset;
+	}
+
+	if (changed) {
+		dir_flush(dir_block_of(of->file));
+		cmap_flush(m);
+	}
+	if (changed || copied) fat_flush();
+	if (copied > 0) refcnt_flush(FAT_EOC);
+	block_unplug();
+	of->offset = offset;
+
+	return (int)numwrite;
+}
+
+static int cmap_read(struct openfile *of, uint8_t *ibuf, size_t count)
+{
+	struct cmap *m = of->cmap;
+	const uint32_t usize = CUNIT_BLOCKS << super_block->block_shift;
+	uint64_t offset = of->offset;
+	size_t numread = 0;
+
+	//never read past the end of the file
+	if (count > of->file->file_size - offset) count = of->file->file_size - offset;
+
+	while (numread < count) {
+		uint32_t u = offset / usize;
+		uint32_t uoff = offset % usize;
+		uint32_t len = usize - uoff;
+		if (len > count - numread) len = count - numread;
+
+		if (uoff == 0 && len == unit_size(of, u) && m->cached != u) {
+			//whole unit, decompressed straight into the caller's buffer
+			if (unit_load(of, u, ibuf + numread) == -1) break;
+		} else {
+			if (unit_cache(of, u) == -1) break;
+			memcpy(ibuf + numread, m->ubuf + uoff, len);
+		}
+		numread += len;
+		offset += len;
+	}
+	of->offset = offset;
+	if (count && !numread) return -1;
 
 	return (int)numread;
 }
+
+static int do_write(int fd, void *buf, size_t count)
+{
+	if (!super_block || super_block->ro || fd < 0 || fd >= openfile_cap || !openfile_table[fd].file) return -1;
+	struct openfile *of = &openfile_table[fd];
+	//files stop at the largest size fs_stat() can return, offsets cannot wrap
+	if (count > (size_t)FS_FILE_SIZE_MAX - of->offset) count = (size_t)FS_FILE_SIZE_MAX - of->offset;
+	if (count < 1) return 0;
+
+	if (of->cmap) return cmap_write(of, (const uint8_t*) buf, count);
+	return xfer->write(of, (const uint8_t*) buf, count);
+}
+
+static int do_read(int fd, void *buf, size_t count)
+{
+	if (!super_block || fd < 0 || fd >= openfile_cap || !openfile_table[fd].file) return -1;
+
+	if (openfile_table[fd].cmap) return cmap_read(&openfile_table[fd], (uint8_t*) buf, count);
+	return xfer->read(&openfile_table[fd], (uint8_t*) buf, count);
+}
+
+/*
+public entry points: the calls are recorded with their duration while a
+trace is being taken, which costs a single test otherwise.
+*/
+#define TRACED(ret, op, call, fd, arg, name, name2) \
+do { \
+	if (!trace_out) { \
+		ret = call; \
+		break; \
+	} \
+	uint64_t start = trace_clock(); \
+	ret = call; \
+	trace_call(op, start, ret, fd, arg, name, name2); \
+} while (0)
+
+int fs_mount(const char *diskname)
+{
+	int ret;
+	trace_auto_start();
+	TRACED(ret, TRACE_MOUNT, mount(diskname, 0), -1, 0, diskname, NULL);
+	return ret;
+}
+
+int fs_mount_ro(const char *diskname)
+{
+	int ret;
+	trace_auto_start();
+	TRACED(ret, TRACE_MOUNT_RO, mount(diskname, 1), -1, 0, diskname, NULL);
+	return ret;
+}
+
+int fs_umount(void)
+{
+	int ret;
+	TRACED(ret, TRACE_UMOUNT, do_umount(), -1, 0, NULL, NULL);
+	return ret;
+}
+
+int fs_info(void)
+{
+	int ret;
+	TRACED(ret, TRACE_INFO, do_info(), -1, 0, NULL, NULL);
+	return ret;
+}
+
+int fs_create(const char *filename)
+{
+	int ret;
+	TRACED(ret, TRACE_CREATE, do_create(filename), -1, 0, filename, NULL);
+	return ret;
+}
+
+int fs_delete(const char *filename)
+{
+	int ret;
+	TRACED(ret, TRACE_DELETE, do_delete(filename), -1, 0, filename, NULL);
+	return ret;
+}
+
+int fs_clone(const char *src, const char *dst)
+{
+	int ret;
+	TRACED(ret, TRACE_CLONE, do_clone(src, dst), -1, 0, src, dst);
+	return ret;
+}
+
+int fs_compress(const char *filename)
+{
+	int ret;
+	TRACED(ret, TRACE_COMPRESS, do_compress(filename), -1, 0, filename, NULL);
+	return ret;
+}
+
+int fs_ls(void)
+{
+	int ret;
+	TRACED(ret, TRACE_LS, do_ls(), -1, 0, NULL, NULL);
+	return ret;
+}
+
+int fs_open(const char *filename)
+{
+	int ret;
+	TRACED(ret, TRACE_OPEN, do_open(filename), -1, 0, filename, NULL);
+	return ret;
+}
+
+int fs_close(int fd)
+{
+	int ret;
+	TRACED(ret, TRACE_CLOSE, do_close(fd), fd, 0, NULL, NULL);
+	return ret;
+}
+
+int fs_stat(int fd)
+{
+	int ret;
+	TRACED(ret, TRACE_STAT, do_stat(fd), fd, 0, NULL, NULL);
+	return ret;
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	int ret;
+	TRACED(ret, TRACE_LSEEK, do_lseek(fd, offset), fd, offset, NULL, NULL);
+	return ret;
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+	int ret;
+	TRACED(ret, TRACE_WRITE, do_write(fd, buf, count), fd, count, NULL, NULL);
+	return ret;
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	int ret;
+	TRACED(ret, TRACE_READ, do_read(fd, buf, count), fd, count, NULL, NULL);
+	return ret;
+}
@@ -1,17 +1,93 @@
 #ifndef _FS_H
 #define _FS_H
 
+#include <limits.h> /* for INT_MAX */
 #include <stddef.h> /* for size_t definition */
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
 
-/** Maximum number of files in the root directory */
+/** Maximum number of files in a classic, single-block, root directory */
 #define FS_FILE_MAX_COUNT 128
 
-/** Maximum number of open files */
+/**
+ * Largest size of a file, in bytes, whatever the format and block size, so
+ * that fs_stat() can return it
+ */
+#define FS_FILE_SIZE_MAX INT_MAX
+
+/** Initial size of the file descriptor table, which grows as files are opened */
 #define FS_OPEN_MAX_COUNT 32
 
+/**
+ * struct fs_format_opts - File system creation options
+ * @wide: Use the wide format (32-bit FAT entries) instead of the legacy one
+ * @block_size: Block size of a wide image, 0 for the default 4 KiB
+ * @preallocate: Reserve the image's space on the host instead of leaving the
+ *	data region sparse
+ * @dir_blocks: Number of blocks of a hashed root directory (wide images only),
+ *	or 0 for the classic single-block directory of %FS_FILE_MAX_COUNT files
+ * @refcount: Keep per-block reference counts, so that files can be cloned
+ *	with fs_clone() (wide images only)
+ * @checksum: Keep a CRC-32C checksum of every block, verified whenever the
+ *	block is read (wide images only)
+ * @compress: Let files be stored compressed, see fs_compress() (wide images
+ *	only)
+ */
+struct fs_format_opts {
+	int wide;
+	size_t block_size;
+	int preallocate;
+	size_t dir_blocks;
+	int refcount;
+	int checksum;
+	int compress;
+};
+
+/**
+ * fs_format - Create a file system
+ * @diskname: Name of the virtual disk file to create
+ * @nblocks: Number of data blocks
+ * @opts: Creation options, or NULL for a legacy image with 4 KiB blocks
+ *
+ * Create (or truncate) the virtual disk file @diskname and lay out an empty
+ * file system with @nblocks data blocks. The superblock, the FAT and the root
+ * directory are emitted with a single vectored write; the data region is left
+ * as a hole unless preallocation is requested.
+ *
+ * A @diskname with a backend prefix (see block_disk_open()) is created and
+ * written through the disk layer instead, preallocation being ignored.
+ *
+ * Return: -1 if @diskname is invalid, if @nblocks is out of range for the
+ * selected format (1 to 8192 data blocks for legacy images), if the block size
+ * is not supported, if a hashed directory, reference counts, checksums or
+ * compression are requested for a legacy image, or if the virtual disk file
+ * cannot be created. 0 otherwise.
+ */
+int fs_format(const char *diskname, size_t nblocks,
+	      const struct fs_format_opts *opts);
+
+/**
+ * fs_pack - Build a file system from a host directory
+ * @diskname: Name of the virtual disk file to create
+ * @hostdir: Host directory whose regular files are copied
+ * @nblocks: Number of data blocks, or 0 for just enough to hold the files
+ * @opts: Creation options, as for fs_format()
+ * @nworkers: Number of threads copying file contents, or 0 for one per CPU
+ *
+ * Create the virtual disk file @diskname holding a copy of every regular file
+ * of @hostdir, without going through fs_write(). The whole layout is planned
+ * in memory first, each file getting a contiguous extent, then file contents
+ * are copied by @nworkers threads with large sequential writes, and finally
+ * the FAT and the root directory are written at once.
+ *
+ * Return: -1 if @hostdir cannot be read, holds more files than the root
+ * directory can, a filename longer than %FS_FILENAME_LEN characters, or a
+ * file larger than %FS_FILE_SIZE_MAX bytes, if @nblocks is too small, or if the virtual disk file cannot be created. 0 otherwise.
+ */
+int fs_pack(const char *diskname, const char *hostdir, size_t nblocks,
+	    const struct fs_format_opts *opts, int nworkers);
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -20,11 +96,42 @@
  * contains. A file system needs to be mounted before files can be read from it
  * with fs_read() or written to it with fs_write().
  *
+ * Two on-disk formats are recognized by their signature: the original
+ * "ECS150FS" format with 16-bit FAT entries, limited to 65,535 blocks, and the
+ * wide "ECS150F2" format whose block indices and FAT entries are 32-bit. Wide
+ * images also record their block size, a power of two from 4 KiB to 64 KiB,
+ * and may spread their root directory over several blocks: a file's entry is
+ * then kept in the block its name hashes to, so that creating, opening or
+ * deleting it only touches that block.
+ *
+ * @diskname is handed to block_disk_open(), so "ram:" or any other backend
+ * prefix it understands can be used to mount an image held in memory.
+ *
  * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
  * file system can be located. 0 otherwise.
  */
 int fs_mount(const char *diskname);
 
+/**
+ * fs_mount_ro - Mount a file system for reading only
+ * @diskname: Name of the virtual disk file
+ *
+ * Mount the file system of @diskname like fs_mount(), through
+ * block_disk_open_ro(). When the image is a host file, it is mapped shared and
+ * the FAT and root directory are used in place rather than copied, so that
+ * several processes mounting the same image this way share a single copy of
+ * it in memory. Lookups, fs_stat() and fs_ls() then read the mapping directly,
+ * and fs_read() copies file content out of it.
+ *
+ * fs_create(), fs_delete(), fs_clone(), fs_compress() and fs_write() fail on a
+ * file system mounted this way. Nothing may write to the image while it is
+ * mounted.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located. 0 otherwise.
+ */
+int fs_mount_ro(const char *diskname);
+
 /**
  * fs_umount - Unmount file system
  *
@@ -55,8 +162,8 @@ int fs_info(void);
  * character).
  *
  * Return: -1 if @filename is invalid, if a file named @filename already exists,
- * or if string @filename is too long, or if the root directory already contains
- * %FS_FILE_MAX_COUNT files. 0 otherwise.
+ * or if string @filename is too long, or if the root directory is full
+ * (%FS_FILE_MAX_COUNT files for a classic root directory). 0 otherwise.
  */
 int fs_create(const char *filename);
 
@@ -72,6 +179,38 @@ int fs_create(const char *filename);
  */
 int fs_delete(const char *filename);
 
+/**
+ * fs_clone - Clone a file
+ * @src: Name of the file to clone
+ * @dst: Name of the new file
+ *
+ * Create a new file named @dst with the same content as file @src, in constant
+ * time: @dst shares the data blocks of @src instead of copying them. Each block
+ * is copied the first time either file writes to it (or to a block that comes
+ * after it in the file, as a FAT chain cannot be shared from the middle).
+ *
+ * Return: -1 if the file system does not keep reference counts, if there is
+ * no file named @src, or if @dst cannot be created for any of the reasons
+ * listed for fs_create(). 0 otherwise.
+ */
+int fs_clone(const char *src, const char *dst);
+
+/**
+ * fs_compress - Store a file compressed
+ * @filename: File name
+ *
+ * Have the content of the empty file named @filename compressed from now on.
+ * Every 16 blocks of content are compressed together and stored in as few
+ * blocks as they need, so the file takes less space and is read with fewer
+ * block transfers. fs_read(), fs_write() and fs_lseek() work as for any file,
+ * at any offset; a write recompresses the 16-block units it touches.
+ *
+ * Return: -1 if the file system was not formatted with compression allowed,
+ * if there is no file named @filename, or if file @filename is not empty or
+ * is currently open. 0 otherwise.
+ */
+int fs_compress(const char *filename);
+
 /**
  * fs_ls - List files on file system
  *
@@ -90,12 +229,13 @@ int fs_ls(void);
  * that is used subsequently to access the contents of the file. The file offset
  * of the file descriptor is set to 0 initially (beginning of the file). If the
  * same file is opened multiple files, fs_open() must return distinct file
- * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
+ * descriptors. The descriptor table starts with %FS_OPEN_MAX_COUNT entries and
+ * doubles whenever it is full, so opening and closing files take constant time
+ * however many are open.
  *
  * Return: -1 if @filename is invalid, there is no file named @filename to open,
- * or if there are already %FS_OPEN_MAX_COUNT files currently open. Otherwise,
- * return the file descriptor.
+ * or if the descriptor table cannot grow. Otherwise, return the file
+ * descriptor.
  */
 int fs_open(const char *filename);
 
@@ -151,6 +291,8 @@ int fs_lseek(int fd, size_t offset);
  * runs out of space while performing a write operation, fs_write() should write
  * as many bytes as possible. The number of written bytes can therefore be
  * smaller than @count (it can even be 0 if there is no more space on disk).
+ * Likewise, a file never grows beyond %FS_FILE_SIZE_MAX bytes: a write that
+ * would take it further stops there.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
  * open). Otherwise return the number of bytes actually written.
@@ -173,8 +315,38 @@ int fs_write(int fd, void *buf, size_t count);
  * implicitly incremented by the number of bytes that were actually read.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). Otherwise return the number of bytes actually read.
+ * open), or if nothing could be read because the first block cannot be read
+ * from the disk (or does not match its checksum). Otherwise return the number
+ * of bytes actually read, which a failing block cuts short.
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_trace_start - Record file system calls
+ * @path: Name of the trace file to create
+ *
+ * From now on and until fs_trace_stop(), every call to fs_mount(),
+ * fs_mount_ro(), fs_umount() and the functions operating on a mounted file
+ * system is appended to the trace file @path, with its arguments, its return
+ * value, when it started and how long it took. Data is not recorded. The
+ * trace format is described in trace.h, and fs_replay replays traces.
+ *
+ * Programs can also be traced without being changed: when the FS_TRACE
+ * environment variable names a file, a trace into it is started by the first
+ * mount if no trace is being taken, and covers every call until the program
+ * exits.
+ *
+ * Return: -1 if a trace is already being taken or if @path cannot be created.
+ * 0 otherwise.
+ */
+int fs_trace_start(const char *path);
+
+/**
+ * fs_trace_stop - Stop recording file system calls
+ *
+ * Return: -1 if no trace was being taken or if it could not be written
+ * entirely. 0 otherwise.
+ */
+int fs_trace_stop(void);
+
 #endif /* _FS_H */
@@ -0,0 +1,185 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+/*
+ * Compressed data is a series of sequences, each made of:
+ * - a token byte, literal count in the high nibble and match length minus
+ *   LZ_MIN_MATCH in the low one, 15 meaning more bytes follow,
+ * - the rest of the literal count, as bytes of 255 ended by a smaller one,
+ * - the literals,
+ * - the match offset, 16-bit little-endian, and the rest of the match length.
+ * The last sequence stops after its literals.
+ */
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 13
+
+static inline uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static inline uint32_t lz_hash(uint32_t seq)
+{
+	return (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Store the part of @n that does not fit in a nibble */
+static uint8_t *put_length(uint8_t *op, size_t n)
+{
+	for (n -= 15; n >= 255; n -= 255)
+		*op++ = 255;
+	*op++ = n;
+	return op;
+}
+
+/* Emit a sequence, without a match if @mlen is 0 */
+static uint8_t *put_sequence(uint8_t *op, const uint8_t *oend,
+			     const uint8_t *lit, size_t nlit,
+			     size_t mlen, size_t offset)
+{
+	uint8_t *token = op;
+
+	/* Worst case of the length bytes, so that only one check is needed */
+	if ((size_t)(oend - op) < 1 + nlit + nlit / 255 + 1 + 2 + mlen / 255 + 1)
+		return NULL;
+
+	op++;
+	*token = (nlit < 15 ? nlit : 15) << 4;
+	if (nlit >= 15)
+		op = put_length(op, nlit);
+	memcpy(op, lit, nlit);
+	op += nlit;
+	if (!mlen)
+		return op;
+
+	*op++ = offset & 0xFF;
+	*op++ = offset >> 8;
+	mlen -= LZ_MIN_MATCH;
+	*token |= mlen < 15 ? mlen : 15;
+	if (mlen >= 15)
+		op = put_length(op, mlen);
+
+	return op;
+}
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap)
+{
+	const uint8_t *base = src, *ip = base, *anchor = base, *end = base + len;
+	uint8_t *op = dst, *oend = op + cap;
+	uint32_t table[1 << LZ_HASH_BITS];
+	unsigned misses = 0;
+
+	memset(table, 0, sizeof(table));
+
+	while (end - ip >= LZ_MIN_MATCH) {
+		uint32_t seq = read32(ip), h = lz_hash(seq);
+		const uint8_t *ref = base + table[h];
+		const uint8_t *mp, *rp;
+
+		table[h] = ip - base;
+		if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != seq) {
+			/* Skip faster through data that does not compress */
+			ip += 1 + (misses++ >> 6);
+			continue;
+		}
+		misses = 0;
+
+		/* Extend the match eight bytes at a time, then byte by byte */
+		mp = ip + LZ_MIN_MATCH;
+		rp = ref + LZ_MIN_MATCH;
+		while (end - mp >= 8) {
+			uint64_t a, b;
+
+			memcpy(&a, mp, 8);
+			memcpy(&b, rp, 8);
+			if (a != b)
+				break;
+			mp += 8;
+			rp += 8;
+		}
+		while (mp < end && *mp == *rp) {
+			mp++;
+			rp++;
+		}
+
+		op = put_sequence(op, oend, anchor, ip - anchor, mp - ip, ip - ref);
+		if (!op)
+			return 0;
+		ip = anchor = mp;
+	}
+
+	if (anchor < end || op == (uint8_t*)dst) {
+		op = put_sequence(op, oend, anchor, end - anchor, 0, 0);
+		if (!op)
+			return 0;
+	}
+
+	return op - (uint8_t*)dst;
+}
+
+/* Read the part of a length that did not fit in a nibble */
+static int get_length(const uint8_t **ip, const uint8_t *iend, size_t *n)
+{
+	uint8_t b;
+
+	do {
+		if (*ip == iend)
+			return -1;
+		b = *(*ip)++;
+		*n += b;
+	} while (b == 255);
+
+	return 0;
+}
+
+int lz_decompress(const void *src, size_t len, void *dst, size_t cap)
+{
+	const uint8_t *ip = src, *iend = ip + len;
+	uint8_t *op = dst, *oend = op + cap;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+		size_t nlit = token >> 4, mlen = token & 15, offset;
+
+		if (nlit == 15 && get_length(&ip, iend, &nlit))
+			return -1;
+		if (nlit > (size_t)(iend - ip) || nlit > (size_t)(oend - op))
+			return -1;
+		memcpy(op, ip, nlit);
+		op += nlit;
+		ip += nlit;
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (mlen == 15 && get_length(&ip, iend, &mlen))
+			return -1;
+		mlen += LZ_MIN_MATCH;
+		if (!offset || offset > (size_t)(op - (uint8_t*)dst)
+		    || mlen > (size_t)(oend - op))
+			return -1;
+
+		if (offset >= mlen) {
+			memcpy(op, op - offset, mlen);
+			op += mlen;
+		} else {
+			/* Overlapping copy repeats the last @offset bytes */
+			const uint8_t *ref = op - offset;
+
+			while (mlen--)
+				*op++ = *ref++;
+		}
+	}
+
+	return op - (uint8_t*)dst;
+}
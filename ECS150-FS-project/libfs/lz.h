@@ -0,0 +1,34 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+#include <stddef.h>
+
+/**
+ * lz_compress - Compress a buffer
+ * @src: Data to compress
+ * @len: Length of @src in bytes
+ * @dst: Buffer receiving the compressed data
+ * @cap: Size of @dst in bytes
+ *
+ * Compress @src with a byte-oriented LZ77 codec in the spirit of LZ4: runs of
+ * literals alternate with copies of at least four bytes from the previous
+ * 64 KiB. It favours speed over compression ratio.
+ *
+ * Return: The length of the compressed data, or 0 if it does not fit in @cap
+ * bytes.
+ */
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap);
+
+/**
+ * lz_decompress - Decompress a buffer
+ * @src: Data produced by lz_compress()
+ * @len: Length of @src in bytes
+ * @dst: Buffer receiving the original data
+ * @cap: Size of @dst in bytes
+ *
+ * Return: -1 if @src is corrupted or decompresses to more than @cap bytes.
+ * Otherwise return the length of the original data.
+ */
+int lz_decompress(const void *src, size_t len, void *dst, size_t cap);
+
+#endif /* _LZ_H */
@@ -0,0 +1,398 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+#include "disk.h"
+#include "fs.h"
+#include "private.h"
+
+#define pack_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Size of the transfers between host files and the image */
+#define PACK_CHUNK (8 << 20)
+
+/* Host file to be copied, and the extent planned for it */
+struct pack_file {
+	char name[FS_FILENAME_LEN];
+	size_t size;
+	uint32_t first;
+	uint32_t nblocks;
+};
+
+/* State shared by the copy workers */
+struct pack_job {
+	const char *hostdir;
+	struct pack_file *files;
+	int count;
+	int next;
+	int failed;
+	int img;
+	size_t bsize;
+	off_t data_start;
+	/* Checksum of every block of the image, or NULL */
+	uint32_t *csum;
+	pthread_mutex_t lock;
+};
+
+/* Checksum of a block, as the disk layer records them (0 means unknown) */
+static uint32_t pack_csum(const void *buf, size_t bsize)
+{
+	uint32_t crc = crc32c(0, buf, bsize);
+
+	return crc ? crc : 0xFFFFFFFF;
+}
+
+static int cmp_files(const void *a, const void *b)
+{
+	return strcmp(((const struct pack_file*)a)->name,
+		      ((const struct pack_file*)b)->name);
+}
+
+/*
+ * Collect the regular files of @hostdir, sorted by name so that the same
+ * directory always produces the same image.
+ */
+static int scan_dir(const char *hostdir, struct pack_file *files, int max)
+{
+	struct dirent *de;
+	struct stat st;
+	int count = 0;
+	DIR *dir;
+
+	dir = opendir(hostdir);
+	if (!dir) {
+		perror("opendir");
+		return -1;
+	}
+
+	while ((de = readdir(dir))) {
+		if (fstatat(dirfd(dir), de->d_name, &st, 0) || !S_ISREG(st.st_mode))
+			continue;
+		if (strlen(de->d_name) >= FS_FILENAME_LEN) {
+			pack_error("filename '%s' too long", de->d_name);
+			count = -1;
+			break;
+		}
+		if (count == max) {
+			pack_error("more than %d files", max);
+			count = -1;
+			break;
+		}
+		if ((uint64_t)st.st_size > FS_FILE_SIZE_MAX) {
+			pack_error("file '%s' too large", de->d_name);
+			count = -1;
+			break;
+		}
+		strcpy(files[count].name, de->d_name);
+		files[count].size = st.st_size;
+		count++;
+	}
+	closedir(dir);
+
+	if (count > 0)
+		qsort(files, count, sizeof(*files), cmp_files);
+	return count;
+}
+
+/* Copy one host file into its extent, a chunk at a time */
+static int copy_file(struct pack_job *job, struct pack_file *file, char *buf)
+{
+	off_t dst = job->data_start + (off_t)file->first * job->bsize;
+	size_t off = 0;
+	int fd, dfd;
+
+	dfd = open(job->hostdir, O_RDONLY | O_DIRECTORY);
+	if (dfd < 0) {
+		perror("open");
+		return -1;
+	}
+	fd = openat(dfd, file->name, O_RDONLY);
+	close(dfd);
+	if (fd < 0) {
+		perror("openat");
+		return -1;
+	}
+
+	while (off < file->size) {
+		size_t len = file->size - off < PACK_CHUNK ?
+			file->size - off : PACK_CHUNK;
+		size_t padded = (len + job->bsize - 1) / job->bsize * job->bsize;
+		size_t got = 0;
+
+		while (got < len) {
+			ssize_t n = pread(fd, buf + got, len - got, off + got);
+			if (n <= 0) {
+				pack_error("short read on '%s'", file->name);
+				close(fd);
+				return -1;
+			}
+			got += n;
+		}
+		/* The tail of the last block is zero-filled */
+		memset(buf + len, 0, padded - len);
+
+		if (job->csum) {
+			size_t block = (dst + off) / job->bsize, k;
+
+			for (k = 0; k < padded / job->bsize; k++)
+				job->csum[block + k] = pack_csum(buf + k * job->bsize,
+								 job->bsize);
+		}
+
+		if (pwrite(job->img, buf, padded, dst + off) != (ssize_t)padded) {
+			perror("pwrite");
+			close(fd);
+			return -1;
+		}
+		off += len;
+	}
+
+	close(fd);
+	return 0;
+}
+
+static void *pack_worker(void *arg)
+{
+	struct pack_job *job = arg;
+	char *buf = malloc(PACK_CHUNK);
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		i = !buf || job->failed ? job->count : job->next++;
+		if (!buf)
+			job->failed = 1;
+		pthread_mutex_unlock(&job->lock);
+
+		if (i >= job->count)
+			break;
+		if (job->files[i].size && copy_file(job, &job->files[i], buf)) {
+			pthread_mutex_lock(&job->lock);
+			job->failed = 1;
+			pthread_mutex_unlock(&job->lock);
+		}
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Pick the directory entry of @name: the next free one in a classic directory,
+ * or a free one in its home block (or the closest block after it with room)
+ * in a hashed directory, updating the block headers as fs_create() would.
+ */
+static struct fileentry *place_entry(uint8_t *rdir, size_t bsize,
+				     size_t dir_blocks, const char *name,
+				     int index)
+{
+	size_t slots = bsize / sizeof(struct fileentry) - 1;
+	uint32_t home, block;
+	size_t k, i;
+
+	if (!dir_blocks)
+		return (struct fileentry*)rdir + index;
+
+	home = dir_hash(name, dir_blocks);
+	for (k = 0; k < dir_blocks; k++) {
+		struct dirheader *hdr;
+		struct fileentry *slot;
+
+		block = (home + k) % dir_blocks;
+		hdr = (struct dirheader*)(rdir + block * bsize);
+		if (hdr->used == slots)
+			continue;
+		slot = (struct fileentry*)hdr + 1;
+		for (i = 0; slot[i].filename[0]; i++)
+			;
+		hdr->used++;
+		if (k)
+			((struct dirheader*)(rdir + home * bsize))->overflow++;
+		return &slot[i];
+	}
+	return NULL;
+}
+
+/*
+ * Fill the FAT and the root directory, which follow each other on disk (with
+ * the reference counts in between, all zero for blocks with a single owner),
+ * so that they can be written in one go.
+ */
+static void build_metadata(uint8_t *meta, const struct layout *lay,
+			   const struct fs_format_opts *opts,
+			   struct pack_file *files, int count)
+{
+	size_t bsize = lay->block_size;
+	uint8_t *rdir = meta + (lay->root_index - 1) * bsize;
+	int wide = opts->wide;
+	uint32_t *fat32 = (uint32_t*)meta;
+	uint16_t *fat16 = (uint16_t*)meta;
+	int i;
+
+	if (wide)
+		fat32[0] = FAT_EOC;
+	else
+		fat16[0] = FAT_EOC16;
+
+	for (i = 0; i < count; i++) {
+		uint32_t first = files[i].nblocks ? files[i].first : FAT_EOC;
+		struct fileentry *entry;
+		uint32_t b;
+
+		/* Each extent is a contiguous chain */
+		for (b = files[i].first; b < files[i].first + files[i].nblocks; b++) {
+			int last = b + 1 == files[i].first + files[i].nblocks;
+			if (wide)
+				fat32[b] = last ? FAT_EOC : b + 1;
+			else
+				fat16[b] = last ? FAT_EOC16 : b + 1;
+		}
+
+		/* Capacity was checked when scanning, there is always room */
+		entry = place_entry(rdir, bsize, opts->dir_blocks,
+				    files[i].name, i);
+		strcpy((char*)entry->filename, files[i].name);
+		entry->file_size = files[i].size;
+		entry->first_data_block_index = first & 0xFFFF;
+		entry->first_data_block_hi = wide ? first >> 16 : 0;
+	}
+}
+
+int fs_pack(const char *diskname, const char *hostdir, size_t nblocks,
+	    const struct fs_format_opts *opts, int nworkers)
+{
+	struct fs_format_opts defaults = { 0 };
+	struct pack_file *files;
+	struct pack_job job;
+	pthread_t *workers;
+	size_t bsize, needed;
+	struct layout lay;
+	uint8_t *meta = NULL;
+	int count, max, i, started = 0, ret = -1;
+
+	if (!diskname || !hostdir) {
+		pack_error("invalid arguments");
+		return -1;
+	}
+	if (!opts)
+		opts = &defaults;
+	/* Check the options before scanning, the real layout comes later */
+	if (format_layout(1, opts, &lay))
+		return -1;
+	bsize = lay.block_size;
+	if (nworkers < 1)
+		nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nworkers < 1)
+		nworkers = 1;
+
+	/* A hashed directory has a header in the first slot of every block */
+	if (opts->dir_blocks)
+		max = opts->dir_blocks * (bsize / sizeof(struct fileentry) - 1);
+	else
+		max = FS_FILE_MAX_COUNT;
+
+	files = calloc(max, sizeof(*files));
+	workers = calloc(nworkers, sizeof(*workers));
+	if (!files || !workers) {
+		perror("calloc");
+		goto out;
+	}
+
+	count = scan_dir(hostdir, files, max);
+	if (count < 0)
+		goto out;
+
+	/* Plan one contiguous extent per file, data block 0 being reserved */
+	needed = 1;
+	for (i = 0; i < count; i++) {
+		files[i].nblocks = (files[i].size + bsize - 1) / bsize;
+		files[i].first = files[i].nblocks ? needed : 0;
+		needed += files[i].nblocks;
+	}
+	if (!nblocks)
+		nblocks = needed;
+	if (nblocks < needed) {
+		pack_error("'%s' needs %zu data blocks", hostdir, needed);
+		goto out;
+	}
+
+	if (format_layout(nblocks, opts, &lay) || fs_format(diskname, nblocks, opts))
+		goto out;
+
+	meta = calloc(lay.data_start - 1, bsize);
+	if (!meta) {
+		perror("calloc");
+		goto out;
+	}
+	build_metadata(meta, &lay, opts, files, count);
+
+	/* Metadata blocks are final, data blocks get theirs while copied */
+	job.csum = NULL;
+	if (lay.csum_blocks) {
+		size_t b;
+
+		job.csum = (uint32_t*)(meta + (lay.csum_index - 1) * bsize);
+		for (b = 1; b < lay.data_start; b++) {
+			if (b >= lay.csum_index && b < lay.csum_index + lay.csum_blocks)
+				continue;
+			job.csum[b] = pack_csum(meta + (b - 1) * bsize, bsize);
+		}
+	}
+
+	job.img = open(diskname, O_WRONLY);
+	if (job.img < 0) {
+		perror("open");
+		goto out;
+	}
+	job.hostdir = hostdir;
+	job.files = files;
+	job.count = count;
+	job.next = 0;
+	job.failed = 0;
+	job.bsize = bsize;
+	job.data_start = (off_t)lay.data_start * bsize;
+	pthread_mutex_init(&job.lock, NULL);
+
+	/* Copy file contents in parallel, each worker claiming whole files */
+	for (i = 0; i < nworkers && i < count; i++) {
+		if (pthread_create(&workers[i], NULL, pack_worker, &job))
+			break;
+		started++;
+	}
+	if (!started && count)
+		pack_worker(&job);
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i], NULL);
+	pthread_mutex_destroy(&job.lock);
+
+	/* Metadata goes last, once every extent is in place */
+	if (!job.failed) {
+		size_t len = (lay.data_start - 1) * bsize;
+
+		if (pwrite(job.img, meta, len, bsize) == (ssize_t)len)
+			ret = 0;
+		else
+			perror("pwrite");
+	}
+	if (close(job.img) && !ret) {
+		perror("close");
+		ret = -1;
+	}
+	if (ret)
+		unlink(diskname);
+
+out:
+	free(meta);
+	free(workers);
+	free(files);
+	return ret;
+}
@@ -0,0 +1,123 @@
+#ifndef _FS_PRIVATE_H
+#define _FS_PRIVATE_H
+
+/*
+ * This header is only meant to be included by files from the libfs, as it
+ * describes the on-disk layout shared by the file system and its formatter.
+ * This header is not to be included by user programs directly.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fs.h"
+
+#define FAT_EOC 0xFFFFFFFF
+#define FAT_EOC16 0xFFFF
+#define MIN_SHIFT 12 //4KiB blocks
+#define MAX_SHIFT 16 //64KiB blocks
+#define LEGACY_MAX_DATA_BLOCKS 8192 //as enforced by the reference fs_make
+
+//format extensions of wide images
+#define FEAT_HASHDIR 0x1 //root directory hashed over root_block_count blocks
+#define FEAT_REFCOUNT 0x2 //16-bit count of extra references per data block
+#define FEAT_CHECKSUM 0x4 //CRC-32C of every block, kept by the disk layer
+#define FEAT_COMPRESS 0x8 //files may be stored compressed, see ENTRY_COMPRESSED
+#define FEAT_KNOWN (FEAT_HASHDIR | FEAT_REFCOUNT | FEAT_CHECKSUM | FEAT_COMPRESS)
+
+//file entry flags, wide format only
+#define ENTRY_COMPRESSED 0x1
+
+/*
+compressed files: the content is cut in units of CUNIT_BLOCKS blocks,
+each compressed on its own and stored in as few whole blocks as it
+needs. the chain starts with the unit map, one 32-bit entry per unit
+giving its stored length, then holds the units in order.
+*/
+#define CUNIT_BLOCKS 16
+#define CMAP_RAW 0x80000000 //unit stored as is, it did not compress
+
+//signatures of the two on-disk formats
+#define FMT_LEGACY "ECS150FS"
+#define FMT_WIDE "ECS150F2"
+
+//memory layout of the superblock (legacy format, 16-bit FAT)
+struct __attribute__ ((__packed__)) superblock {
+	uint8_t signature[8];
+	uint16_t total_block_amount;
+	uint16_t root_block_index;
+	uint16_t data_block_start_index;
+	uint16_t data_block_amount;
+	uint8_t fat_block_count;
+	uint8_t padding[4079];
+};
+//memory layout of the superblock (wide format, 32-bit FAT)
+struct __attribute__ ((__packed__)) superblock_wide {
+	uint8_t signature[8];
+	uint32_t total_block_amount;
+	uint32_t root_block_index;
+	uint32_t data_block_start_index;
+	uint32_t data_block_amount;
+	uint32_t fat_block_count;
+	uint32_t block_size; //0 for the default BLOCK_SIZE
+	uint32_t flags; //FEAT_* format extensions
+	uint32_t root_block_count; //hashed directory only
+	uint32_t refcnt_block_index; //reference counts only
+	uint32_t refcnt_block_count;
+	uint32_t csum_block_index; //checksums only
+	uint32_t csum_block_count;
+	uint8_t padding[4040];
+};
+//memory layout of an individual file entry
+struct __attribute__ ((__packed__)) fileentry {
+	uint8_t filename[FS_FILENAME_LEN];
+	uint32_t file_size;
+	uint16_t first_data_block_index;
+	uint16_t first_data_block_hi; //upper half of the index, wide format only
+	uint8_t flags; //ENTRY_* flags, wide format only
+	uint8_t padding[7];
+};
+//first slot of every block of a hashed directory
+struct __attribute__ ((__packed__)) dirheader {
+	uint32_t used; //entries stored in this block
+	uint32_t overflow; //entries hashed to this block but stored further
+	uint8_t padding[24];
+};
+
+//home block of @filename in a hashed directory of @blocks blocks (FNV-1a)
+static inline uint32_t dir_hash(const char *filename, uint32_t blocks)
+{
+	uint32_t hash = 2166136261u;
+	while (*filename) {
+		hash ^= (uint8_t)*filename++;
+		hash *= 16777619u;
+	}
+	return hash % blocks;
+}
+
+//where each region of an image goes, as laid out by fs_format()
+struct layout {
+	size_t block_size;
+	size_t fat_blocks;
+	size_t refcnt_index; //0 when there is no reference count region
+	size_t refcnt_blocks;
+	size_t csum_index; //0 when there is no checksum region
+	size_t csum_blocks;
+	size_t root_index;
+	size_t dir_blocks;
+	size_t data_start;
+	size_t total;
+};
+
+/*
+ * format_layout - Plan the regions of an image
+ * @nblocks: Number of data blocks
+ * @opts: Creation options, or NULL for the defaults of fs_format()
+ * @lay: Layout to fill
+ *
+ * Return: -1 if @nblocks or @opts are not valid, 0 otherwise.
+ */
+int format_layout(size_t nblocks, const struct fs_format_opts *opts,
+		  struct layout *lay);
+
+#endif /* _FS_PRIVATE_H */
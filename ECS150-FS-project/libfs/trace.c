@@ -0,0 +1,261 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fs.h"
+#include "trace.h"
+
+#define trace_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Records are buffered this much before going to the trace file */
+#define TRACE_BUFFER (1 << 20)
+
+/* Longest varint, for 64-bit values */
+#define VARINT_MAX 10
+
+const char *const trace_op_names[TRACE_OPS] = {
+	[TRACE_MOUNT] = "mount",
+	[TRACE_MOUNT_RO] = "mount_ro",
+	[TRACE_UMOUNT] = "umount",
+	[TRACE_INFO] = "info",
+	[TRACE_CREATE] = "create",
+	[TRACE_DELETE] = "delete",
+	[TRACE_CLONE] = "clone",
+	[TRACE_COMPRESS] = "compress",
+	[TRACE_LS] = "ls",
+	[TRACE_OPEN] = "open",
+	[TRACE_CLOSE] = "close",
+	[TRACE_STAT] = "stat",
+	[TRACE_LSEEK] = "lseek",
+	[TRACE_WRITE] = "write",
+	[TRACE_READ] = "read",
+};
+
+FILE *trace_out;
+
+/* Start of the last recorded call, or of the trace */
+static uint64_t trace_last;
+
+uint64_t trace_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint8_t *put_varint(uint8_t *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+/* Signed values, small whatever their sign */
+static uint64_t zigzag(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static int get_varint(FILE *f, uint64_t *v)
+{
+	int shift, c;
+
+	*v = 0;
+	for (shift = 0; shift < 64; shift += 7) {
+		if ((c = getc(f)) == EOF)
+			return -1;
+		*v |= (uint64_t)(c & 0x7F) << shift;
+		if (!(c & 0x80))
+			return 0;
+	}
+
+	return -1;
+}
+
+/* Which arguments each operation records */
+static int has_name(int op)
+{
+	return op == TRACE_MOUNT || op == TRACE_MOUNT_RO || op == TRACE_CREATE
+		|| op == TRACE_DELETE || op == TRACE_CLONE
+		|| op == TRACE_COMPRESS || op == TRACE_OPEN;
+}
+
+static int has_fd(int op)
+{
+	return op >= TRACE_CLOSE && op <= TRACE_READ;
+}
+
+static int has_arg(int op)
+{
+	return op == TRACE_LSEEK || op == TRACE_WRITE || op == TRACE_READ;
+}
+
+static void put_name(const char *name, size_t max)
+{
+	size_t len = name ? strnlen(name, max - 1) : 0;
+
+	if (len)
+		fwrite(name, 1, len, trace_out);
+	putc('\0', trace_out);
+}
+
+int fs_trace_start(const char *path)
+{
+	if (!path || trace_out)
+		return -1;
+
+	trace_out = fopen(path, "wb");
+	if (!trace_out) {
+		perror("fopen");
+		return -1;
+	}
+	setvbuf(trace_out, NULL, _IOFBF, TRACE_BUFFER);
+	fwrite(TRACE_SIGNATURE, 1, 8, trace_out);
+	trace_last = trace_clock();
+
+	return 0;
+}
+
+int fs_trace_stop(void)
+{
+	int ret = 0;
+
+	if (!trace_out)
+		return -1;
+
+	if (ferror(trace_out))
+		ret = -1;
+	if (fclose(trace_out) || ret) {
+		trace_error("cannot write trace");
+		ret = -1;
+	}
+	trace_out = NULL;
+
+	return ret;
+}
+
+void trace_call(int op, uint64_t start, int ret, int fd, uint64_t arg,
+		const char *name, const char *name2)
+{
+	uint8_t head[1 + 5 * VARINT_MAX], *p = head;
+
+	*p++ = op;
+	p = put_varint(p, start - trace_last);
+	p = put_varint(p, trace_clock() - start);
+	p = put_varint(p, zigzag(ret));
+	if (has_fd(op))
+		p = put_varint(p, zigzag(fd));
+	if (has_arg(op))
+		p = put_varint(p, arg);
+	fwrite(head, 1, p - head, trace_out);
+	if (has_name(op))
+		put_name(name, TRACE_NAME_MAX);
+	if (op == TRACE_CLONE)
+		put_name(name2, FS_FILENAME_LEN);
+	trace_last = start;
+
+	if (ferror(trace_out))
+		fs_trace_stop();
+}
+
+static void trace_exit(void)
+{
+	if (trace_out)
+		fs_trace_stop();
+}
+
+void trace_auto_start(void)
+{
+	static int started;
+	const char *path = getenv("FS_TRACE");
+
+	/* A single trace covers every mount of the program */
+	if (started || trace_out || !path || !*path)
+		return;
+	started = 1;
+	if (!fs_trace_start(path))
+		atexit(trace_exit);
+}
+
+FILE *trace_open(const char *path)
+{
+	char sig[8];
+	FILE *f = fopen(path, "rb");
+
+	if (!f) {
+		perror("fopen");
+		return NULL;
+	}
+	setvbuf(f, NULL, _IOFBF, TRACE_BUFFER);
+
+	if (fread(sig, 1, 8, f) != 8 || memcmp(sig, TRACE_SIGNATURE, 8)) {
+		trace_error("'%s' is not a trace", path);
+		fclose(f);
+		return NULL;
+	}
+
+	return f;
+}
+
+static int get_name(FILE *f, char *name, size_t max)
+{
+	size_t len;
+	int c;
+
+	for (len = 0; len < max; len++) {
+		if ((c = getc(f)) == EOF)
+			return -1;
+		name[len] = c;
+		if (!c)
+			return 0;
+	}
+
+	return -1;
+}
+
+int trace_read(FILE *f, struct trace_rec *rec, uint64_t prev)
+{
+	uint64_t delta, ret, v;
+	int op = getc(f);
+
+	if (op == EOF)
+		return 0;
+	if (op <= 0 || op >= TRACE_OPS)
+		return -1;
+
+	rec->op = op;
+	rec->fd = -1;
+	rec->arg = 0;
+	rec->name[0] = '\0';
+	rec->name2[0] = '\0';
+	if (get_varint(f, &delta) || get_varint(f, &rec->duration)
+	    || get_varint(f, &ret))
+		return -1;
+	rec->start = prev + delta;
+	rec->ret = unzigzag(ret);
+	if (has_fd(op)) {
+		if (get_varint(f, &v))
+			return -1;
+		rec->fd = unzigzag(v);
+	}
+	if (has_arg(op) && get_varint(f, &rec->arg))
+		return -1;
+	if (has_name(op) && get_name(f, rec->name, sizeof(rec->name)))
+		return -1;
+	if (op == TRACE_CLONE && get_name(f, rec->name2, sizeof(rec->name2)))
+		return -1;
+
+	return 1;
+}
@@ -0,0 +1,118 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+/*
+ * Trace of the calls made to a mounted file system, as taken by
+ * fs_trace_start() and read back by fs_replay.
+ *
+ * A trace file starts with the 8-byte signature "FSTRACE1", followed by one
+ * record per call:
+ * - the operation, one byte,
+ * - the start of the call in nanoseconds after the start of the previous one
+ *   (after the start of the trace for the first record), its duration in
+ *   nanoseconds, and its return value zigzag-encoded, as varints,
+ * - the arguments of the operation, see struct trace_rec.
+ * Varints are little-endian groups of 7 bits, the high bit of each byte
+ * telling whether another one follows. Names are NUL-terminated.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "fs.h"
+
+#define TRACE_SIGNATURE "FSTRACE1"
+
+/* Longest name recorded, including the NUL */
+#define TRACE_NAME_MAX 4096
+
+enum trace_op {
+	TRACE_MOUNT = 1,	/* name */
+	TRACE_MOUNT_RO,		/* name */
+	TRACE_UMOUNT,
+	TRACE_INFO,
+	TRACE_CREATE,		/* name */
+	TRACE_DELETE,		/* name */
+	TRACE_CLONE,		/* name, name2 */
+	TRACE_COMPRESS,		/* name */
+	TRACE_LS,
+	TRACE_OPEN,		/* name */
+	TRACE_CLOSE,		/* fd */
+	TRACE_STAT,		/* fd */
+	TRACE_LSEEK,		/* fd, arg (offset) */
+	TRACE_WRITE,		/* fd, arg (count) */
+	TRACE_READ,		/* fd, arg (count) */
+	TRACE_OPS
+};
+
+/* One recorded call */
+struct trace_rec {
+	int op;
+	/* Nanoseconds since the start of the trace */
+	uint64_t start;
+	uint64_t duration;
+	int64_t ret;
+	int fd;
+	uint64_t arg;
+	char name[TRACE_NAME_MAX];
+	char name2[FS_FILENAME_LEN];
+};
+
+/* Name of every operation, as the fs_* function without its prefix */
+extern const char *const trace_op_names[TRACE_OPS];
+
+/* Trace being taken, NULL if none */
+extern FILE *trace_out;
+
+/**
+ * trace_clock - Current time for the trace
+ *
+ * Return: Nanoseconds on the monotonic clock.
+ */
+uint64_t trace_clock(void);
+
+/**
+ * trace_call - Record a call in the trace being taken
+ * @op: Operation
+ * @start: trace_clock() when the call started
+ * @ret: Return value of the call
+ * @fd: File descriptor argument, if @op has one
+ * @arg: Offset or count argument, if @op has one
+ * @name: Name argument, if @op has one
+ * @name2: Second name argument, if @op has one
+ *
+ * The trace is stopped, with a message, if it cannot be written.
+ */
+void trace_call(int op, uint64_t start, int ret, int fd, uint64_t arg,
+		const char *name, const char *name2);
+
+/**
+ * trace_auto_start - Start the trace named by the environment
+ *
+ * The first time it is called, start a trace into the file named by the
+ * FS_TRACE environment variable if it is set and no trace is being taken. That
+ * trace is stopped when the program exits.
+ */
+void trace_auto_start(void);
+
+/**
+ * trace_open - Open a trace file for reading
+ * @path: Name of the trace file
+ *
+ * Return: NULL if @path cannot be opened or is not a trace. Otherwise return
+ * the file, positioned on its first record.
+ */
+FILE *trace_open(const char *path);
+
+/**
+ * trace_read - Read the next record of a trace
+ * @f: Trace file opened with trace_open()
+ * @rec: Record to fill
+ * @prev: Start of the previous record, 0 for the first one
+ *
+ * Return: 1 if @rec was filled, 0 at the end of the trace, -1 if the record is
+ * truncated or corrupted.
+ */
+int trace_read(FILE *f, struct trace_rec *rec, uint64_t prev);
+
+#endif /* _TRACE_H */
@@ -0,0 +1,157 @@
+/*
+ * Queue contention benchmark
+ *
+ * Producer kernel threads enqueue items that consumer kernel threads dequeue,
+ * all at the same time, first through a linked queue behind a mutex, then
+ * through a concurrent queue. Checks that every item comes out exactly once,
+ * and reports the throughput of both.
+ *
+ * Usage: queue_bench.x [<producers>] [<consumers>] [<items per producer>]
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "queue.h"
+
+#define TEST_ASSERT(assert)			\
+do {						\
+	printf("ASSERT: " #assert " ... ");	\
+	if (assert) {				\
+		printf("PASS\n");		\
+	} else	{				\
+		printf("FAIL\n");		\
+		exit(1);			\
+	}					\
+} while(0)					\
+
+#define CAPACITY 1024
+
+static queue_t q;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int locked; //q is a linked queue, to be used under lock
+static long items;
+static atomic_long consumed;
+static atomic_ulong checksum;
+static long total;
+
+static int enqueue(void *data)
+{
+	int ret;
+
+	if (!locked)
+		return queue_enqueue(q, data);
+	pthread_mutex_lock(&lock);
+	ret = queue_enqueue(q, data);
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+static int dequeue(void **data)
+{
+	int ret;
+
+	if (!locked)
+		return queue_dequeue(q, data);
+	pthread_mutex_lock(&lock);
+	ret = queue_dequeue(q, data);
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+static void *producer(void *arg)
+{
+	uintptr_t base = (uintptr_t)arg * items;
+
+	for (long i = 1; i <= items; i++)
+		while (enqueue((void*)(base + i)))
+			sched_yield(); //full
+	return NULL;
+}
+
+static void *consumer(void *arg)
+{
+	unsigned long sum = 0;
+	void *data;
+	(void)arg;
+
+	while (atomic_load(&consumed) < total) {
+		if (dequeue(&data)) {
+			sched_yield(); //empty
+			continue;
+		}
+		sum += (uintptr_t)data;
+		atomic_fetch_add(&consumed, 1);
+	}
+	atomic_fetch_add(&checksum, sum);
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Run the producers and consumers through q, return the time it took */
+static double run(int producers, int consumers)
+{
+	pthread_t *threads = malloc((producers + consumers) * sizeof(*threads));
+	double start = now();
+
+	atomic_store(&consumed, 0);
+	atomic_store(&checksum, 0);
+	for (int i = 0; i < producers; i++)
+		pthread_create(&threads[i], NULL, producer, (void*)(uintptr_t)i);
+	for (int i = 0; i < consumers; i++)
+		pthread_create(&threads[producers + i], NULL, consumer, NULL);
+	for (int i = 0; i < producers + consumers; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	return now() - start;
+}
+
+int main(int argc, char **argv)
+{
+	int producers = argc > 1 ? atoi(argv[1]) : 4;
+	int consumers = argc > 2 ? atoi(argv[2]) : 4;
+	double linked, ring;
+	unsigned long expected;
+
+	items = argc > 3 ? atol(argv[3]) : 1000000;
+	if (producers <= 0 || consumers <= 0 || items <= 0) {
+		fprintf(stderr, "Usage: %s [<producers>] [<consumers>] "
+			"[<items per producer>]\n", argv[0]);
+		return 1;
+	}
+	total = producers * items;
+	/* Sum of 1 to total */
+	expected = (unsigned long)total * (total + 1) / 2;
+
+	fprintf(stderr, "*** TEST linked queue behind a mutex ***\n");
+	q = queue_create();
+	locked = 1;
+	linked = run(producers, consumers);
+	TEST_ASSERT(atomic_load(&checksum) == expected);
+	TEST_ASSERT(queue_destroy(q) == 0);
+
+	fprintf(stderr, "*** TEST concurrent queue ***\n");
+	q = queue_create_concurrent(CAPACITY);
+	locked = 0;
+	ring = run(producers, consumers);
+	TEST_ASSERT(atomic_load(&checksum) == expected);
+	TEST_ASSERT(queue_destroy(q) == 0);
+
+	printf("%d producers, %d consumers, %ld items: linked+mutex %.1f Mops/s, "
+	       "concurrent %.1f Mops/s\n", producers, consumers, total,
+	       total / linked / 1e6, total / ring / 1e6);
+
+	return 0;
+}
@@ -154,6 +154,74 @@ void test_three_item(void){
 	TEST_ASSERT(queue_dequeue(q, NULL) == -1);
 }
 
+/* intrusive queue: fifo order, O(1) delete anywhere, reuse of links */
+struct item {
+	int val;
+	struct queue_link link;
+};
+
+void test_intrusive(void){
+	struct item items[3] = {{.val = 0}, {.val = 1}, {.val = 2}};
+	struct iqueue q;
+	struct queue_link *l;
+
+	fprintf(stderr, "*** TEST intrusive queue ***\n");
+	iqueue_init(&q);
+	TEST_ASSERT(iqueue_length(&q) == 0);
+	TEST_ASSERT(iqueue_dequeue(&q) == NULL);
+	for (int i = 0; i < 3; i++)
+		iqueue_enqueue(&q, &items[i].link);
+	TEST_ASSERT(iqueue_length(&q) == 3);
+
+	fprintf(stderr, "*** TEST intrusive delete middle item ***\n");
+	iqueue_delete(&q, &items[1].link);
+	TEST_ASSERT(iqueue_length(&q) == 2);
+
+	fprintf(stderr, "*** TEST intrusive re-enqueue deleted item ***\n");
+	iqueue_enqueue(&q, &items[1].link);
+	l = iqueue_dequeue(&q);
+	TEST_ASSERT(iqueue_entry(l, struct item, link)->val == 0);
+	l = iqueue_dequeue(&q);
+	TEST_ASSERT(iqueue_entry(l, struct item, link)->val == 2);
+	l = iqueue_dequeue(&q);
+	TEST_ASSERT(iqueue_entry(l, struct item, link)->val == 1);
+	TEST_ASSERT(iqueue_length(&q) == 0);
+	TEST_ASSERT(iqueue_dequeue(&q) == NULL);
+}
+
+
+/* concurrent queue, single threaded: same contract, bounded */
+void test_concurrent(void){
+	int data[] = {0,1,2,3,4};
+	int *ptr;
+	queue_t q;
+
+	fprintf(stderr, "*** TEST concurrent queue ***\n");
+	q = queue_create_concurrent(3);
+	TEST_ASSERT(q != NULL);
+	TEST_ASSERT(queue_dequeue(q, (void**)&ptr) == -1);
+	TEST_ASSERT(queue_enqueue(q, NULL) == -1);
+	for (int i = 0; i < 4; i++)
+		TEST_ASSERT(queue_enqueue(q, &data[i]) == 0);
+
+	fprintf(stderr, "*** TEST concurrent queue full ***\n");
+	TEST_ASSERT(queue_enqueue(q, &data[4]) == -1);
+	TEST_ASSERT(queue_length(q) == 4);
+	TEST_ASSERT(queue_delete(q, &data[0]) == -1);
+	TEST_ASSERT(queue_iterate(q, find_item, (void*)0, NULL) == -1);
+	TEST_ASSERT(queue_destroy(q) == -1);
+
+	fprintf(stderr, "*** TEST concurrent queue order across wrap ***\n");
+	queue_dequeue(q, (void**)&ptr);
+	TEST_ASSERT(ptr == &data[0]);
+	TEST_ASSERT(queue_enqueue(q, &data[4]) == 0);
+	for (int i = 1; i < 5; i++) {
+		queue_dequeue(q, (void**)&ptr);
+		TEST_ASSERT(ptr == &data[i]);
+	}
+	TEST_ASSERT(queue_length(q) == 0);
+	TEST_ASSERT(queue_destroy(q) == 0);
+}
 
 int main(void)
 {
@@ -161,6 +229,8 @@ int main(void)
 	test_queue_simple();
 	test_iterator();
 	test_three_item();
+	test_intrusive();
+	test_concurrent();
 	fprintf(stderr, "*** Test complete. ***\n");
 	return 0;
 }
@@ -0,0 +1,94 @@
+/*
+ * Many threads test
+ *
+ * Creates a large number of threads (100,000 by default) that all stay alive
+ * at the same time, each of them yielding once before waiting for the main
+ * thread to let them finish. Stacks are reserved without committing memory, so
+ * the resident size only grows with the pages the threads actually touch:
+ * about one per thread here, whatever the stack size.
+ *
+ * Usage: uthread_many.x [<threads>] [<stack size in KiB>]
+ *
+ * Threads are created without a guard page, since each guard takes a mapping
+ * of its own and the kernel limits them to vm.max_map_count (65,530 by
+ * default).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "uthread.h"
+
+static volatile int go;
+static int started;
+
+int worker(void)
+{
+	started++;
+	while (!go)
+		uthread_yield();
+	return 1;
+}
+
+/* Resident memory of the process, in MiB */
+static double resident(void)
+{
+	long pages = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (f) {
+		if (fscanf(f, "%*d %ld", &pages) != 1)
+			pages = 0;
+		fclose(f);
+	}
+	return (double)pages * sysconf(_SC_PAGESIZE) / (1 << 20);
+}
+
+int main(int argc, char **argv)
+{
+	struct uthread_attr attr;
+	int count = argc > 1 ? atoi(argv[1]) : 100000;
+	int i, ret, sum = 0;
+	uthread_t *tids;
+	double before;
+
+	uthread_attr_init(&attr);
+	attr.guard_size = 0;
+	if (argc > 2)
+		attr.stack_size = (size_t)atoi(argv[2]) << 10;
+
+	tids = malloc(count * sizeof(*tids));
+	if (count <= 0 || !tids) {
+		fprintf(stderr, "Usage: %s [<threads>] [<stack size in KiB>]\n",
+			argv[0]);
+		return 1;
+	}
+
+	uthread_start(0);
+	before = resident();
+	for (i = 0; i < count; i++) {
+		ret = uthread_create_attr(worker, &attr);
+		if (ret < 0) {
+			fprintf(stderr, "Cannot create thread %d\n", i + 1);
+			return 1;
+		}
+		tids[i] = ret;
+	}
+
+	/* Let every thread run up to its first yield */
+	uthread_yield();
+	printf("%d threads alive (%d started), %zu KiB stacks: %.1f MiB resident "
+	       "(%.1f KiB per thread)\n", count, started, attr.stack_size >> 10,
+	       resident(), (resident() - before) * 1024 / count);
+
+	go = 1;
+	for (i = 0; i < count; i++) {
+		uthread_join(tids[i], &ret);
+		sum += ret;
+	}
+	printf("%d threads joined\n", sum);
+	uthread_stop();
+	free(tids);
+
+	return 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * M:N scaling test
+ *
+ * Runs the same embarrassingly parallel workload, independent CPU-bound
+ * threads that yield now and then, on one kernel thread and then on several,
+ * and reports the speedup.
+ *
+ * Usage: uthread_parallel.x [<workers>] [<threads>]
+ *
+ * By default, there is one worker per online processor, and 256 threads.
+ */
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "uthread.h"
+
+#define ITERATIONS 2000000
+#define YIELD_EVERY 100000
+
+static atomic_ulong checksum;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int task(void)
+{
+	unsigned long x = uthread_self();
+
+	for (int i = 1; i <= ITERATIONS; i++) {
+		x = x * 6364136223846793005UL + 1442695040888963407UL;
+		if (i % YIELD_EVERY == 0)
+			uthread_yield();
+	}
+	atomic_fetch_xor(&checksum, x >> 32);
+	return 1;
+}
+
+/* Run @count threads on @workers kernel threads, return the time it took */
+static double run(int workers, int count, uthread_t *tids)
+{
+	int ret, sum = 0;
+	double start = now();
+
+	if (uthread_start_workers(workers)) {
+		fprintf(stderr, "Cannot start %d workers\n", workers);
+		exit(1);
+	}
+	for (int i = 0; i < count; i++)
+		tids[i] = uthread_create(task);
+	for (int i = 0; i < count; i++) {
+		uthread_join(tids[i], &ret);
+		sum += ret;
+	}
+	if (sum != count || uthread_stop()) {
+		fprintf(stderr, "%d threads out of %d joined\n", sum, count);
+		exit(1);
+	}
+
+	return now() - start;
+}
+
+int main(int argc, char **argv)
+{
+	int workers = argc > 1 ? atoi(argv[1]) : 0;
+	int count = argc > 2 ? atoi(argv[2]) : 256;
+	uthread_t *tids = malloc(count * sizeof(*tids));
+	double one, many;
+
+	if (!workers)
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers <= 0 || count <= 0 || !tids) {
+		fprintf(stderr, "Usage: %s [<workers>] [<threads>]\n", argv[0]);
+		return 1;
+	}
+
+	one = run(1, count, tids);
+	many = run(workers, count, tids);
+	printf("%d threads: %.3f s on 1 worker, %.3f s on %d (%.2fx)\n", count,
+	       one, many, workers, one / many);
+	free(tids);
+
+	return 0;
+}
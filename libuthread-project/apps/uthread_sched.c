@@ -0,0 +1,113 @@
+/*
+ * Scheduling policies test
+ *
+ * Runs CPU-bound batch threads, which never yield, next to an interactive
+ * thread that works for about 100 us and then yields, a number of times.
+ * Reports how long the interactive thread waited each time it yielded, and
+ * how much the batch threads got done meanwhile.
+ *
+ * Usage: uthread_sched.x [fifo|prio|mlfq]
+ *
+ * With fifo, the interactive thread waits behind a whole quantum of every
+ * batch thread each time. With prio it is given a higher priority than the
+ * batch threads, so it runs without waiting for them, and they only run once it
+ * is done. With mlfq every thread has the same priority, but the batch threads
+ * are demoted below the interactive one as they use their quanta: it waits
+ * for them at first, then rarely.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "uthread.h"
+
+#define BATCH 4
+#define ROUNDS 200
+
+static volatile int done;
+static volatile unsigned long work[BATCH];
+static int next_batch;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void spin(double seconds)
+{
+	double end = now() + seconds;
+
+	while (now() < end)
+		;
+}
+
+int batch(void)
+{
+	int i = next_batch++;
+
+	while (!done)
+		work[i]++;
+	return 0;
+}
+
+int interactive(void)
+{
+	double wait = 0, max = 0;
+
+	for (int i = 0; i < ROUNDS; i++) {
+		spin(100e-6);
+		double start = now();
+		uthread_yield();
+		double w = now() - start;
+		wait += w;
+		if (w > max)
+			max = w;
+	}
+	done = 1;
+	printf("interactive: %.3f ms mean wait per yield, %.3f ms max\n",
+	       wait / ROUNDS * 1e3, max * 1e3);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	static const char *names[] = { "fifo", "prio", "mlfq" };
+	enum uthread_sched policy = UTHREAD_SCHED_FIFO;
+	struct uthread_attr attr;
+	uthread_t tids[BATCH + 1];
+	unsigned long total = 0;
+	double start;
+
+	if (argc > 1) {
+		for (policy = 0; policy < 3; policy++)
+			if (!strcmp(argv[1], names[policy]))
+				break;
+		if (policy == 3) {
+			fprintf(stderr, "Usage: %s [fifo|prio|mlfq]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	uthread_start_sched(1, policy);
+	start = now();
+	uthread_attr_init(&attr);
+	if (policy == UTHREAD_SCHED_PRIO)
+		attr.priority = UTHREAD_PRIO_MAX;
+	tids[0] = uthread_create_attr(interactive, &attr);
+	for (int i = 1; i <= BATCH; i++)
+		tids[i] = uthread_create(batch);
+	/* The main thread only joins, it never competes with the others */
+	for (int i = 0; i <= BATCH; i++)
+		uthread_join(tids[i], NULL);
+
+	for (int i = 0; i < BATCH; i++)
+		total += work[i];
+	printf("%s: %.3f s, %lu batch iterations\n", names[policy],
+	       now() - start, total);
+	uthread_stop();
+
+	return 0;
+}
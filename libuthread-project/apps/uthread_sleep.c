@@ -0,0 +1,91 @@
+/*
+ * Sleeping test
+ *
+ * Periodic threads, with periods from 1 to 8 ms, each sleep until their next
+ * deadline a number of times. Checks that no sleep ends before its deadline,
+ * and reports how late they end, and how much processor time the process took
+ * compared to the time it ran: with nothing to do between deadlines, it should
+ * take almost none.
+ *
+ * Usage: uthread_sleep.x [<workers>]
+ *
+ * Without argument, runs on a single kernel thread with preemption. Otherwise
+ * runs in M:N mode on <workers> kernel threads.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "uthread.h"
+
+#define THREADS 8
+#define PERIOD_NS 1000000
+#define RUN_NS 500000000
+
+static uint64_t clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t late_total, late_max;
+static long wakeups;
+
+int periodic(void)
+{
+	/* Threads 1 to 8 have periods of 1 to 8 ms */
+	uint64_t period = PERIOD_NS * (1 + (uthread_self() - 1) % THREADS);
+	uint64_t deadline = clock_ns(CLOCK_MONOTONIC);
+
+	for (uint64_t i = 0; i < RUN_NS / period; i++) {
+		deadline += period;
+		uthread_sleep_until(deadline);
+
+		uint64_t now = clock_ns(CLOCK_MONOTONIC);
+
+		if (now < deadline) {
+			printf("FAIL: woke %llu ns early\n",
+			       (unsigned long long)(deadline - now));
+			exit(1);
+		}
+		/* Counted under preemption or on several workers: approximate */
+		late_total += now - deadline;
+		if (now - deadline > late_max)
+			late_max = now - deadline;
+		wakeups++;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	uthread_t tids[THREADS];
+	uint64_t start, elapsed, cpu;
+
+	if (argc > 1 ? uthread_start_workers(atoi(argv[1])) : uthread_start(1)) {
+		fprintf(stderr, "Cannot start\n");
+		return 1;
+	}
+
+	start = clock_ns(CLOCK_MONOTONIC);
+	cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+	for (int i = 0; i < THREADS; i++)
+		tids[i] = uthread_create(periodic);
+	/* The main thread sleeps too, and is the first to be due */
+	uthread_sleep_ns(PERIOD_NS / 2);
+	for (int i = 0; i < THREADS; i++)
+		uthread_join(tids[i], NULL);
+	elapsed = clock_ns(CLOCK_MONOTONIC) - start;
+	cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+	uthread_stop();
+
+	printf("%ld wakeups in %.3f s: %.1f us late on average, %.1f us at most, "
+	       "%.1f%% CPU\n", wakeups, elapsed / 1e9,
+	       late_total / 1e3 / (wakeups ? wakeups : 1), late_max / 1e3,
+	       100.0 * cpu / elapsed);
+
+	return 0;
+}
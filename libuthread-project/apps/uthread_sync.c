@@ -0,0 +1,145 @@
+/*
+ * Synchronization primitives test
+ *
+ * Producers and consumers exchange items through a bounded buffer, guarded by
+ * a mutex with condition variables for "not full" and "not empty", while the
+ * number of items in flight is also bounded by a semaphore. Each thread spends
+ * some time working inside its critical section, so that preemption often
+ * finds it there and the other threads must block on the mutex.
+ *
+ * Usage: uthread_sync.x [<workers>]
+ *
+ * Without argument, runs on a single kernel thread with preemption. Otherwise
+ * runs in M:N mode on <workers> kernel threads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "sync.h"
+#include "uthread.h"
+
+#define PRODUCERS 4
+#define CONSUMERS 4
+#define ITEMS 2000
+#define SLOTS 8
+#define IN_FLIGHT 4
+
+static uthread_mutex_t mutex;
+static uthread_cond_t not_full, not_empty;
+static uthread_sem_t in_flight;
+
+static long buffer[SLOTS];
+static int head, count;
+static long produced, consumed, sum;
+static int inside; //threads in a critical section, must stay 0 or 1
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Busy for 20 us, long enough to be preempted now and then */
+static void work(void)
+{
+	double end = now() + 20e-6;
+
+	while (now() < end)
+		;
+}
+
+static void check(int ok, const char *what)
+{
+	if (!ok) {
+		printf("FAIL: %s\n", what);
+		exit(1);
+	}
+}
+
+int producer(void)
+{
+	for (long i = 1; i <= ITEMS; i++) {
+		uthread_sem_down(in_flight);
+		uthread_mutex_lock(mutex);
+		check(++inside == 1, "mutual exclusion");
+		while (count == SLOTS) {
+			inside--;
+			uthread_cond_wait(not_full, mutex);
+			inside++;
+		}
+		buffer[(head + count++) % SLOTS] = i;
+		produced++;
+		work();
+		inside--;
+		uthread_cond_signal(not_empty);
+		uthread_mutex_unlock(mutex);
+	}
+	return 0;
+}
+
+int consumer(void)
+{
+	for (long i = 1; i <= ITEMS; i++) {
+		uthread_mutex_lock(mutex);
+		check(++inside == 1, "mutual exclusion");
+		while (count == 0) {
+			inside--;
+			uthread_cond_wait(not_empty, mutex);
+			inside++;
+		}
+		sum += buffer[head];
+		head = (head + 1) % SLOTS;
+		count--;
+		consumed++;
+		work();
+		inside--;
+		uthread_cond_signal(not_full);
+		uthread_mutex_unlock(mutex);
+		uthread_sem_up(in_flight);
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	uthread_t tids[PRODUCERS + CONSUMERS];
+	double start, elapsed;
+
+	if (argc > 1 ? uthread_start_workers(atoi(argv[1])) : uthread_start(1)) {
+		fprintf(stderr, "Cannot start\n");
+		return 1;
+	}
+	mutex = uthread_mutex_create();
+	not_full = uthread_cond_create();
+	not_empty = uthread_cond_create();
+	in_flight = uthread_sem_create(IN_FLIGHT);
+
+	start = now();
+	for (int i = 0; i < PRODUCERS; i++)
+		tids[i] = uthread_create(producer);
+	for (int i = 0; i < CONSUMERS; i++)
+		tids[PRODUCERS + i] = uthread_create(consumer);
+	for (int i = 0; i < PRODUCERS + CONSUMERS; i++)
+		uthread_join(tids[i], NULL);
+	elapsed = now() - start;
+
+	check(produced == PRODUCERS * ITEMS && consumed == CONSUMERS * ITEMS,
+	      "every item exchanged");
+	check(sum == (long)PRODUCERS * ITEMS * (ITEMS + 1) / 2, "items intact");
+	check(uthread_mutex_trylock(mutex) == 0, "mutex free at the end");
+	check(uthread_mutex_lock(mutex) == -1, "relocking fails");
+	check(uthread_mutex_destroy(mutex) == -1, "locked mutex kept");
+	uthread_mutex_unlock(mutex);
+	check(uthread_mutex_unlock(mutex) == -1, "unlocking twice fails");
+	check(uthread_mutex_destroy(mutex) == 0 && uthread_cond_destroy(not_full) == 0
+	      && uthread_cond_destroy(not_empty) == 0
+	      && uthread_sem_destroy(in_flight) == 0, "destroyed");
+	check(uthread_stop() == 0, "stopped");
+
+	printf("%ld items through %d slots in %.3f s\n", produced, SLOTS, elapsed);
+
+	return 0;
+}
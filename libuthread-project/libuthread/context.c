@@ -1,12 +1,15 @@
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "private.h"
 #include "uthread.h"
 
-/* Size of the stack for a thread (in bytes) */
-#define UTHREAD_STACK_SIZE 32768
-
+#ifndef UTHREAD_CTX_ASM
 void uthread_ctx_switch(uthread_ctx_t *prev, uthread_ctx_t *next)
 {
 	/*
@@ -18,15 +21,218 @@ void uthread_ctx_switch(uthread_ctx_t *prev, uthread_ctx_t *next)
 		exit(1);
 	}
 }
+#endif
+
+/*
+ * Stack pool
+ *
+ * Stacks are reserved with MAP_NORESERVE, so that only the pages a thread
+ * actually touches take memory, with an inaccessible guard region below them
+ * so that an overflow faults instead of silently corrupting memory.
+ *
+ * Stacks of the default size and guard are never unmapped: a released one
+ * goes back to the pool and is handed out again before any new one is
+ * mapped, the most recently released first since its top is likely still
+ * cached. The STACK_POOL_HIGH most recent ones are kept as they are; older
+ * ones are trimmed, their memory being given back to the system with
+ * madvise(MADV_DONTNEED), and kept on a cold list. A trimmed stack still holds
+ * its top page and two mappings, so the cold list keeps STACK_POOL_COLD of
+ * them at most, and stacks beyond are unmapped. Stacks of other sizes are
+ * unmapped when released, and uthread_stop() releases the whole pool.
+ *
+ * Pooled stacks are linked through their top page, which trimming spares. In
+ * use, that page also holds the descriptor of the thread (see below), so that
+ * a thread takes a single allocation, served by the pool.
+ */
+#define STACK_POOL_HIGH 64
+#define STACK_POOL_COLD 1024
+
+struct pooled_stack {
+	struct pooled_stack *next;
+};
+
+/* Most recently released stacks, a ring whose @warm_head slot is next */
+static void *warm[STACK_POOL_HIGH];
+static unsigned int warm_head;
+static unsigned int warm_count;
+/* Trimmed stacks */
+static struct pooled_stack *cold;
+static unsigned int cold_count;
+/* Workers allocate stacks concurrently in M:N mode */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t page_size(void)
+{
+	static size_t size;
+
+	if (!size)
+		size = sysconf(_SC_PAGESIZE);
+	return size;
+}
+
+/* Sizes are rounded up to whole pages */
+static size_t page_round(size_t size)
+{
+	return (size + page_size() - 1) & ~(page_size() - 1);
+}
+
+/* Whether stacks of @size with @guard go to the pool */
+static int pooled(size_t size, size_t guard)
+{
+	return page_round(size) == page_round(UTHREAD_STACK_DEFAULT)
+		&& page_round(guard) == page_size();
+}
+
+static struct pooled_stack *stack_link(void *stack)
+{
+	return (struct pooled_stack *)((char *)stack
+				       + page_round(UTHREAD_STACK_DEFAULT)) - 1;
+}
+
+static void *stack_of(struct pooled_stack *link)
+{
+	return (char *)(link + 1) - page_round(UTHREAD_STACK_DEFAULT);
+}
+
+static void stack_unmap(void *stack, size_t size, size_t guard)
+{
+	size = page_round(size);
+	guard = page_round(guard);
+	munmap((char *)stack - guard, guard + size);
+}
+
+static void *pool_get(void)
+{
+	void *stack = NULL;
+
+	preempt_disable();
+	pthread_mutex_lock(&pool_lock);
+	if (warm_count) {
+		warm_head = (warm_head - 1) % STACK_POOL_HIGH;
+		warm_count--;
+		stack = warm[warm_head];
+	} else if (cold) {
+		stack = stack_of(cold);
+		cold = cold->next;
+		cold_count--;
+	}
+	pthread_mutex_unlock(&pool_lock);
+	preempt_enable();
+
+	return stack;
+}
+
+static void pool_put(void *stack)
+{
+	preempt_disable();
+	pthread_mutex_lock(&pool_lock);
+	if (warm_count == STACK_POOL_HIGH) {
+		/* Full ring: its head slot holds the oldest stack, trim it */
+		void *old = warm[warm_head];
+		struct pooled_stack *link = stack_link(old);
+
+		if (cold_count == STACK_POOL_COLD) {
+			stack_unmap(old, UTHREAD_STACK_DEFAULT, page_size());
+		} else {
+			madvise(old, page_round(UTHREAD_STACK_DEFAULT) - page_size(),
+				MADV_DONTNEED);
+			link->next = cold;
+			cold = link;
+			cold_count++;
+		}
+		warm_count--;
+	}
+	warm[warm_head] = stack;
+	warm_head = (warm_head + 1) % STACK_POOL_HIGH;
+	warm_count++;
+	pthread_mutex_unlock(&pool_lock);
+	preempt_enable();
+}
 
-void *uthread_ctx_alloc_stack(void)
+void *uthread_ctx_alloc_stack(size_t size, size_t guard)
 {
-	return malloc(UTHREAD_STACK_SIZE);
+	void *stack = pooled(size, guard) ? pool_get() : NULL;
+	char *map;
+
+	if (stack)
+		return stack;
+
+	size = page_round(size);
+	guard = page_round(guard);
+	map = mmap(NULL, guard + size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_NORESERVE,
+		   -1, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+	if (guard && mprotect(map, guard, PROT_NONE)) {
+		munmap(map, guard + size);
+		return NULL;
+	}
+
+	return map + guard;
 }
 
-void uthread_ctx_destroy_stack(void *top_of_stack)
+void uthread_ctx_destroy_stack(void *top_of_stack, size_t size, size_t guard)
 {
-	free(top_of_stack);
+	if (!top_of_stack)
+		return;
+
+	if (pooled(size, guard)) {
+		pool_put(top_of_stack);
+		return;
+	}
+
+	stack_unmap(top_of_stack, size, guard);
+}
+
+void uthread_ctx_release_stacks(void)
+{
+	preempt_disable();
+	pthread_mutex_lock(&pool_lock);
+	for (; warm_count; warm_count--) {
+		warm_head = (warm_head - 1) % STACK_POOL_HIGH;
+		stack_unmap(warm[warm_head], UTHREAD_STACK_DEFAULT, page_size());
+	}
+	while (cold) {
+		void *stack = stack_of(cold);
+
+		cold = cold->next;
+		stack_unmap(stack, UTHREAD_STACK_DEFAULT, page_size());
+	}
+	cold_count = 0;
+	pthread_mutex_unlock(&pool_lock);
+	preempt_enable();
+}
+
+/*
+ * Thread descriptors sit at the top of their stack, aligned on a cache line,
+ * within the top page that trimming spares. A pooled stack's link overlaps
+ * them, but only once the thread is gone.
+ */
+struct uthread_data *uthread_ctx_alloc_thread(size_t size, size_t guard)
+{
+	char *stack = uthread_ctx_alloc_stack(size, guard);
+	struct uthread_data *thd;
+
+	if (!stack)
+		return NULL;
+
+	thd = (struct uthread_data *)(((uintptr_t)stack + page_round(size)
+				       - sizeof(*thd)) & ~(uintptr_t)63);
+	thd->stk_ptr = stack;
+	thd->stk_size = size;
+	thd->stk_guard = guard;
+
+	return thd;
+}
+
+void uthread_ctx_destroy_thread(struct uthread_data *thd)
+{
+	/* Releasing the stack may overwrite the descriptor */
+	void *stack = thd->stk_ptr;
+	size_t size = thd->stk_size, guard = thd->stk_guard;
+
+	uthread_ctx_destroy_stack(stack, size, guard);
 }
 
 /*
@@ -44,7 +250,40 @@ static void uthread_ctx_bootstrap(uthread_func_t func)
 	uthread_exit(func());
 }
 
-int uthread_ctx_init(uthread_ctx_t *uctx, void *top_of_stack,
+#ifdef UTHREAD_CTX_ASM
+/* Entry point of new contexts, in context_x86_64.S */
+void uthread_ctx_trampoline(void);
+
+int uthread_ctx_init(uthread_ctx_t *uctx, void *top_of_stack, size_t size,
+		     uthread_func_t func)
+{
+	uintptr_t top = ((uintptr_t)top_of_stack + size) & ~(uintptr_t)15;
+	uint64_t *frame = (uint64_t*)(top - 80);
+	uint32_t mxcsr;
+	uint16_t fpucw;
+
+	/*
+	 * Lay out the frame uthread_ctx_switch() pops when switching to @uctx
+	 * for the first time:
+	 * - the SSE and x87 control words, inherited from the creator
+	 * - r15, r14, rbx and rbp, cleared
+	 * - r13 and r12, the argument and function the trampoline calls
+	 * - the return address, the trampoline, which then runs with the
+	 *   stack aligned on 16 bytes as calls require
+	 */
+	__asm__ volatile ("stmxcsr %0\n\tfnstcw %1" : "=m" (mxcsr), "=m" (fpucw));
+	memset(frame, 0, 80);
+	memcpy(&frame[0], &mxcsr, sizeof(mxcsr));
+	memcpy((char*)&frame[0] + 4, &fpucw, sizeof(fpucw));
+	frame[3] = (uint64_t)(uintptr_t)func;
+	frame[4] = (uint64_t)(uintptr_t)uthread_ctx_bootstrap;
+	frame[7] = (uint64_t)(uintptr_t)uthread_ctx_trampoline;
+	uctx->sp = frame;
+
+	return 0;
+}
+#else
+int uthread_ctx_init(uthread_ctx_t *uctx, void *top_of_stack, size_t size,
 		     uthread_func_t func)
 {
 	/*
@@ -57,7 +296,7 @@ int uthread_ctx_init(uthread_ctx_t *uctx, void *top_of_stack,
 	 * Change context @uctx's stack to the specified stack
 	 */
 	uctx->uc_stack.ss_sp = top_of_stack;
-	uctx->uc_stack.ss_size = UTHREAD_STACK_SIZE;
+	uctx->uc_stack.ss_size = size;
 
 	/*
 	 * Finish setting up context @uctx:
@@ -69,4 +308,4 @@ int uthread_ctx_init(uthread_ctx_t *uctx, void *top_of_stack,
 
 	return 0;
 }
-
+#endif
@@ -0,0 +1,149 @@
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "deque.h"
+
+/*
+ * After "Correct and Efficient Work-Stealing for Weak Memory Models" (Lê, Pop,
+ * Cohen, Zappa Nardelli, PPoPP 2013), with the owner never taking from the
+ * bottom: items come out in the order they went in.
+ *
+ * Thieves may still be reading an array after the owner has replaced it with a
+ * larger one, so replaced arrays are only freed along with the deque.
+ */
+#define DEQUE_MIN 64
+#define CACHE_LINE 64
+
+struct deque_array {
+	struct deque_array *retired; //array this one replaced
+	long size; //power of 2
+	_Atomic(void *) items[];
+};
+
+struct deque {
+	/* Next item to steal, moved by thieves */
+	_Alignas(CACHE_LINE) atomic_long top;
+	/* Next free slot, moved by the owner only */
+	_Alignas(CACHE_LINE) atomic_long bottom;
+	_Atomic(struct deque_array *) array;
+};
+
+static struct deque_array *array_alloc(long size)
+{
+	struct deque_array *a = malloc(sizeof(*a) + size * sizeof(a->items[0]));
+
+	if (!a)
+		return NULL;
+	a->retired = NULL;
+	a->size = size;
+	return a;
+}
+
+deque_t deque_create(void)
+{
+	deque_t deque = aligned_alloc(CACHE_LINE, sizeof(struct deque));
+	struct deque_array *a = array_alloc(DEQUE_MIN);
+
+	if (!deque || !a) {
+		free(deque);
+		free(a);
+		return NULL;
+	}
+	atomic_init(&deque->top, 0);
+	atomic_init(&deque->bottom, 0);
+	atomic_init(&deque->array, a);
+
+	return deque;
+}
+
+int deque_destroy(deque_t deque)
+{
+	if (!deque || deque_length(deque) != 0)
+		return -1;
+
+	struct deque_array *a = atomic_load_explicit(&deque->array,
+						     memory_order_relaxed);
+	while (a) {
+		struct deque_array *retired = a->retired;
+		free(a);
+		a = retired;
+	}
+	free(deque);
+
+	return 0;
+}
+
+/* Replace the full array @a, holding items @t to @b, with one twice as large */
+static struct deque_array *grow(deque_t deque, struct deque_array *a,
+				long t, long b)
+{
+	struct deque_array *n = array_alloc(2 * a->size);
+
+	if (!n)
+		return NULL;
+	for (long i = t; i < b; i++)
+		atomic_store_explicit(&n->items[i & (n->size - 1)],
+			atomic_load_explicit(&a->items[i & (a->size - 1)],
+					     memory_order_relaxed),
+			memory_order_relaxed);
+	n->retired = a;
+	atomic_store_explicit(&deque->array, n, memory_order_release);
+
+	return n;
+}
+
+int deque_push(deque_t deque, void *data)
+{
+	if (!deque || !data)
+		return -1;
+
+	long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+	long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+	struct deque_array *a = atomic_load_explicit(&deque->array,
+						     memory_order_relaxed);
+
+	if (b - t > a->size - 1 && !(a = grow(deque, a, t, b)))
+		return -1;
+	atomic_store_explicit(&a->items[b & (a->size - 1)], data,
+			      memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+
+	return 0;
+}
+
+void *deque_steal(deque_t deque)
+{
+	for (;;) {
+		long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+		atomic_thread_fence(memory_order_seq_cst);
+		long b = atomic_load_explicit(&deque->bottom,
+					      memory_order_acquire);
+
+		if (t >= b)
+			return NULL;
+
+		struct deque_array *a = atomic_load_explicit(&deque->array,
+							     memory_order_acquire);
+		void *data = atomic_load_explicit(&a->items[t & (a->size - 1)],
+						  memory_order_relaxed);
+		if (atomic_compare_exchange_strong_explicit(&deque->top, &t,
+							    t + 1,
+							    memory_order_seq_cst,
+							    memory_order_relaxed))
+			return data;
+		/* Another thread got item @t first, try the next one */
+	}
+}
+
+int deque_length(deque_t deque)
+{
+	if (!deque)
+		return -1;
+
+	long b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+	long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+
+	return b > t ? (int)(b - t) : 0;
+}
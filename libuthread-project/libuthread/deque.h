@@ -0,0 +1,68 @@
+#ifndef _DEQUE_H
+#define _DEQUE_H
+
+/*
+ * deque_t - Work-stealing deque type
+ *
+ * A Chase-Lev deque: a single owner thread pushes items at the bottom, and any
+ * thread, the owner included, steals them from the top, in the order they
+ * were pushed. Neither operation takes a lock. The items are kept in a
+ * circular array, which the owner grows as needed.
+ */
+typedef struct deque* deque_t;
+
+/*
+ * deque_create - Allocate an empty deque
+ *
+ * Return: Pointer to new empty deque. NULL in case of failure when allocating
+ * the new deque.
+ */
+deque_t deque_create(void);
+
+/*
+ * deque_destroy - Deallocate a deque
+ * @deque: Deque to deallocate
+ *
+ * Deallocate the memory associated to the deque object pointed by @deque. No
+ * other thread may be using @deque anymore.
+ *
+ * Return: -1 if @deque is NULL or if @deque is not empty. 0 if @deque was
+ * successfully destroyed.
+ */
+int deque_destroy(deque_t deque);
+
+/*
+ * deque_push - Push an item at the bottom of a deque
+ * @deque: Deque in which to push the item
+ * @data: Address of data item to push
+ *
+ * Only the owner of @deque may push.
+ *
+ * Return: -1 if @deque or @data are NULL, or in case of memory allocation error
+ * when growing the deque. 0 if @data was successfully pushed.
+ */
+int deque_push(deque_t deque, void *data);
+
+/*
+ * deque_steal - Steal the item at the top of a deque
+ * @deque: Deque in which to steal an item
+ *
+ * Any thread may steal. When several race for the same item, only one gets it
+ * and the others move on to the next one.
+ *
+ * Return: The oldest item of @deque, or NULL if @deque is empty.
+ */
+void *deque_steal(deque_t deque);
+
+/*
+ * deque_length - Deque length
+ * @deque: Deque to get the length of
+ *
+ * Unless called by the owner with no thief around, the length may have
+ * changed by the time it is returned.
+ *
+ * Return: -1 if @deque is NULL. Length of @deque otherwise.
+ */
+int deque_length(deque_t deque);
+
+#endif /* _DEQUE_H */
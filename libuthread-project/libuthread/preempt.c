@@ -24,21 +24,37 @@ static struct sigaction oldsa;
 static struct itimerval old;
 static struct itimerval new;
 static int on = 0;
+/*
+ * preemption is disabled with a flag rather than by blocking SIGVTALRM, so
+ * that yielding takes no system call. a tick arriving meanwhile is kept
+ * pending until preempt_enable()
+ */
+static volatile sig_atomic_t disabled;
+static volatile sig_atomic_t pending;
 
 
-static void timer_handler(void)
+static void timer_handler(int signum)
 {
-	uthread_yield();
+	(void)signum;
+	if (disabled) {
+		pending = 1;
+		return;
+	}
+	uthread_tick();
 }
 
 void preempt_start(void)
 {
 	on = 1;
-	sa.sa_handler = (__sighandler_t)timer_handler;
+	disabled = 0;
+	pending = 0;
+	sa.sa_handler = timer_handler;
+	/*
+	 * the handler may switch to another thread without returning: the
+	 * signal must stay unblocked meanwhile, the flag protects the scheduler
+	 */
+	sa.sa_flags = SA_NODEFER;
 	sigemptyset (&sa.sa_mask);
-	sigemptyset (&oldsa.sa_mask);
-	sigaddset(&sa.sa_mask, SIGVTALRM);
-	preempt_enable();
 	sigaction(SIGVTALRM, &sa, &oldsa);
 	//period between each succesive timer is 10000 micro sec
 	new.it_interval.tv_sec = 0;
@@ -52,26 +68,27 @@ void preempt_start(void)
 void preempt_stop(void)
 {
 	preempt_disable();
-	sigaction(SIGVTALRM, &oldsa, NULL);
 	setitimer (ITIMER_VIRTUAL, &old, NULL);
+	sigaction(SIGVTALRM, &oldsa, NULL);
 	on = 0;
+	disabled = 0;
+	pending = 0;
 }
 
-/*unblock the signal with preemption*/
+/*let the timer preempt again, preempting now if it fired meanwhile*/
 void preempt_enable(void)
 {
 	if (!on) return;
-	sigset_t *ptr = NULL;
-	sigemptyset (&sa.sa_mask);
-	sigprocmask(SIG_UNBLOCK, &sa.sa_mask, ptr);
+	disabled = 0;
+	if (pending) {
+		pending = 0;
+		uthread_tick();
+	}
 }
 
-/*block the signal no preemption*/
+/*defer timer interrupts, no preemption*/
 void preempt_disable(void)
 {
 	if (!on) return;
-	sigset_t *ptr = NULL;
-	sigemptyset (&sa.sa_mask);
-	sigprocmask(SIG_BLOCK, &sa.sa_mask, ptr);
+	disabled = 1;
 }
-
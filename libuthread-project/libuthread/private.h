@@ -10,8 +10,6 @@
 /**
  * Private context API
  */
-#include <ucontext.h>
-
 #include "uthread.h"
 
 /*
@@ -23,8 +21,20 @@
  * Such a context is initialized for the first time when creating a thread with
  * uthread_ctx_init(). Once initialized, it can be switched to with
  * uthread_ctx_switch().
+ *
+ * On x86-64, contexts are switched by hand (see context_x86_64.S) and only
+ * hold a stack pointer. Elsewhere, or when built with UTHREAD_UCONTEXT defined
+ * (make UCONTEXT=1), they are switched with swapcontext().
  */
+#if defined(__x86_64__) && !defined(UTHREAD_UCONTEXT)
+#define UTHREAD_CTX_ASM
+typedef struct {
+	void *sp;
+} uthread_ctx_t;
+#else
+#include <ucontext.h>
 typedef ucontext_t uthread_ctx_t;
+#endif
 
 /*
  * uthread_ctx_switch - Switch between two execution contexts
@@ -36,28 +46,71 @@ void uthread_ctx_switch(uthread_ctx_t *prev, uthread_ctx_t *next);
 
 /*
  * uthread_ctx_alloc_stack - Allocate stack segment
+ * @size: Size of the stack in bytes
+ * @guard: Size of the inaccessible region below the stack in bytes, 0 for none
+ *
+ * Sizes are rounded up to whole pages. Stacks only take memory for the pages
+ * that get touched, and those of the default size and guard are recycled
+ * through a pool.
  *
  * Return: Pointer to the top of a valid stack segment, or NULL in case of
  * failure
  */
-void *uthread_ctx_alloc_stack(void);
+void *uthread_ctx_alloc_stack(size_t size, size_t guard);
 
 /*
  * uthread_ctx_destroy_stack - Deallocate stack segment
  * @top_of_stack: Address of stack to deallocate
+ * @size: Size the stack was allocated with
+ * @guard: Guard size the stack was allocated with
+ *
+ * Must not be called while running on the stack.
  */
-void uthread_ctx_destroy_stack(void *top_of_stack);
+void uthread_ctx_destroy_stack(void *top_of_stack, size_t size, size_t guard);
+
+/*
+ * uthread_ctx_release_stacks - Unmap every stack kept by the pool
+ *
+ * Called once no thread but the caller is left, which runs on its own stack.
+ */
+void uthread_ctx_release_stacks(void);
+
+struct uthread_data;
+
+/*
+ * uthread_ctx_alloc_thread - Allocate a thread descriptor with its stack
+ * @size: Size of the stack in bytes
+ * @guard: Size of the inaccessible region below the stack in bytes, 0 for none
+ *
+ * The descriptor is carved from the top page of a stack allocated with
+ * uthread_ctx_alloc_stack(), and the stack usable by the thread ends where it
+ * starts. A stack from the pool thus comes with its descriptor, and nothing
+ * else is allocated. The stk_ptr, stk_size and stk_guard fields are set.
+ *
+ * Return: Pointer to the descriptor, or NULL in case of failure
+ */
+struct uthread_data *uthread_ctx_alloc_thread(size_t size, size_t guard);
+
+/*
+ * uthread_ctx_destroy_thread - Deallocate a thread descriptor with its stack
+ * @thd: Descriptor allocated with uthread_ctx_alloc_thread()
+ *
+ * Must not be called while running on the stack.
+ */
+void uthread_ctx_destroy_thread(struct uthread_data *thd);
 
 /*
  * uthread_ctx_init - Initialize a thread's execution context
  * @uctx: Pointer to thread context to initialize
  * @top_of_stack: Pointer to the top of a valid stack segment, as allocated by
  *	uthread_ctx_alloc_stack()
+ * @size: Size of the stack usable from @top_of_stack, at most the size it was
+ *	allocated with
  * @func: Function to be executed by the thread
  *
  * Return: 0 if @uctx was properly initialized, or -1 in case of failure
  */
-int uthread_ctx_init(uthread_ctx_t *uctx, void *top_of_stack,
+int uthread_ctx_init(uthread_ctx_t *uctx, void *top_of_stack, size_t size,
 					 uthread_func_t func);
 
 
@@ -83,12 +136,297 @@ void preempt_stop(void);
 
 /*
  * preempt_enable - Enable preemption
+ *
+ * A timer interrupt received while preemption was disabled yields now.
  */
 void preempt_enable(void);
 
 /*
  * preempt_disable - Disable preemption
+ *
+ * Timer interrupts are not blocked, which would take a system call, but they
+ * only take note that the running thread must yield once preemption is enabled
+ * again. Context switches do not touch the signal mask either.
  */
 void preempt_disable(void);
 
+/**
+ * Private scheduling API
+ */
+#include "queue.h"
+
+/*
+ * struct sched_entity - Scheduling state of a thread
+ * @link: Link in the ready queues of the policy while @queued. Otherwise free
+ *	for the library to queue the thread elsewhere.
+ * @queued: Whether the thread is in the ready queues of the policy
+ * @prio: Priority the thread was given
+ * @level: Effective priority, managed by the policy
+ * @epoch: Policy-specific
+ */
+struct sched_entity {
+	struct queue_link link;
+	int queued;
+	int prio;
+	int level;
+	unsigned int epoch;
+};
+
+/*
+ * struct sched_policy - Scheduling policy
+ * @init: Prepare empty ready queues, when the library starts
+ * @setup: Reset @se after its priority was set, before it is first enqueued
+ * @enqueue: Make @se ready to run
+ * @pick_next: Dequeue the thread to run next, NULL if none is ready
+ * @remove: Dequeue @se, which is queued, without running it
+ * @tick: Account a timer tick to @se, running. The thread yields afterwards.
+ *
+ * Hooks are called with preemption disabled.
+ */
+struct sched_policy {
+	void (*init)(void);
+	void (*setup)(struct sched_entity *se);
+	void (*enqueue)(struct sched_entity *se);
+	struct sched_entity *(*pick_next)(void);
+	void (*remove)(struct sched_entity *se);
+	void (*tick)(struct sched_entity *se);
+};
+
+/*
+ * sched_policy_get - Get a scheduling policy
+ * @policy: Policy to get
+ *
+ * Return: The policy, or NULL if @policy is unknown
+ */
+const struct sched_policy *sched_policy_get(enum uthread_sched policy);
+
+/*
+ * uthread_tick - Preempt the running thread
+ *
+ * Called at timer interrupts while preemption is enabled: account the tick to
+ * the running thread, then yield.
+ */
+void uthread_tick(void);
+
+/**
+ * Private waiting API, for the synchronization primitives
+ */
+#include <stdatomic.h>
+
+/*
+ * struct wait_queue - Threads blocked until another one wakes them
+ * @guard: Taken by wait_lock() in M:N mode
+ * @waiters: Blocked threads, oldest first
+ */
+struct wait_queue {
+	atomic_flag guard;
+	struct iqueue waiters;
+};
+
+/*
+ * wait_init - Initialize an empty wait queue
+ * @wq: Wait queue to initialize
+ */
+void wait_init(struct wait_queue *wq);
+
+/*
+ * wait_lock - Lock a wait queue against other workers
+ * @wq: Wait queue to lock
+ *
+ * Only locks in M:N mode. Against preemption, callers disable it beforehand,
+ * once for all the wait queues they lock.
+ */
+void wait_lock(struct wait_queue *wq);
+
+/*
+ * wait_unlock - Unlock a wait queue
+ * @wq: Wait queue to unlock
+ */
+void wait_unlock(struct wait_queue *wq);
+
+/*
+ * wait_sleep - Block the running thread on a wait queue
+ * @wq: Wait queue, locked, with preemption disabled
+ *
+ * Return: Once woken by wait_wake(), with @wq unlocked and preemption enabled.
+ */
+void wait_sleep(struct wait_queue *wq);
+
+/*
+ * wait_wake - Wake the oldest thread of a wait queue
+ * @wq: Wait queue, locked
+ *
+ * Return: TID of the thread made ready, -1 if @wq is empty
+ */
+int wait_wake(struct wait_queue *wq);
+
+/**
+ * Private timer API
+ */
+#include <stdint.h>
+
+/* A tick of the timer wheel is 2^TIMER_SHIFT ns, about a microsecond */
+#define TIMER_SHIFT 10
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS 8
+
+/*
+ * struct timer - Timer of a timer wheel
+ * @link: Link in the slot of the wheel holding the timer
+ * @expires: Tick at which the timer expires
+ */
+struct timer {
+	struct queue_link link;
+	uint64_t expires;
+};
+
+/*
+ * struct timer_wheel - Hierarchical timer wheel
+ * @clock: Tick up to which timers have been expired
+ * @count: Number of timers in the wheel
+ * @occupied: Bitmap of the non-empty slots, per level
+ * @slots: Timers, per level and slot
+ *
+ * See timer.c. The wheel is not locked, its user does it.
+ */
+struct timer_wheel {
+	uint64_t clock;
+	unsigned int count;
+	uint64_t occupied[TIMER_LEVELS];
+	struct iqueue slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+/*
+ * timer_now - Current time of CLOCK_MONOTONIC, in nanoseconds
+ */
+uint64_t timer_now(void);
+
+/*
+ * timer_wheel_init - Initialize an empty timer wheel
+ * @wheel: Timer wheel to initialize
+ * @now: Current time, in nanoseconds
+ */
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now);
+
+/*
+ * timer_add - Add a timer to a timer wheel
+ * @wheel: Timer wheel
+ * @timer: Timer, not in any wheel
+ * @deadline: Time at which @timer expires, in nanoseconds. Rounded up to a
+ *	whole tick.
+ */
+void timer_add(struct timer_wheel *wheel, struct timer *timer,
+	       uint64_t deadline);
+
+/*
+ * timer_expire - Remove the expired timers of a timer wheel
+ * @wheel: Timer wheel
+ * @now: Current time, in nanoseconds
+ * @expired: Queue to which expired timers are moved, through their link
+ */
+void timer_expire(struct timer_wheel *wheel, uint64_t now,
+		  struct iqueue *expired);
+
+/*
+ * timer_next - Time at which a timer wheel must be expired next
+ * @wheel: Timer wheel
+ *
+ * Timers far away only cascade at that time, which is never later than the
+ * earliest expiry.
+ *
+ * Return: Time in nanoseconds, UINT64_MAX if @wheel is empty
+ */
+uint64_t timer_next(const struct timer_wheel *wheel);
+
+/**
+ * Private sleeping API, for the workers
+ */
+
+/*
+ * sleep_expire - Make the threads whose sleep is over ready
+ *
+ * Return: Time at which the next sleeper may be due, UINT64_MAX if none
+ */
+uint64_t sleep_expire(void);
+
+/*
+ * sleep_next - Time at which the next sleeper may be due, UINT64_MAX if none
+ */
+uint64_t sleep_next(void);
+
+/**
+ * Private M:N API
+ *
+ * With uthread_start_workers(), threads run on several kernel threads, the
+ * workers. Each has a deque of ready threads and steals from the others when
+ * its own is empty. A thread that stops running switches to the scheduler of
+ * its worker, which then publishes what the thread left to do: until then
+ * another worker must not resume it, as it is still on its stack.
+ */
+
+/*
+ * struct uthread_data - Thread, as known to the scheduler
+ *
+ * The main thread, TID 0, always runs on the kernel thread that started the
+ * library.
+ */
+struct uthread_data {
+	uthread_t tid;
+	uthread_ctx_t context;
+	void *stk_ptr; //pointer to top of stack, the descriptor is at its other end
+	size_t stk_size;
+	size_t stk_guard;
+	struct uthread_data *joiner; //thread waiting to join with this one
+	int dead; //exited, waiting to be joined
+	int ev; //return value
+	struct sched_entity se; //its link is also used for blockedQ, deadQ and wait queues
+	struct wait_queue *waiting; //wait queue to unlock once blocked, M:N mode
+	struct timer timer; //in the timer wheel while sleeping
+};
+
+/*
+ * worker_start - Start running threads on workers
+ * @workers: Number of workers, the calling kernel thread included. 0 for one
+ *	per online processor.
+ * @main_thd: Calling thread, the main thread
+ *
+ * Return: 0 in case of success, -1 in case of failure (e.g., memory
+ * allocation, kernel thread creation)
+ */
+int worker_start(int workers, struct uthread_data *main_thd);
+
+/*
+ * worker_stop - Stop the workers
+ *
+ * Called by the main thread, once every other thread is gone.
+ */
+void worker_stop(void);
+
+/*
+ * worker_current - Thread running on the calling worker
+ */
+struct uthread_data *worker_current(void);
+
+/*
+ * worker_ready - Make a thread ready to run
+ * @thd: Thread, not running
+ *
+ * The thread is queued on the calling worker, from which others may steal it.
+ */
+void worker_ready(struct uthread_data *thd);
+
+/*
+ * worker_switch - Switch from the running thread to its worker's scheduler
+ * @after: Called by the scheduler with the thread, once off its stack
+ *
+ * Return: When the thread is resumed, possibly on another worker.
+ */
+void worker_switch(void (*after)(struct uthread_data *thd));
+
+/*
+ * worker_notify - Tell the idle workers that the next sleeper is due earlier
+ */
+void worker_notify(void);
+
 #endif /* _UTHREAD_PRIVATE_H */
@@ -1,3 +1,5 @@
+#include <limits.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,12 +11,100 @@ struct node {
 	struct node* next;
 };
 
+/*
+ * Concurrent queue: a bounded ring of cells, after Dmitry Vyukov's MPMC queue.
+ * The sequence number of a cell tells whose turn it is: the producer of
+ * position pos when it is pos, the consumer of pos when it is pos + 1. A
+ * producer or consumer claims its position by moving the corresponding index
+ * with a CAS, then hands the cell over by setting the sequence number, so
+ * that neither ever waits for another one.
+ */
+#define CACHE_LINE 64
+
+struct cell {
+	atomic_size_t seq;
+	void *data;
+};
+
+struct ring {
+	size_t mask; //capacity - 1
+	//each index on its own cache line, apart from the cells
+	_Alignas(CACHE_LINE) atomic_size_t enqueue_pos;
+	_Alignas(CACHE_LINE) atomic_size_t dequeue_pos;
+	_Alignas(CACHE_LINE) struct cell cells[];
+};
+
 struct queue {
 	int length;
 	struct node *front;
 	struct node *rear;
+	struct ring *ring; //concurrent queue, NULL for a linked one
 };
 
+static int ring_enqueue(struct ring *ring, void *data)
+{
+	size_t pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+	struct cell *cell;
+
+	for (;;) {
+		cell = &ring->cells[pos & ring->mask];
+		size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&ring->enqueue_pos,
+			    &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return -1; //full
+		} else {
+			pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+		}
+	}
+	cell->data = data;
+	atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+
+	return 0;
+}
+
+static int ring_dequeue(struct ring *ring, void **data)
+{
+	size_t pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+	struct cell *cell;
+
+	for (;;) {
+		cell = &ring->cells[pos & ring->mask];
+		size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&ring->dequeue_pos,
+			    &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return -1; //empty
+		} else {
+			pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+		}
+	}
+	*data = cell->data;
+	atomic_store_explicit(&cell->seq, pos + ring->mask + 1, memory_order_release);
+
+	return 0;
+}
+
+static int ring_length(struct ring *ring)
+{
+	size_t deq = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+	size_t enq = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+	intptr_t len = (intptr_t)(enq - deq);
+
+	//both indices move meanwhile, keep to what the ring can hold
+	if (len < 0) return 0;
+	if ((size_t)len > ring->mask + 1) return ring->mask + 1;
+	return len;
+}
+
 queue_t queue_create(void)
 {
 	//init queue
@@ -23,12 +113,46 @@ queue_t queue_create(void)
 	newq->front = NULL;
 	newq->rear = NULL;
 	newq->length = 0;
+	newq->ring = NULL;
+	return newq;
+}
+
+queue_t queue_create_concurrent(size_t capacity)
+{
+	size_t size = 2;
+
+	if (capacity > (size_t)INT_MAX) return NULL;
+	while (size < capacity) size *= 2;
+
+	queue_t newq = (queue_t) malloc(sizeof(struct queue));
+	struct ring *ring = aligned_alloc(CACHE_LINE,
+		(sizeof(struct ring) + size * sizeof(struct cell) + CACHE_LINE - 1)
+		/ CACHE_LINE * CACHE_LINE);
+	if (!newq || !ring) {
+		free(newq);
+		free(ring);
+		return NULL;
+	}
+	for (size_t i = 0; i < size; i++)
+		atomic_init(&ring->cells[i].seq, i);
+	atomic_init(&ring->enqueue_pos, 0);
+	atomic_init(&ring->dequeue_pos, 0);
+	ring->mask = size - 1;
+	newq->front = NULL;
+	newq->rear = NULL;
+	newq->length = 0;
+	newq->ring = ring;
 	return newq;
 }
 
 int queue_destroy(queue_t queue)
 {
-	if (queue && !queue->front) {
+	if (queue && queue->ring && ring_length(queue->ring) == 0) {
+		free(queue->ring);
+		free(queue);
+		return 0;
+	}
+	if (queue && !queue->ring && !queue->front) {
 		free(queue);
 		return 0;
 	}
@@ -38,6 +162,7 @@ int queue_destroy(queue_t queue)
 int queue_enqueue(queue_t queue, void *data)
 {
 	if (!queue || !data) return -1;
+	if (queue->ring) return ring_enqueue(queue->ring, data);
 
 	struct node *nn = (struct node*) malloc(sizeof(struct node));
 	if (!nn) return -1;
@@ -57,7 +182,9 @@ int queue_enqueue(queue_t queue, void *data)
 
 int queue_dequeue(queue_t queue, void **data)
 {
-	if (!data || !queue || !queue->front) return -1;
+	if (!data || !queue) return -1;
+	if (queue->ring) return ring_dequeue(queue->ring, data);
+	if (!queue->front) return -1;
 
 	void* d = NULL;
 	if (queue->front) {
@@ -78,7 +205,7 @@ int queue_dequeue(queue_t queue, void **data)
 
 int queue_delete(queue_t queue, void *data)
 {
-	if (!queue || !data) return -1;
+	if (!queue || !data || queue->ring) return -1;
 	//node* variables used for iteration
 	struct node dummy = {NULL, queue->front};
 	struct node *prev = &dummy;
@@ -109,7 +236,7 @@ int queue_delete(queue_t queue, void *data)
 
 int queue_iterate(queue_t queue, queue_func_t func, void *arg, void **data)
 {
-	if (!queue || !func) return -1;
+	if (!queue || !func || queue->ring) return -1;
 
 	struct node *curr = queue->front;
 	struct node *next = NULL;
@@ -129,6 +256,7 @@ int queue_iterate(queue_t queue, queue_func_t func, void *arg, void **data)
 int queue_length(queue_t queue)
 {
 	if (!queue) return -1;
+	if (queue->ring) return ring_length(queue->ring);
 	return queue->length;
 }
 
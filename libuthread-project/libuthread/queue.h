@@ -1,6 +1,8 @@
 #ifndef _QUEUE_H
 #define _QUEUE_H
 
+#include <stddef.h>
+
 /*
  * queue_t - Queue type
  *
@@ -22,6 +24,25 @@ typedef struct queue* queue_t;
  */
 queue_t queue_create(void);
 
+/*
+ * queue_create_concurrent - Allocate an empty concurrent queue
+ * @capacity: Number of items the queue can hold, rounded up to a power of 2
+ *
+ * Create a queue that any number of kernel threads can enqueue in and dequeue
+ * from at the same time without locking. Its items are kept in a ring
+ * allocated once and for all: enqueueing never allocates memory, but fails
+ * when the queue is full.
+ *
+ * The queue follows the contract of queue_enqueue(), queue_dequeue(),
+ * queue_length() and queue_destroy(), with the length being a snapshot while
+ * other threads are using the queue. queue_delete() and queue_iterate() are
+ * not supported and return -1.
+ *
+ * Return: Pointer to new empty queue. NULL in case of failure when allocating
+ * the new queue, or if @capacity is larger than INT_MAX.
+ */
+queue_t queue_create_concurrent(size_t capacity);
+
 /*
  * queue_destroy - Deallocate a queue
  * @queue: Queue to deallocate
@@ -40,8 +61,9 @@ int queue_destroy(queue_t queue);
  *
  * Enqueue the address contained in @data in the queue @queue.
  *
- * Return: -1 if @queue or @data are NULL, or in case of memory allocation error
- * when enqueing. 0 if @data was successfully enqueued in @queue.
+ * Return: -1 if @queue or @data are NULL, in case of memory allocation error
+ * when enqueing, or if @queue is a full concurrent queue. 0 if @data was
+ * successfully enqueued in @queue.
  */
 int queue_enqueue(queue_t queue, void *data);
 
@@ -113,4 +135,114 @@ int queue_iterate(queue_t queue, queue_func_t func, void *arg, void **data);
  */
 int queue_length(queue_t queue);
 
+/*
+ * Intrusive queue
+ *
+ * A variant of the queue for items that embed their own link, which makes it
+ * allocation-free: an item can be in a single intrusive queue at a time, through
+ * a given link. Deleting an item does not need to search for it, so every
+ * operation is O(1). The queue is a circular doubly-linked list through a
+ * sentinel link.
+ */
+
+/*
+ * struct queue_link - Link embedded in an intrusive queue item
+ */
+struct queue_link {
+	struct queue_link *prev;
+	struct queue_link *next;
+};
+
+/*
+ * struct iqueue - Intrusive queue
+ */
+struct iqueue {
+	struct queue_link head;
+	int length;
+};
+
+/*
+ * iqueue_entry - Item of a link
+ * @link: Address of the link
+ * @type: Type of the item
+ * @member: Name of the link in @type
+ */
+#define iqueue_entry(link, type, member) \
+	((type *)((char *)(link) - offsetof(type, member)))
+
+/*
+ * iqueue_init - Initialize an empty intrusive queue
+ * @queue: Queue to initialize
+ */
+static inline void iqueue_init(struct iqueue *queue)
+{
+	queue->head.prev = queue->head.next = &queue->head;
+	queue->length = 0;
+}
+
+/*
+ * iqueue_enqueue - Enqueue an item
+ * @queue: Queue in which to enqueue the item
+ * @link: Link of the item, not in any queue
+ */
+static inline void iqueue_enqueue(struct iqueue *queue, struct queue_link *link)
+{
+	link->prev = queue->head.prev;
+	link->next = &queue->head;
+	queue->head.prev->next = link;
+	queue->head.prev = link;
+	queue->length++;
+}
+
+/*
+ * iqueue_delete - Delete an item
+ * @queue: Queue the item is in
+ * @link: Link of the item
+ */
+static inline void iqueue_delete(struct iqueue *queue, struct queue_link *link)
+{
+	link->prev->next = link->next;
+	link->next->prev = link->prev;
+	link->prev = link->next = NULL;
+	queue->length--;
+}
+
+/*
+ * iqueue_dequeue - Dequeue the oldest item
+ * @queue: Queue in which to dequeue the item
+ *
+ * Return: Link of the oldest item, or NULL if @queue is empty.
+ */
+static inline struct queue_link *iqueue_dequeue(struct iqueue *queue)
+{
+	struct queue_link *link = queue->head.next;
+
+	if (link == &queue->head)
+		return NULL;
+	iqueue_delete(queue, link);
+	return link;
+}
+
+/*
+ * iqueue_length - Intrusive queue length
+ * @queue: Queue to get the length of
+ *
+ * Return: Length of @queue.
+ */
+static inline int iqueue_length(struct iqueue *queue)
+{
+	return queue->length;
+}
+
+/*
+ * iqueue_for_each - Iterate through an intrusive queue
+ * @link: Link cursor
+ * @queue: Queue to iterate through, from the oldest item to the newest
+ *
+ * The item at the cursor must not be deleted during the iteration.
+ */
+#define iqueue_for_each(link, queue) \
+	for ((link) = (queue)->head.next; (link) != &(queue)->head; \
+	     (link) = (link)->next)
+
 #endif /* _QUEUE_H */
@@ -0,0 +1,192 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "private.h"
+#include "queue.h"
+#include "uthread.h"
+
+/*
+ * Scheduling policies
+ *
+ * All of them keep ready threads in intrusive queues, so that making a thread
+ * ready or picking the next one never allocates.
+ */
+
+#define se_of(l) iqueue_entry(l, struct sched_entity, link)
+
+/*
+ * FIFO: a single queue, threads run in the order they became ready
+ */
+static struct iqueue fifo_q;
+
+static void fifo_init(void)
+{
+	iqueue_init(&fifo_q);
+}
+
+static void static_setup(struct sched_entity *se)
+{
+	se->level = se->prio;
+}
+
+static void fifo_enqueue(struct sched_entity *se)
+{
+	iqueue_enqueue(&fifo_q, &se->link);
+	se->queued = 1;
+}
+
+static struct sched_entity *fifo_pick_next(void)
+{
+	struct queue_link *l = iqueue_dequeue(&fifo_q);
+
+	if (!l)
+		return NULL;
+	se_of(l)->queued = 0;
+	return se_of(l);
+}
+
+static void fifo_remove(struct sched_entity *se)
+{
+	iqueue_delete(&fifo_q, &se->link);
+	se->queued = 0;
+}
+
+static void static_tick(struct sched_entity *se)
+{
+	(void)se;
+}
+
+/*
+ * Priority levels: one queue per level, and a bitmap of the non-empty ones so
+ * that the highest ready level is found with a single instruction. Threads are
+ * queued at their effective priority, @level.
+ */
+#define LEVELS (UTHREAD_PRIO_MAX + 1)
+
+static struct iqueue levels[LEVELS];
+static uint32_t ready_map; //bit n set if levels[n] is not empty
+
+static void prio_init(void)
+{
+	for (int i = 0; i < LEVELS; i++)
+		iqueue_init(&levels[i]);
+	ready_map = 0;
+}
+
+static void prio_enqueue(struct sched_entity *se)
+{
+	iqueue_enqueue(&levels[se->level], &se->link);
+	ready_map |= (uint32_t)1 << se->level;
+	se->queued = 1;
+}
+
+static void prio_remove(struct sched_entity *se)
+{
+	iqueue_delete(&levels[se->level], &se->link);
+	if (!iqueue_length(&levels[se->level]))
+		ready_map &= ~((uint32_t)1 << se->level);
+	se->queued = 0;
+}
+
+static struct sched_entity *prio_pick_next(void)
+{
+	if (!ready_map)
+		return NULL;
+
+	int level = 31 - __builtin_clz(ready_map);
+	struct sched_entity *se = se_of(levels[level].head.next);
+
+	prio_remove(se);
+	return se;
+}
+
+/*
+ * MLFQ: priority levels where a thread loses a level each time it is charged a
+ * tick. Every MLFQ_BOOST ticks, the epoch changes and every thread goes back
+ * to its priority: those that are ready at once, the others the next time
+ * they are enqueued.
+ */
+#define MLFQ_BOOST 100
+
+static unsigned int mlfq_epoch;
+static unsigned int mlfq_ticks;
+
+static void mlfq_init(void)
+{
+	prio_init();
+	mlfq_epoch = 0;
+	mlfq_ticks = 0;
+}
+
+static void mlfq_setup(struct sched_entity *se)
+{
+	se->level = se->prio;
+	se->epoch = mlfq_epoch;
+}
+
+static void mlfq_enqueue(struct sched_entity *se)
+{
+	if (se->epoch != mlfq_epoch)
+		mlfq_setup(se);
+	prio_enqueue(se);
+}
+
+static void mlfq_boost(void)
+{
+	struct iqueue all;
+	struct queue_link *l;
+
+	mlfq_epoch++;
+	iqueue_init(&all);
+	for (int i = LEVELS - 1; i >= 0; i--)
+		while ((l = iqueue_dequeue(&levels[i])))
+			iqueue_enqueue(&all, l);
+	ready_map = 0;
+	while ((l = iqueue_dequeue(&all)))
+		mlfq_enqueue(se_of(l));
+}
+
+static void mlfq_tick(struct sched_entity *se)
+{
+	if (se->epoch != mlfq_epoch)
+		mlfq_setup(se);
+	if (se->level > UTHREAD_PRIO_MIN)
+		se->level--;
+	if (++mlfq_ticks % MLFQ_BOOST == 0)
+		mlfq_boost();
+}
+
+static const struct sched_policy policies[] = {
+	[UTHREAD_SCHED_FIFO] = {
+		.init = fifo_init,
+		.setup = static_setup,
+		.enqueue = fifo_enqueue,
+		.pick_next = fifo_pick_next,
+		.remove = fifo_remove,
+		.tick = static_tick,
+	},
+	[UTHREAD_SCHED_PRIO] = {
+		.init = prio_init,
+		.setup = static_setup,
+		.enqueue = prio_enqueue,
+		.pick_next = prio_pick_next,
+		.remove = prio_remove,
+		.tick = static_tick,
+	},
+	[UTHREAD_SCHED_MLFQ] = {
+		.init = mlfq_init,
+		.setup = mlfq_setup,
+		.enqueue = mlfq_enqueue,
+		.pick_next = prio_pick_next,
+		.remove = prio_remove,
+		.tick = mlfq_tick,
+	},
+};
+
+const struct sched_policy *sched_policy_get(enum uthread_sched policy)
+{
+	if ((unsigned int)policy >= sizeof(policies) / sizeof(policies[0]))
+		return NULL;
+
+	return &policies[policy];
+}
@@ -0,0 +1,250 @@
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "private.h"
+#include "sync.h"
+#include "uthread.h"
+
+/*
+ * Every operation disables preemption first, then locks the wait queues it
+ * needs (which only matters in M:N mode). A thread that blocks leaves both to
+ * wait_sleep(), which releases them once it is off its stack.
+ */
+
+struct uthread_mutex {
+	struct wait_queue wq;
+	int locked;
+	uthread_t owner;
+};
+
+struct uthread_cond {
+	struct wait_queue wq;
+};
+
+struct uthread_sem {
+	struct wait_queue wq;
+	size_t count;
+};
+
+uthread_mutex_t uthread_mutex_create(void)
+{
+	uthread_mutex_t mutex = malloc(sizeof(*mutex));
+
+	if (!mutex)
+		return NULL;
+	wait_init(&mutex->wq);
+	mutex->locked = 0;
+	return mutex;
+}
+
+int uthread_mutex_destroy(uthread_mutex_t mutex)
+{
+	if (!mutex || mutex->locked)
+		return -1;
+
+	free(mutex);
+	return 0;
+}
+
+int uthread_mutex_lock(uthread_mutex_t mutex)
+{
+	if (!mutex)
+		return -1;
+
+	uthread_t self = uthread_self();
+
+	preempt_disable();
+	wait_lock(&mutex->wq);
+	if (!mutex->locked) {
+		mutex->locked = 1;
+		mutex->owner = self;
+	} else if (mutex->owner == self) {
+		wait_unlock(&mutex->wq);
+		preempt_enable();
+		return -1;
+	} else {
+		/* Owned once woken, see unlock() */
+		wait_sleep(&mutex->wq);
+		return 0;
+	}
+	wait_unlock(&mutex->wq);
+	preempt_enable();
+
+	return 0;
+}
+
+int uthread_mutex_trylock(uthread_mutex_t mutex)
+{
+	int ret = -1;
+
+	if (!mutex)
+		return -1;
+
+	uthread_t self = uthread_self();
+
+	preempt_disable();
+	wait_lock(&mutex->wq);
+	if (!mutex->locked) {
+		mutex->locked = 1;
+		mutex->owner = self;
+		ret = 0;
+	}
+	wait_unlock(&mutex->wq);
+	preempt_enable();
+
+	return ret;
+}
+
+/* Hand @mutex over to its oldest waiter, or unlock it. @mutex->wq is locked */
+static void unlock(uthread_mutex_t mutex)
+{
+	int next = wait_wake(&mutex->wq);
+
+	if (next >= 0)
+		mutex->owner = next;
+	else
+		mutex->locked = 0;
+}
+
+int uthread_mutex_unlock(uthread_mutex_t mutex)
+{
+	int ret = -1;
+
+	if (!mutex)
+		return -1;
+
+	uthread_t self = uthread_self();
+
+	preempt_disable();
+	wait_lock(&mutex->wq);
+	if (mutex->locked && mutex->owner == self) {
+		unlock(mutex);
+		ret = 0;
+	}
+	wait_unlock(&mutex->wq);
+	preempt_enable();
+
+	return ret;
+}
+
+uthread_cond_t uthread_cond_create(void)
+{
+	uthread_cond_t cond = malloc(sizeof(*cond));
+
+	if (!cond)
+		return NULL;
+	wait_init(&cond->wq);
+	return cond;
+}
+
+int uthread_cond_destroy(uthread_cond_t cond)
+{
+	if (!cond || iqueue_length(&cond->wq.waiters))
+		return -1;
+
+	free(cond);
+	return 0;
+}
+
+int uthread_cond_wait(uthread_cond_t cond, uthread_mutex_t mutex)
+{
+	if (!cond || !mutex)
+		return -1;
+
+	uthread_t self = uthread_self();
+
+	preempt_disable();
+	wait_lock(&cond->wq);
+	wait_lock(&mutex->wq);
+	if (!mutex->locked || mutex->owner != self) {
+		wait_unlock(&mutex->wq);
+		wait_unlock(&cond->wq);
+		preempt_enable();
+		return -1;
+	}
+	unlock(mutex);
+	wait_unlock(&mutex->wq);
+	/* Signals need @cond->wq, which stays locked until the thread sleeps */
+	wait_sleep(&cond->wq);
+
+	return uthread_mutex_lock(mutex);
+}
+
+static int wake(uthread_cond_t cond, int all)
+{
+	if (!cond)
+		return -1;
+
+	preempt_disable();
+	wait_lock(&cond->wq);
+	while (wait_wake(&cond->wq) >= 0 && all)
+		;
+	wait_unlock(&cond->wq);
+	preempt_enable();
+
+	return 0;
+}
+
+int uthread_cond_signal(uthread_cond_t cond)
+{
+	return wake(cond, 0);
+}
+
+int uthread_cond_broadcast(uthread_cond_t cond)
+{
+	return wake(cond, 1);
+}
+
+uthread_sem_t uthread_sem_create(size_t count)
+{
+	uthread_sem_t sem = malloc(sizeof(*sem));
+
+	if (!sem)
+		return NULL;
+	wait_init(&sem->wq);
+	sem->count = count;
+	return sem;
+}
+
+int uthread_sem_destroy(uthread_sem_t sem)
+{
+	if (!sem || iqueue_length(&sem->wq.waiters))
+		return -1;
+
+	free(sem);
+	return 0;
+}
+
+int uthread_sem_down(uthread_sem_t sem)
+{
+	if (!sem)
+		return -1;
+
+	preempt_disable();
+	wait_lock(&sem->wq);
+	if (!sem->count) {
+		/* The unit is handed over by up() */
+		wait_sleep(&sem->wq);
+		return 0;
+	}
+	sem->count--;
+	wait_unlock(&sem->wq);
+	preempt_enable();
+
+	return 0;
+}
+
+int uthread_sem_up(uthread_sem_t sem)
+{
+	if (!sem)
+		return -1;
+
+	preempt_disable();
+	wait_lock(&sem->wq);
+	if (wait_wake(&sem->wq) < 0)
+		sem->count++;
+	wait_unlock(&sem->wq);
+	preempt_enable();
+
+	return 0;
+}
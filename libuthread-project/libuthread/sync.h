@@ -0,0 +1,175 @@
+#ifndef _SYNC_H
+#define _SYNC_H
+
+#include <stddef.h>
+
+/*
+ * Synchronization primitives
+ *
+ * A thread that has to wait is blocked on the primitive itself, off the ready
+ * queues, until another thread wakes it: it takes no processor time
+ * meanwhile. Waiters are woken in the order they started waiting, and are
+ * handed what they waited for directly: a mutex being unlocked becomes owned
+ * by its oldest waiter, and a semaphore being upped gives its unit to its
+ * oldest waiter, before any other thread can take them.
+ *
+ * The primitives are safe against preemption, and against threads running on
+ * other kernel threads in M:N mode.
+ */
+
+/*
+ * uthread_mutex_t - Mutex type
+ *
+ * A mutex is owned by at most one thread at a time, the one that locked it,
+ * and only that thread can unlock it. It cannot be locked again by its owner.
+ */
+typedef struct uthread_mutex *uthread_mutex_t;
+
+/*
+ * uthread_mutex_create - Allocate an unlocked mutex
+ *
+ * Return: Pointer to the new mutex. NULL in case of failure when allocating
+ * the new mutex.
+ */
+uthread_mutex_t uthread_mutex_create(void);
+
+/*
+ * uthread_mutex_destroy - Deallocate a mutex
+ * @mutex: Mutex to deallocate
+ *
+ * Return: -1 if @mutex is NULL or locked. 0 if @mutex was successfully
+ * destroyed.
+ */
+int uthread_mutex_destroy(uthread_mutex_t mutex);
+
+/*
+ * uthread_mutex_lock - Lock a mutex
+ * @mutex: Mutex to lock
+ *
+ * Block the calling thread until it owns @mutex.
+ *
+ * Return: -1 if @mutex is NULL or already owned by the calling thread. 0 once
+ * @mutex is owned by the calling thread.
+ */
+int uthread_mutex_lock(uthread_mutex_t mutex);
+
+/*
+ * uthread_mutex_trylock - Lock a mutex if it is unlocked
+ * @mutex: Mutex to lock
+ *
+ * Return: -1 if @mutex is NULL or locked. 0 if @mutex is now owned by the
+ * calling thread.
+ */
+int uthread_mutex_trylock(uthread_mutex_t mutex);
+
+/*
+ * uthread_mutex_unlock - Unlock a mutex
+ * @mutex: Mutex to unlock
+ *
+ * If threads are waiting for @mutex, the oldest one becomes its owner and is
+ * made ready.
+ *
+ * Return: -1 if @mutex is NULL or not owned by the calling thread. 0 otherwise.
+ */
+int uthread_mutex_unlock(uthread_mutex_t mutex);
+
+/*
+ * uthread_cond_t - Condition variable type
+ */
+typedef struct uthread_cond *uthread_cond_t;
+
+/*
+ * uthread_cond_create - Allocate a condition variable
+ *
+ * Return: Pointer to the new condition variable. NULL in case of failure when
+ * allocating the new condition variable.
+ */
+uthread_cond_t uthread_cond_create(void);
+
+/*
+ * uthread_cond_destroy - Deallocate a condition variable
+ * @cond: Condition variable to deallocate
+ *
+ * Return: -1 if @cond is NULL or if threads are waiting on it. 0 if @cond was
+ * successfully destroyed.
+ */
+int uthread_cond_destroy(uthread_cond_t cond);
+
+/*
+ * uthread_cond_wait - Wait on a condition variable
+ * @cond: Condition variable to wait on
+ * @mutex: Mutex owned by the calling thread
+ *
+ * Unlock @mutex and block the calling thread on @cond, as one step: a signal
+ * sent after @mutex is unlocked wakes the thread. Once woken, the thread locks
+ * @mutex again before returning. As with other condition variables, the
+ * condition waited for must be checked again after waking.
+ *
+ * Return: -1 if @cond or @mutex is NULL, or if @mutex is not owned by the
+ * calling thread. 0 once woken, owning @mutex.
+ */
+int uthread_cond_wait(uthread_cond_t cond, uthread_mutex_t mutex);
+
+/*
+ * uthread_cond_signal - Wake a thread waiting on a condition variable
+ * @cond: Condition variable
+ *
+ * Make the oldest thread waiting on @cond ready, if any.
+ *
+ * Return: -1 if @cond is NULL. 0 otherwise.
+ */
+int uthread_cond_signal(uthread_cond_t cond);
+
+/*
+ * uthread_cond_broadcast - Wake every thread waiting on a condition variable
+ * @cond: Condition variable
+ *
+ * Return: -1 if @cond is NULL. 0 otherwise.
+ */
+int uthread_cond_broadcast(uthread_cond_t cond);
+
+/*
+ * uthread_sem_t - Semaphore type
+ */
+typedef struct uthread_sem *uthread_sem_t;
+
+/*
+ * uthread_sem_create - Allocate a semaphore
+ * @count: Initial count of the semaphore
+ *
+ * Return: Pointer to the new semaphore. NULL in case of failure when
+ * allocating the new semaphore.
+ */
+uthread_sem_t uthread_sem_create(size_t count);
+
+/*
+ * uthread_sem_destroy - Deallocate a semaphore
+ * @sem: Semaphore to deallocate
+ *
+ * Return: -1 if @sem is NULL or if threads are waiting on it. 0 if @sem was
+ * successfully destroyed.
+ */
+int uthread_sem_destroy(uthread_sem_t sem);
+
+/*
+ * uthread_sem_down - Take a unit from a semaphore
+ * @sem: Semaphore to take from
+ *
+ * Block the calling thread until a unit is available.
+ *
+ * Return: -1 if @sem is NULL. 0 once a unit was taken.
+ */
+int uthread_sem_down(uthread_sem_t sem);
+
+/*
+ * uthread_sem_up - Give a unit back to a semaphore
+ * @sem: Semaphore to give to
+ *
+ * If threads are waiting on @sem, the unit goes to the oldest one, which is
+ * made ready.
+ *
+ * Return: -1 if @sem is NULL. 0 otherwise.
+ */
+int uthread_sem_up(uthread_sem_t sem);
+
+#endif /* _SYNC_H */
@@ -0,0 +1,157 @@
+#include <stdint.h>
+#include <time.h>
+
+#include "private.h"
+#include "queue.h"
+
+/*
+ * Timer wheel
+ *
+ * Level 0 has a slot per tick, and each slot of level n spans all the slots of
+ * level n - 1. A timer goes to the lowest level that spans its expiry from the
+ * current tick, in the slot of its expiry at that level. Each time the wheel
+ * reaches the start of a slot of level n > 0, the timers of the slot move
+ * down (they cascade) according to their remaining time, until they expire
+ * from a slot of level 0. Timers too far away for the top level are kept in
+ * its last slot and cascade again from there.
+ *
+ * Adding a timer takes constant time, and so does expiring it, save for its
+ * few cascades. A bitmap per level tells which slots are occupied, so that the
+ * wheel jumps straight to the next slot to process instead of ticking through
+ * empty ones, and can tell when that is.
+ */
+
+#define LEVEL_SHIFT(level) ((level) * TIMER_LEVEL_BITS)
+#define SLOT_MASK (TIMER_SLOTS - 1)
+#define SPAN ((uint64_t)1 << LEVEL_SHIFT(TIMER_LEVELS))
+
+uint64_t timer_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now)
+{
+	wheel->clock = now >> TIMER_SHIFT;
+	wheel->count = 0;
+	for (int level = 0; level < TIMER_LEVELS; level++) {
+		wheel->occupied[level] = 0;
+		for (int slot = 0; slot < TIMER_SLOTS; slot++)
+			iqueue_init(&wheel->slots[level][slot]);
+	}
+}
+
+/* Put @timer in its slot, for its expiry from the current tick */
+static void place(struct timer_wheel *wheel, struct timer *timer)
+{
+	uint64_t delta = timer->expires - wheel->clock;
+	uint64_t at = timer->expires;
+	int level = 0;
+
+	if (delta >= SPAN) {
+		delta = SPAN - 1;
+		at = wheel->clock + delta;
+	}
+	while (delta >> LEVEL_SHIFT(level + 1))
+		level++;
+
+	unsigned int slot = (at >> LEVEL_SHIFT(level)) & SLOT_MASK;
+
+	iqueue_enqueue(&wheel->slots[level][slot], &timer->link);
+	wheel->occupied[level] |= (uint64_t)1 << slot;
+}
+
+void timer_add(struct timer_wheel *wheel, struct timer *timer,
+	       uint64_t deadline)
+{
+	/* Rounded up, never to expire early */
+	timer->expires = (deadline >> TIMER_SHIFT)
+		+ !!(deadline & (((uint64_t)1 << TIMER_SHIFT) - 1));
+	if (timer->expires <= wheel->clock)
+		timer->expires = wheel->clock + 1;
+	place(wheel, timer);
+	wheel->count++;
+}
+
+/* Tick at which the next occupied slot is processed. The wheel is not empty */
+static uint64_t next_tick(const struct timer_wheel *wheel)
+{
+	uint64_t next = UINT64_MAX;
+
+	for (int level = 0; level < TIMER_LEVELS; level++) {
+		uint64_t occupied = wheel->occupied[level];
+
+		if (!occupied)
+			continue;
+
+		int shift = LEVEL_SHIFT(level);
+		unsigned int current = (wheel->clock >> shift) & SLOT_MASK;
+		uint64_t later = current == SLOT_MASK ? 0
+			: occupied & ~(uint64_t)0 << (current + 1);
+		/* Slots up to the current one come round again after a turn */
+		unsigned int slot = __builtin_ctzll(later ? later : occupied);
+		uint64_t tick = (wheel->clock >> (shift + TIMER_LEVEL_BITS)
+				 << (shift + TIMER_LEVEL_BITS))
+			+ ((uint64_t)slot << shift);
+
+		if (!later)
+			tick += (uint64_t)TIMER_SLOTS << shift;
+		if (tick < next)
+			next = tick;
+	}
+
+	return next;
+}
+
+uint64_t timer_next(const struct timer_wheel *wheel)
+{
+	return wheel->count ? next_tick(wheel) << TIMER_SHIFT : UINT64_MAX;
+}
+
+/* Process the slots that start at the current tick, highest level first */
+static void process(struct timer_wheel *wheel, struct iqueue *expired)
+{
+	struct queue_link *l;
+
+	for (int level = TIMER_LEVELS - 1; level >= 0; level--) {
+		int shift = LEVEL_SHIFT(level);
+		unsigned int slot = (wheel->clock >> shift) & SLOT_MASK;
+		struct iqueue *q = &wheel->slots[level][slot];
+
+		if (wheel->clock & (((uint64_t)1 << shift) - 1)
+		    || !(wheel->occupied[level] & (uint64_t)1 << slot))
+			continue;
+
+		wheel->occupied[level] &= ~((uint64_t)1 << slot);
+		while ((l = iqueue_dequeue(q))) {
+			struct timer *timer = iqueue_entry(l, struct timer, link);
+
+			if (level && timer->expires > wheel->clock) {
+				place(wheel, timer);
+			} else {
+				iqueue_enqueue(expired, l);
+				wheel->count--;
+			}
+		}
+	}
+}
+
+void timer_expire(struct timer_wheel *wheel, uint64_t now,
+		  struct iqueue *expired)
+{
+	uint64_t tick = now >> TIMER_SHIFT;
+
+	while (wheel->count) {
+		uint64_t next = next_tick(wheel);
+
+		if (next > tick)
+			break;
+		wheel->clock = next;
+		process(wheel, expired);
+	}
+	if (tick > wheel->clock)
+		wheel->clock = tick;
+}
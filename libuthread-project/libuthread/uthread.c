@@ -1,66 +1,230 @@
 #include <assert.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "private.h"
 #include "uthread.h"
 #include "queue.h"
 
-struct uthread_data {
-	uthread_t tid;
-	uthread_ctx_t *context;
-	void *stk_ptr; //pointer to top of stack
-	int thd_joined; //thread to join with
-	int ev; //return value
+/*
+ * Thread table. A TID is the index of its thread's slot in the low
+ * TID_SLOT_BITS bits, and the generation of the slot in the other ones. The
+ * generation changes each time a slot is freed, so that the TID of a joined
+ * thread stops matching once its slot is reused. Slot 0 is the main thread's.
+ */
+#define TID_SLOT_BITS 20
+#define TID_SLOTS (1u << TID_SLOT_BITS)
+#define TID_GEN_MASK ((uthread_t)INT_MAX >> TID_SLOT_BITS)
+#define TABLE_MIN 64
+
+struct thd_slot {
+	struct uthread_data *thd; //NULL if free
+	uthread_t gen;
+	unsigned int next_free;
 };
 
+static struct thd_slot *table;
+static unsigned int table_size; //slots allocated
+static unsigned int table_used; //slots ever handed out
+//free slots, oldest first so a slot is reused as late as possible. 0 if none
+static unsigned int free_head, free_tail;
+
 static int num_threads = 0;
 static int preempt_required;
-static struct uthread_data *running; //currently running thread
-static queue_t readyQ; //ready threads
-static queue_t blockedQ; //blocked threads
-static queue_t deadQ; //zombie threads
+static const struct sched_policy *sched;
+static int num_ready; //threads in the ready queues of sched
+static struct uthread_data *running; //currently running thread, main in M:N mode
+static int mn; //threads run on workers, see worker.c
+static pthread_mutex_t thd_lock = PTHREAD_MUTEX_INITIALIZER; //in M:N mode
+//threads are linked into these through their own link, so moving a thread
+//between them never allocates. ready threads are queued by sched
+static struct iqueue blockedQ; //blocked threads
+static struct iqueue deadQ; //zombie threads
+//sleeping threads, linked through their timer. the counts are also read without the lock
+static struct timer_wheel wheel;
+static atomic_int num_sleepers;
+static _Atomic uint64_t next_wakeup; //timer_next(&wheel)
+
+#define thd_of(s) iqueue_entry(s, struct uthread_data, se)
 
-//search method to be iterated. used to find data pointer with given tid
-static int find_thd_data(queue_t q, void *data, void *arg)
+//give thd a slot of the table and the tid that goes with it
+static int slot_alloc(struct uthread_data *thd)
 {
-	struct uthread_data *tdata = (struct uthread_data*) data;
-	uthread_t tidmatch = *((uthread_t*) arg);
-	(void)q; //unused
+	unsigned int slot;
 
-	if (tdata->tid == tidmatch) return 1;
+	if (free_head) {
+		slot = free_head;
+		free_head = table[slot].next_free;
+		if (!free_head) free_tail = 0;
+	} else {
+		if (table_used == table_size) {
+			if (table_size == TID_SLOTS) return -1;
+			struct thd_slot *t = realloc(table, 2 * table_size * sizeof(*table));
+			if (!t) return -1;
+			table = t;
+			table_size *= 2;
+		}
+		slot = table_used++;
+		table[slot].gen = 0;
+	}
+	table[slot].thd = thd;
+	thd->tid = table[slot].gen << TID_SLOT_BITS | slot;
 
 	return 0;
 }
 
+static void slot_free(uthread_t tid)
+{
+	unsigned int slot = tid & (TID_SLOTS - 1);
+
+	table[slot].thd = NULL;
+	table[slot].gen = (table[slot].gen + 1) & TID_GEN_MASK;
+	table[slot].next_free = 0;
+	if (free_tail) table[free_tail].next_free = slot;
+	else free_head = slot;
+	free_tail = slot;
+}
+
+//find the thread with given tid, NULL if none
+static struct uthread_data *find_thd_data(uthread_t tid)
+{
+	unsigned int slot = tid & (TID_SLOTS - 1);
+
+	if (slot >= table_used || !table[slot].thd || table[slot].thd->tid != tid)
+		return NULL;
+
+	return table[slot].thd;
+}
+
+//protect the thread table and queues, from the timer or from other workers
+static void lock(void)
+{
+	if (mn) pthread_mutex_lock(&thd_lock);
+	else preempt_disable();
+}
+
+static void unlock(void)
+{
+	if (mn) pthread_mutex_unlock(&thd_lock);
+	else preempt_enable();
+}
+
+static struct uthread_data *current(void)
+{
+	return mn ? worker_current() : running;
+}
+
+static void make_ready(struct uthread_data *thd)
+{
+	if (mn) {
+		worker_ready(thd);
+		return;
+	}
+	sched->enqueue(&thd->se);
+	num_ready++;
+}
+
+//remove the next thread to run from the ready queues, NULL if none
+static struct uthread_data *pick_ready(void)
+{
+	struct sched_entity *se = sched->pick_next();
+
+	if (!se) return NULL;
+	num_ready--;
+	return thd_of(se);
+}
+
+//make the threads whose sleep is over ready. the lock is held
+static void wake_sleepers(void)
+{
+	if (!atomic_load(&num_sleepers) || timer_now() < atomic_load(&next_wakeup)) return;
+
+	struct iqueue expired;
+	struct queue_link *l;
+	iqueue_init(&expired);
+	timer_expire(&wheel, timer_now(), &expired);
+	while ((l = iqueue_dequeue(&expired))) {
+		make_ready(iqueue_entry(l, struct uthread_data, timer.link));
+		atomic_fetch_sub(&num_sleepers, 1);
+	}
+	atomic_store(&next_wakeup, timer_next(&wheel));
+}
+
+//block the kernel thread until deadline, with nothing to run meanwhile
+static void idle_until(uint64_t deadline)
+{
+	struct timespec ts = {
+		.tv_sec = deadline / 1000000000,
+		.tv_nsec = deadline % 1000000000,
+	};
+
+	//an interruption only makes the caller check the sleepers early
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+//remove the next thread to run from the ready queues. if none is ready, wait
+//for the next sleeper. keep running if no thread sleeps either
+static struct uthread_data *next_ready(void)
+{
+	struct uthread_data *next;
+
+	wake_sleepers();
+	while (!(next = pick_ready()) && atomic_load(&num_sleepers)) {
+		idle_until(atomic_load(&next_wakeup));
+		wake_sleepers();
+	}
+
+	return next ? next : running;
+}
+
 int uthread_start(int preempt)
 {
+	return uthread_start_sched(preempt, UTHREAD_SCHED_FIFO);
+}
+
+int uthread_start_sched(int preempt, enum uthread_sched policy)
+{
+	sched = sched_policy_get(policy);
+	if (!sched) return -1;
+	sched->init();
+	num_ready = 0;
 	preempt_required = preempt;
+	iqueue_init(&blockedQ);
+	iqueue_init(&deadQ);
+	timer_wheel_init(&wheel, timer_now());
+	atomic_store(&num_sleepers, 0);
+	atomic_store(&next_wakeup, UINT64_MAX);
 	//allocate memory
-	readyQ = queue_create();
-	blockedQ = queue_create();
-	deadQ = queue_create();
 	running = (struct uthread_data*) malloc(sizeof(struct uthread_data));
-	uthread_ctx_t *ctx = (uthread_ctx_t*) malloc(sizeof(uthread_ctx_t));
+	table = (struct thd_slot*) malloc(TABLE_MIN * sizeof(*table));
 	//check for failed malloc
-	if (!(readyQ && blockedQ && deadQ && running && ctx)) {
-		if (readyQ) free(readyQ);
-		if (blockedQ) free(blockedQ);
-		if (deadQ) free(deadQ);
+	if (!(running && table)) {
 		if (running) free(running);
-		if (ctx) free(ctx);
+		if (table) free(table);
 		return -1;
 	}
+	table_size = TABLE_MIN;
+	table_used = 1;
+	free_head = free_tail = 0;
 	//set properties of initial thread
+	table[0].thd = running;
+	table[0].gen = 0;
 	running->tid = 0;
-	running->context = ctx;
 	running->stk_ptr = NULL;
-	running->thd_joined = -1;
+	running->joiner = NULL;
+	running->dead = 0;
+	running->se.queued = 0;
+	running->se.prio = UTHREAD_PRIO_DEFAULT;
+	sched->setup(&running->se);
 	num_threads++;
 
 	if (preempt_required == 1) preempt_start();
@@ -68,137 +232,352 @@ int uthread_start(int preempt)
 	return 0;
 }
 
+int uthread_start_workers(int workers)
+{
+	if (uthread_start_sched(0, UTHREAD_SCHED_FIFO)) return -1;
+	mn = 1;
+	if (worker_start(workers, running)) {
+		mn = 0;
+		uthread_stop();
+		return -1;
+	}
+
+	return 0;
+}
+
+void wait_init(struct wait_queue *wq)
+{
+	atomic_flag_clear(&wq->guard);
+	iqueue_init(&wq->waiters);
+}
+
+void wait_lock(struct wait_queue *wq)
+{
+	if (!mn) return;
+	//held for a few instructions, unless its holder's kernel thread is descheduled
+	for (int spins = 0; atomic_flag_test_and_set_explicit(&wq->guard, memory_order_acquire); spins++)
+		if (spins >= 100) sched_yield();
+}
+
+void wait_unlock(struct wait_queue *wq)
+{
+	if (mn) atomic_flag_clear_explicit(&wq->guard, memory_order_release);
+}
+
+//M:N: thd has left its stack, blocked on a wait queue
+static void waiting(struct uthread_data *thd)
+{
+	wait_unlock(thd->waiting);
+}
+
+void wait_sleep(struct wait_queue *wq)
+{
+	struct uthread_data *self = current();
+
+	iqueue_enqueue(&wq->waiters, &self->se.link);
+	if (mn) {
+		self->waiting = wq;
+		worker_switch(waiting);
+		return;
+	}
+	running = next_ready();
+	uthread_ctx_switch(&self->context, &running->context);
+	preempt_enable();
+}
+
+int wait_wake(struct wait_queue *wq)
+{
+	struct queue_link *l = iqueue_dequeue(&wq->waiters);
+
+	if (!l) return -1;
+	struct uthread_data *thd = iqueue_entry(l, struct uthread_data, se.link);
+	int tid = thd->tid;
+	make_ready(thd);
+
+	return tid;
+}
+
 int uthread_stop(void)
 {
-	if (running && queue_length(readyQ) == 0 && queue_length(blockedQ) == 0 && queue_length(deadQ) == 0) {
+	if (mn) {
+		lock();
+		int alone = current() == running && num_threads == 1;
+		unlock();
+		if (!alone) return -1;
+		//only the main thread is left, no other worker can be busy with threads
+		worker_stop();
+		mn = 0;
+	}
+	//threads blocked on wait queues are in none of the library's queues: count them all
+	if (!mn && running && num_threads == 1) {
 		if (preempt_required) preempt_stop();
-		//free memory
-		queue_destroy(readyQ);
-		queue_destroy(blockedQ);
-		queue_destroy(deadQ);
-		free(running->context);
+		//free memory, stacks included
+		uthread_ctx_release_stacks();
 		free(running);
+		free(table);
 		running = NULL;
+		table = NULL;
 		num_threads = 0;
 		return 0;
 	}
 	return -1;
 }
 
+void uthread_attr_init(struct uthread_attr *attr)
+{
+	attr->stack_size = UTHREAD_STACK_DEFAULT;
+	attr->guard_size = (size_t)sysconf(_SC_PAGESIZE);
+	attr->priority = UTHREAD_PRIO_DEFAULT;
+}
+
 int uthread_create(uthread_func_t func)
 {
-	struct uthread_data *thd = (struct uthread_data*) malloc(sizeof(struct uthread_data));
-	uthread_ctx_t *ctx = (uthread_ctx_t*) malloc(sizeof(uthread_ctx_t));
-	void *stk = uthread_ctx_alloc_stack();
+	return uthread_create_attr(func, NULL);
+}
+
+int uthread_create_attr(uthread_func_t func, const struct uthread_attr *attr)
+{
+	struct uthread_attr def;
+	if (!attr) {
+		uthread_attr_init(&def);
+		attr = &def;
+	}
+	if (attr->stack_size < UTHREAD_STACK_MIN
+	|| attr->priority < UTHREAD_PRIO_MIN || attr->priority > UTHREAD_PRIO_MAX) return -1;
 
-	preempt_disable();
+	//descriptor and stack come together, from the stack pool
+	struct uthread_data *thd = uthread_ctx_alloc_thread(attr->stack_size, attr->guard_size);
+
+	lock();
 	//classify new thread as ready. critical zone where queue is modified
-	if (!(num_threads <= USHRT_MAX && thd && ctx && stk 
-	&& uthread_ctx_init(ctx, stk, func) == 0 
-	&& queue_enqueue(readyQ, (void*) thd) == 0)) {
-		preempt_enable();
-		if (thd) free(thd);
-		if (ctx) free(ctx);
-		if (stk) uthread_ctx_destroy_stack(stk);
+	if (!(thd
+	&& uthread_ctx_init(&thd->context, thd->stk_ptr,
+			    (char*)thd - (char*)thd->stk_ptr, func) == 0
+	&& slot_alloc(thd) == 0)) {
+		unlock();
+		if (thd) uthread_ctx_destroy_thread(thd);
 		return -1;
 	}
-	thd->tid = num_threads;
-	thd->context = ctx;
-	thd->stk_ptr = stk;
-	thd->thd_joined = -1;
+	thd->joiner = NULL;
+	thd->dead = 0;
+	thd->se.queued = 0;
+	thd->se.prio = attr->priority;
+	sched->setup(&thd->se);
+	uthread_t tid = thd->tid;
+	make_ready(thd);
 
 	num_threads++;
 
-	preempt_enable();
+	unlock();
 
-	return thd->tid;
+	return tid;
 }
 
 void uthread_yield(void)
 {
-	preempt_disable();
-	if(queue_length(readyQ) > 0) { //check if there is sth in readyQ
-		//replace current thread with another ready thread
-		uthread_ctx_t *prev = running->context;
-		queue_enqueue(readyQ, (void*) running);
-		queue_dequeue(readyQ, (void**) &running);
-		uthread_ctx_t *next = running->context;
-		uthread_ctx_switch(prev, next);
+	if (mn) {
+		worker_switch(worker_ready);
+		return;
 	}
+	preempt_disable();
+	//let sched pick between the current thread, the other ready ones and the
+	//sleepers that are due
+	struct uthread_data *prev = running;
+	wake_sleepers();
+	make_ready(running);
+	running = pick_ready();
+	if (running != prev) uthread_ctx_switch(&prev->context, &running->context);
 	preempt_enable();
 }
 
+void uthread_tick(void)
+{
+	preempt_disable();
+	sched->tick(&running->se);
+	uthread_yield();
+}
+
 uthread_t uthread_self(void)
 {
-	return (running -> tid);
+	return (current() -> tid);
+}
+
+int uthread_set_priority(uthread_t tid, int priority)
+{
+	if (priority < UTHREAD_PRIO_MIN || priority > UTHREAD_PRIO_MAX) return -1;
+
+	lock();
+	struct uthread_data *thd = find_thd_data(tid);
+	if (!thd || thd->dead) {
+		unlock();
+		return -1;
+	}
+	//requeue a ready thread at its new priority
+	int queued = thd->se.queued;
+	if (queued) sched->remove(&thd->se);
+	thd->se.prio = priority;
+	sched->setup(&thd->se);
+	if (queued) sched->enqueue(&thd->se);
+	unlock();
+
+	return 0;
+}
+
+int uthread_get_priority(uthread_t tid)
+{
+	lock();
+	struct uthread_data *thd = find_thd_data(tid);
+	int priority = thd && !thd->dead ? thd->se.prio : -1;
+	unlock();
+
+	return priority;
+}
+
+//classify thread as dead and unblock the thread joining with it
+static void set_dead(struct uthread_data *thd)
+{
+	thd->dead = 1;
+	iqueue_enqueue(&deadQ, &thd->se.link);
+	struct uthread_data *td = thd->joiner;
+	if (td) {
+		iqueue_delete(&blockedQ, &td->se.link);
+		make_ready(td);
+	}
+}
+
+//M:N: thd has left its stack for good
+static void exited(struct uthread_data *thd)
+{
+	lock();
+	set_dead(thd);
+	unlock();
+}
+
+//M:N: thd has left its stack, blocked with the lock held
+static void blocked(struct uthread_data *thd)
+{
+	(void)thd;
+	unlock();
+}
+
+uint64_t sleep_expire(void)
+{
+	if (atomic_load(&num_sleepers) && timer_now() >= atomic_load(&next_wakeup)) {
+		lock();
+		wake_sleepers();
+		unlock();
+	}
+
+	return atomic_load(&next_wakeup);
+}
+
+uint64_t sleep_next(void)
+{
+	return atomic_load(&next_wakeup);
+}
+
+//put thd in the timer wheel until deadline. the lock is held
+static void add_sleeper(struct uthread_data *thd, uint64_t deadline)
+{
+	timer_add(&wheel, &thd->timer, deadline);
+	atomic_fetch_add(&num_sleepers, 1);
+	uint64_t next = timer_next(&wheel);
+	if (next < atomic_load(&next_wakeup)) {
+		atomic_store(&next_wakeup, next);
+		//idle workers may be waiting for a later sleeper
+		if (mn) worker_notify();
+	}
+}
+
+void uthread_sleep_until(uint64_t deadline)
+{
+	if (deadline <= timer_now()) return;
+
+	if (mn) {
+		struct uthread_data *self = current();
+		lock();
+		add_sleeper(self, deadline);
+		worker_switch(blocked);
+		return;
+	}
+	preempt_disable();
+	struct uthread_data *prev = running;
+	add_sleeper(running, deadline);
+	running = next_ready();
+	//the sleeper may be the next thread itself, after idling
+	if (running != prev) uthread_ctx_switch(&prev->context, &running->context);
+	preempt_enable();
+}
+
+void uthread_sleep_ns(uint64_t ns)
+{
+	uint64_t now = timer_now();
+
+	uthread_sleep_until(ns < UINT64_MAX - now ? now + ns : UINT64_MAX);
 }
 
 void uthread_exit(int retval)
 {
+	if (mn) {
+		current()->ev = retval;
+		worker_switch(exited);
+	}
 	//running is constant with respect to context as long as it is not reassigned
 	running->ev = retval;
-	uthread_t tjoin = running->thd_joined;
-	uthread_ctx_t *prev = running->context;
+	uthread_ctx_t *prev = &running->context;
 	preempt_disable(); //entering critical zone where queues are modified
-	//classify thread as dead
-	queue_enqueue(deadQ, (void*) running);
-	//unblock thread to join with
-	struct uthread_data *td = NULL;
-	queue_iterate(blockedQ, (queue_func_t)find_thd_data, (void*)&tjoin, (void**)&td);
-	if (td) {
-		queue_delete(blockedQ, (void*) td);
-		queue_enqueue(readyQ, (void*) td);
-	}
+	set_dead(running);
 	//assign new running thread
-	queue_dequeue(readyQ, (void**) &running);
-	uthread_ctx_t *next = running->context;
+	running = next_ready();
+	uthread_ctx_t *next = &running->context;
 	uthread_ctx_switch(prev, next);
 	preempt_enable();
 }
 
+//free a dead thread once joined
+static void reap(struct uthread_data *thd)
+{
+	lock();
+	iqueue_delete(&deadQ, &thd->se.link);
+	slot_free(thd->tid);
+	num_threads--;
+	unlock();
+	uthread_ctx_destroy_thread(thd);
+}
+
 int uthread_join(uthread_t tid, int *retval)
 {
-	if (tid == 0 || tid == running->tid) return -1;
+	struct uthread_data *self = current();
+	if (tid == 0 || tid == self->tid) return -1;
 
- 	//check if tid dead already
-	struct uthread_data *target = NULL;
-	preempt_disable();
-	queue_iterate(deadQ, (queue_func_t)find_thd_data, (void*)&tid, (void**)&target);
-	if (target){	
-		//T2 dead
-		if (target->thd_joined != -1) return -1;
-		if (retval) *retval = target->ev;
-		queue_delete(deadQ, target);
-		preempt_enable();
-		uthread_ctx_destroy_stack(target->stk_ptr);
-		free(target->context);
-		free(target);
-		return 0;
+	lock();
+	struct uthread_data *target = find_thd_data(tid);
+	if (!target || target->joiner) {
+		unlock();
+		return -1;
 	}
-	//search for thread
-	queue_iterate(readyQ, (queue_func_t)find_thd_data, (void*)&tid, (void**)&target);
-	queue_iterate(blockedQ, (queue_func_t)find_thd_data, (void*)&tid, (void**)&target);
-	if (!target) return -1;
 
-	//T2 is in readyQ or blockedQ
-	target->thd_joined = running->tid;
+	if (!target->dead && mn) {
+		//T2 is ready, running or blocked, wait for it
+		target->joiner = self;
+		iqueue_enqueue(&blockedQ, &self->se.link);
+		worker_switch(blocked);
+		lock();
+	} else if (!target->dead) {
+		//T2 is ready or blocked, wait for it
+		target->joiner = running;
 
-	uthread_ctx_t *prev = running->context;
-	queue_enqueue(blockedQ, (void*) running);
-	queue_dequeue(readyQ, (void**) &running);
-	uthread_ctx_t *next = running->context;
-	uthread_ctx_switch(prev, next);
+		uthread_ctx_t *prev = &running->context;
+		iqueue_enqueue(&blockedQ, &running->se.link);
+		running = next_ready();
+		uthread_ctx_t *next = &running->context;
+		uthread_ctx_switch(prev, next);
+	}
 
 	//T2 is in deadQ
 	if (retval) *retval = target->ev;
-	queue_delete(deadQ, target);
-	
-	preempt_enable();
-	//free memory
-	uthread_ctx_destroy_stack(target->stk_ptr);
-	free(target->context);
-	free(target);
+	unlock();
+	reap(target);
 
 	return 0;
 }
-
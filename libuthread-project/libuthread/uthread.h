@@ -1,16 +1,20 @@
 #ifndef _UTHREAD_H
 #define _UTHREAD_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 /*
  * uthread_t - Thread identifier (TID) type
  *
- * Each user thread is assigned a different TID. TID are assigned in increasing
- * order and numbered starting from 1 (apart from the 'main' thread who
- * automatically gets TID #0). Overflowing the current TID value is considered a
- * case of failure (in other words, it is impossible to create more than
- * USHRT_MAX threads).
+ * Each user thread is assigned a different TID, never 0 (the 'main' thread
+ * automatically gets TID #0). TID are positive and fit in an int. The TID of a
+ * thread that has been joined can eventually be handed out again, but only
+ * after about 2,000 other threads have reused the same table slot, so a stale
+ * TID is detected rather than mistaken for a new thread. Up to about one
+ * million threads (2^20) can exist at the same time.
  */
-typedef unsigned short uthread_t;
+typedef unsigned int uthread_t;
 
 /*
  * uthread_func_t - Thread function type
@@ -32,6 +36,62 @@ typedef int (*uthread_func_t)(void);
  */
 int uthread_start(int preempt);
 
+/*
+ * enum uthread_sched - Scheduling policy
+ * @UTHREAD_SCHED_FIFO: Ready threads run in the order they became ready, each
+ *	until it yields, blocks or (with preemption) a timer tick. Priorities are
+ *	kept but ignored.
+ * @UTHREAD_SCHED_PRIO: Static priorities. The ready thread with the highest
+ *	priority runs, threads of equal priority taking turns as with
+ *	UTHREAD_SCHED_FIFO. Lower priorities only run when no higher one is ready.
+ * @UTHREAD_SCHED_MLFQ: Multilevel feedback queue. A thread starts at its
+ *	priority and runs as with UTHREAD_SCHED_PRIO, but is demoted by one level
+ *	each time a timer tick finds it running, that is each time it uses a
+ *	whole quantum: threads that yield or block often keep running ahead of
+ *	CPU-bound ones. Every second, every thread goes back to its priority so
+ *	that demoted threads do not starve. Without preemption, this is the same as
+ *	UTHREAD_SCHED_PRIO.
+ */
+enum uthread_sched {
+	UTHREAD_SCHED_FIFO,
+	UTHREAD_SCHED_PRIO,
+	UTHREAD_SCHED_MLFQ,
+};
+
+/*
+ * uthread_start_sched - Start the multithreading library with a policy
+ * @preempt: Preemption enable
+ * @policy: Scheduling policy
+ *
+ * Same as uthread_start(), which uses UTHREAD_SCHED_FIFO, with threads
+ * scheduled according to @policy.
+ *
+ * Return: 0 in case of success, -1 in case of failure (e.g., unknown @policy,
+ * memory allocation).
+ */
+int uthread_start_sched(int preempt, enum uthread_sched policy);
+
+/*
+ * uthread_start_workers - Start the multithreading library on several kernel
+ * threads
+ * @workers: Number of kernel threads to run threads on, the calling one
+ *	included. 0 for one per online processor.
+ *
+ * Same as uthread_start(), but threads run in parallel on @workers kernel
+ * threads (M:N threading). Each kernel thread runs the threads it has made
+ * ready in turn, and takes threads from the others when it has none left. The
+ * main thread always runs on the calling kernel thread.
+ *
+ * uthread_create(), uthread_yield(), uthread_join() and uthread_exit() behave
+ * as with uthread_start(), but threads now truly run at the same time: data
+ * they share must be protected as between kernel threads. There is no
+ * preemption, and priorities are kept but ignored.
+ *
+ * Return: 0 in case of success, -1 in case of failure (e.g., memory
+ * allocation, kernel thread creation).
+ */
+int uthread_start_workers(int workers);
+
 /*
  * uthread_stop - Stop the multithreading library
  *
@@ -55,6 +115,60 @@ int uthread_stop(void);
  */
 int uthread_create(uthread_func_t func);
 
+/* Default stack size of a thread (in bytes) */
+#define UTHREAD_STACK_DEFAULT 32768
+
+/* Smallest stack size a thread can be created with (in bytes) */
+#define UTHREAD_STACK_MIN 16384
+
+/* Priorities, the higher the more urgent */
+#define UTHREAD_PRIO_MIN 0
+#define UTHREAD_PRIO_MAX 31
+#define UTHREAD_PRIO_DEFAULT 16
+
+/*
+ * struct uthread_attr - Thread creation attributes
+ * @stack_size: Size of the thread's stack in bytes, at least UTHREAD_STACK_MIN
+ * @guard_size: Size of the inaccessible region below the stack in bytes, so
+ *	that overflowing the stack faults. 0 for no guard.
+ * @priority: Priority of the thread, between UTHREAD_PRIO_MIN and
+ *	UTHREAD_PRIO_MAX
+ *
+ * Sizes are rounded up to whole pages. Stacks are reserved without committing
+ * memory: only the pages a thread actually touches take room, so a large stack
+ * costs little more than a small one. A guard however takes a mapping of its
+ * own, and the kernel limits the number of mappings of a process (see
+ * vm.max_map_count): beyond a few tens of thousands of threads, create them
+ * without guards.
+ */
+struct uthread_attr {
+	size_t stack_size;
+	size_t guard_size;
+	int priority;
+};
+
+/*
+ * uthread_attr_init - Initialize thread creation attributes
+ * @attr: Attributes to initialize
+ *
+ * Set @attr to the attributes uthread_create() uses: a stack of
+ * UTHREAD_STACK_DEFAULT bytes, a guard of one page and a priority of
+ * UTHREAD_PRIO_DEFAULT.
+ */
+void uthread_attr_init(struct uthread_attr *attr);
+
+/*
+ * uthread_create_attr - Create a new thread with attributes
+ * @func: Function to be executed by the thread
+ * @attr: Attributes of the thread, NULL for the defaults
+ *
+ * Same as uthread_create(), with the thread's stack described by @attr.
+ *
+ * Return: -1 in case of failure (invalid attributes, memory allocation, context
+ * creation, TID overflow, etc.), or the TID of the new thread.
+ */
+int uthread_create_attr(uthread_func_t func, const struct uthread_attr *attr);
+
 /*
  * uthread_self - Get thread identifier
  *
@@ -62,6 +176,28 @@ int uthread_create(uthread_func_t func);
  */
 uthread_t uthread_self(void);
 
+/*
+ * uthread_set_priority - Set the priority of a thread
+ * @tid: TID of the thread
+ * @priority: New priority, between UTHREAD_PRIO_MIN and UTHREAD_PRIO_MAX
+ *
+ * Under UTHREAD_SCHED_MLFQ, this also puts the thread back at the level of
+ * @priority. The change is taken into account the next time a thread is
+ * picked to run: the calling thread is not preempted by it.
+ *
+ * Return: -1 if thread @tid cannot be found or @priority is out of range, 0
+ * otherwise.
+ */
+int uthread_set_priority(uthread_t tid, int priority);
+
+/*
+ * uthread_get_priority - Get the priority of a thread
+ * @tid: TID of the thread
+ *
+ * Return: -1 if thread @tid cannot be found, its priority otherwise.
+ */
+int uthread_get_priority(uthread_t tid);
+
 /*
  * uthread_yield - Yield execution
  *
@@ -70,6 +206,28 @@ uthread_t uthread_self(void);
  */
 void uthread_yield(void);
 
+/*
+ * uthread_sleep_ns - Sleep for a duration
+ * @ns: Duration in nanoseconds
+ *
+ * The calling thread is kept out of the ready queues until @ns nanoseconds
+ * have passed, while other threads run. When no thread is ready, the kernel
+ * thread blocks until the next sleeper is due, taking no processor time. A
+ * sleep can last longer than asked, by up to a microsecond (the resolution of
+ * the timers) plus the time it takes for the thread to be scheduled.
+ */
+void uthread_sleep_ns(uint64_t ns);
+
+/*
+ * uthread_sleep_until - Sleep until a point in time
+ * @deadline: Time of CLOCK_MONOTONIC, in nanoseconds
+ *
+ * Same as uthread_sleep_ns(), until @deadline. Returns at once if @deadline
+ * has passed. A periodic thread can sleep until its previous deadline plus its
+ * period, so that delays do not add up.
+ */
+void uthread_sleep_until(uint64_t deadline);
+
 /*
  * uthread_exit - Exit from currently running thread
  * @retval: Return value
@@ -0,0 +1,324 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "deque.h"
+#include "private.h"
+#include "uthread.h"
+
+/*
+ * Workers
+ *
+ * A worker takes the threads it runs from the top of its own deque, oldest
+ * first, so that yielding goes round robin as with a single kernel thread.
+ * When it is empty, the worker steals from the others, starting with a
+ * different one each time, and after STEAL_ROUNDS fruitless rounds it sleeps
+ * until a thread is made ready somewhere. Sleeping threads are made ready by
+ * whichever worker finds them due first; one idle worker, the timekeeper,
+ * waits until the next one is due rather than for threads only.
+ *
+ * Worker 0 is the kernel thread that started the library. The main thread
+ * runs on its original stack, so the scheduler of worker 0 gets a stack of its
+ * own, and only worker 0 runs the main thread: a worker that makes it ready,
+ * or steals it, hands it over to worker 0 through @main_mail.
+ */
+#define STEAL_ROUNDS 64
+#define CACHE_LINE 64
+
+struct worker {
+	_Alignas(CACHE_LINE) deque_t ready;
+	uthread_ctx_t ctx; //scheduler
+	struct uthread_data *running;
+	void (*after)(struct uthread_data *thd);
+	pthread_t pthread;
+	unsigned int seed; //for the choice of victims
+};
+
+static struct worker *workers;
+static int num_workers;
+static void *sched_stack; //of worker 0's scheduler
+
+static _Atomic(struct uthread_data *) main_mail;
+static atomic_int stopping;
+static atomic_int num_idle;
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t clock_cond; //on CLOCK_MONOTONIC, for the timekeeper
+static int timekeeper; //whether an idle worker waits on clock_cond
+
+static __thread struct worker *self;
+
+/*
+ * A thread may resume on another kernel thread after a switch, so the address
+ * of @self must not be kept across one: it is only read here, out of line and
+ * out of the compiler's sight.
+ */
+static __attribute__((noinline)) struct worker *this_worker(void)
+{
+	struct worker *w = self;
+
+	__asm__ volatile("" : "+r"(w));
+	return w;
+}
+
+/* Wake a sleeping worker, or all of them */
+static void wake(int all)
+{
+	/* Pairs with the sleeper counting itself before looking for work */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!atomic_load(&num_idle))
+		return;
+
+	pthread_mutex_lock(&idle_lock);
+	if (all) {
+		pthread_cond_broadcast(&idle_cond);
+		pthread_cond_broadcast(&clock_cond);
+	} else if (atomic_load(&num_idle) > timekeeper) {
+		pthread_cond_signal(&idle_cond);
+	} else {
+		pthread_cond_signal(&clock_cond);
+	}
+	pthread_mutex_unlock(&idle_lock);
+}
+
+void worker_notify(void)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!atomic_load(&num_idle))
+		return;
+
+	/* Wake the timekeeper, or make an idle worker the timekeeper */
+	pthread_mutex_lock(&idle_lock);
+	pthread_cond_signal(timekeeper ? &clock_cond : &idle_cond);
+	pthread_mutex_unlock(&idle_lock);
+}
+
+static void push(struct worker *w, struct uthread_data *thd)
+{
+	if (deque_push(w->ready, thd)) {
+		perror("deque_push");
+		exit(1);
+	}
+}
+
+static void mail_main(struct uthread_data *thd)
+{
+	atomic_store(&main_mail, thd);
+	wake(1);
+}
+
+void worker_ready(struct uthread_data *thd)
+{
+	struct worker *w = this_worker();
+
+	if (thd->tid == 0 && w != &workers[0]) {
+		mail_main(thd);
+		return;
+	}
+	push(w, thd);
+	wake(0);
+}
+
+static int work_visible(struct worker *w)
+{
+	if (w == &workers[0] && atomic_load(&main_mail))
+		return 1;
+	for (int i = 0; i < num_workers; i++)
+		if (deque_length(workers[i].ready) > 0)
+			return 1;
+	return 0;
+}
+
+static void sleep_idle(struct worker *w)
+{
+	uint64_t deadline;
+
+	pthread_mutex_lock(&idle_lock);
+	atomic_fetch_add(&num_idle, 1);
+	/* Pairs with worker_notify() after an earlier sleeper */
+	deadline = sleep_next();
+	if (atomic_load(&stopping) || work_visible(w)) {
+		/* Nothing to wait for */
+	} else if (deadline == UINT64_MAX || timekeeper) {
+		pthread_cond_wait(&idle_cond, &idle_lock);
+	} else if (deadline > timer_now()) {
+		struct timespec ts = {
+			.tv_sec = deadline / 1000000000,
+			.tv_nsec = deadline % 1000000000,
+		};
+
+		timekeeper = 1;
+		pthread_cond_timedwait(&clock_cond, &idle_lock, &ts);
+		timekeeper = 0;
+		/* Later sleepers may come due while this worker runs threads */
+		if (atomic_load(&num_idle) > 1)
+			pthread_cond_signal(&idle_cond);
+	}
+	atomic_fetch_sub(&num_idle, 1);
+	pthread_mutex_unlock(&idle_lock);
+}
+
+/* Next thread for @w to run, NULL once the workers are stopping */
+static struct uthread_data *find_work(struct worker *w)
+{
+	struct uthread_data *thd;
+
+	while (!atomic_load(&stopping)) {
+		for (int round = 0; round < STEAL_ROUNDS; round++) {
+			sleep_expire();
+			if (w == &workers[0]
+			    && (thd = atomic_exchange(&main_mail, NULL)))
+				push(w, thd);
+			if ((thd = deque_steal(w->ready)))
+				return thd;
+
+			w->seed = w->seed * 1103515245 + 12345;
+			int first = (w->seed >> 16) % num_workers;
+			for (int i = 0; i < num_workers; i++) {
+				struct worker *victim =
+					&workers[(first + i) % num_workers];
+
+				if (victim == w || !(thd = deque_steal(victim->ready)))
+					continue;
+				if (thd->tid == 0 && w != &workers[0]) {
+					mail_main(thd);
+					continue;
+				}
+				return thd;
+			}
+		}
+		sleep_idle(w);
+	}
+
+	return NULL;
+}
+
+static void run(struct worker *w)
+{
+	struct uthread_data *thd;
+
+	/* Worker 0's scheduler starts when the main thread first leaves */
+	if (w->running)
+		w->after(w->running);
+	while ((thd = find_work(w))) {
+		w->running = thd;
+		uthread_ctx_switch(&w->ctx, &thd->context);
+		/* Off the thread's stack: it can now be resumed anywhere */
+		w->after(w->running);
+	}
+}
+
+static void *worker_main(void *arg)
+{
+	self = arg;
+	run(self);
+	return NULL;
+}
+
+static int worker0_main(void)
+{
+	run(&workers[0]);
+	return 0;
+}
+
+struct uthread_data *worker_current(void)
+{
+	return this_worker()->running;
+}
+
+void worker_switch(void (*after)(struct uthread_data *thd))
+{
+	struct worker *w = this_worker();
+
+	w->after = after;
+	uthread_ctx_switch(&w->running->context, &w->ctx);
+}
+
+static void cleanup(int started)
+{
+	atomic_store(&stopping, 1);
+	pthread_mutex_lock(&idle_lock);
+	pthread_cond_broadcast(&idle_cond);
+	pthread_cond_broadcast(&clock_cond);
+	pthread_mutex_unlock(&idle_lock);
+	for (int i = 1; i < started; i++)
+		pthread_join(workers[i].pthread, NULL);
+
+	for (int i = 0; i < num_workers; i++)
+		if (workers[i].ready)
+			deque_destroy(workers[i].ready);
+	uthread_ctx_destroy_stack(sched_stack, UTHREAD_STACK_DEFAULT,
+				  (size_t)sysconf(_SC_PAGESIZE));
+	pthread_cond_destroy(&clock_cond);
+	free(workers);
+	workers = NULL;
+	sched_stack = NULL;
+	self = NULL;
+	num_workers = 0;
+}
+
+int worker_start(int count, struct uthread_data *main_thd)
+{
+	pthread_condattr_t attr;
+	int i;
+
+	if (count <= 0)
+		count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (count <= 0)
+		count = 1;
+
+	/* The timekeeper waits until a time of the sleepers' clock */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	i = pthread_cond_init(&clock_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if (i)
+		return -1;
+	timekeeper = 0;
+
+	workers = aligned_alloc(CACHE_LINE, count * sizeof(*workers));
+	if (!workers) {
+		pthread_cond_destroy(&clock_cond);
+		return -1;
+	}
+	num_workers = count;
+	atomic_store(&stopping, 0);
+	atomic_store(&num_idle, 0);
+	atomic_store(&main_mail, NULL);
+	for (i = 0; i < count; i++) {
+		workers[i].ready = deque_create();
+		workers[i].running = NULL;
+		workers[i].seed = i;
+	}
+	sched_stack = uthread_ctx_alloc_stack(UTHREAD_STACK_DEFAULT,
+					      (size_t)sysconf(_SC_PAGESIZE));
+	for (i = 0; i < count; i++)
+		if (!workers[i].ready)
+			break;
+	if (i < count || !sched_stack
+	    || uthread_ctx_init(&workers[0].ctx, sched_stack,
+				UTHREAD_STACK_DEFAULT, worker0_main)) {
+		cleanup(0);
+		return -1;
+	}
+
+	self = &workers[0];
+	workers[0].running = main_thd;
+	for (i = 1; i < count; i++)
+		if (pthread_create(&workers[i].pthread, NULL, worker_main,
+				   &workers[i])) {
+			cleanup(i);
+			return -1;
+		}
+
+	return 0;
+}
+
+void worker_stop(void)
+{
+	cleanup(num_workers);
+}